@@ -5,45 +5,67 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <errno.h>
+#include <signal.h>
 #include "common/utility.h"
 
 #include "net.h"
 #include "worker.h"
 #define DEFAULT_IP "127.0.0.1"
 #define DEFAULT_PORT 8080
+#define DEFAULT_WINDOW 16
 
 int server_socket;
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // stdout mutex
 pthread_mutex_t response_lock = PTHREAD_MUTEX_INITIALIZER; // manages the waiting for response flag
 pthread_cond_t response_cond = PTHREAD_COND_INITIALIZER; // cond to wake up threads 
 pthread_mutex_t bg_lock = PTHREAD_MUTEX_INITIALIZER; // lock for background operations 
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER; // whole frames to the server, commands and upload DATA interleave
 
 volatile int should_exit = 0;
-volatile int waiting_for_response = 0;
+volatile int inflight = 0; // foreground commands sent and not yet answered
+uint32_t inflight_ids[MAX_INFLIGHT];
+int max_inflight = 1;
+int inband_data = 0; // transfers as DATA frames on this connection instead of a data port each
 volatile int bg_ops_count = 0; // count to avoid early exit
 volatile int is_writing_content = 0;
 
 char global_server_ip[64]; 
 
 int main(int argc, char* argv[]) {
-    if (argc > 3) {
-        printf("Usage: %s [IP] [Port]\n", argv[0]);
-        return -1;
+    // typing waits for each answer, a script piped in keeps a window of commands in flight
+    max_inflight = isatty(STDIN_FILENO) ? 1 : DEFAULT_WINDOW;
+    char* positional[2] = { NULL, NULL };
+    int npositional = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--window=", 9) == 0) {
+            max_inflight = atoi(argv[i] + 9);
+            if (max_inflight < 1 || max_inflight > MAX_INFLIGHT) {
+                printf("--window must be between 1 and %d\n", MAX_INFLIGHT);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--inband") == 0) {
+            inband_data = 1;
+        } else if (npositional < 2) {
+            positional[npositional++] = argv[i];
+        } else {
+            printf("Usage: %s [IP] [Port] [--window=N] [--inband]\n", argv[0]);
+            return -1;
+        }
     }
     
     char* ip = DEFAULT_IP;
     int port = DEFAULT_PORT;
     
-    if (argc >= 2 && argv[1][0] != '\0') {
-        ip = argv[1];
+    if (npositional >= 1 && positional[0][0] != '\0') {
+        ip = positional[0];
         if (!validate_ipv4(ip)) {
             printf("> IP: %s not valid\n", ip);
             return -1;
         }
     }
 
-    if (argc >= 3 && argv[2][0] != '\0') {
-        port = atoi(argv[2]);
+    if (npositional >= 2 && positional[1][0] != '\0') {
+        port = atoi(positional[1]);
     }
     
     strncpy(global_server_ip, ip, sizeof(global_server_ip) - 1);
@@ -51,12 +73,22 @@ int main(int argc, char* argv[]) {
 
     server_socket = connectToServer(ip, port);
     if (server_socket == -1) return -1;
+    // a server shedding load closes right after its BUSY reply, a write then must fail, not kill us
+    signal(SIGPIPE, SIG_IGN);
 
     printf("[Client]> Successfully connected to server\n");
     
-    pthread_t read_thread, write_thread;
+    // every thread inherits the mask, Ctrl+C is taken by the interrupt thread alone
+    sigset_t sigint;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigint, NULL);
+
+    pthread_t read_thread, write_thread, interrupt_thread;
     pthread_create(&read_thread, NULL, readThreadFunc, NULL);
     pthread_create(&write_thread, NULL, writeThreadFunc, NULL);
+    pthread_create(&interrupt_thread, NULL, interruptThreadFunc, NULL);
+    pthread_detach(interrupt_thread);
     
     pthread_join(write_thread, NULL);
     pthread_cancel(read_thread); 
@@ -5,7 +5,13 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include "common/utility.h"
+#include "common/crc32c.h"
+#include "common/compress.h"
+#include "common/delta.h"
 #include "net.h"
 #include "worker.h"
 
@@ -14,18 +20,162 @@ extern pthread_mutex_t lock;
 extern pthread_mutex_t response_lock;
 extern pthread_cond_t response_cond;
 extern pthread_mutex_t bg_lock;
+extern pthread_mutex_t send_lock;
 
 extern volatile int should_exit;
-extern volatile int waiting_for_response;
+extern volatile int inflight;
+extern uint32_t inflight_ids[MAX_INFLIGHT];
+extern int max_inflight;
+extern int inband_data;
 extern volatile int bg_ops_count;
 extern volatile int is_writing_content;
 extern char global_server_ip[64];
 
 
+// threads still moving file data, a "concluded" reply only means the server sent everything
+static int data_threads = 0;
+static pthread_mutex_t data_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t data_threads_cond = PTHREAD_COND_INITIALIZER;
+
+static void beginDataThread(void) {
+    pthread_mutex_lock(&data_threads_lock);
+    data_threads++;
+    pthread_mutex_unlock(&data_threads_lock);
+}
+
+static void endDataThread(void) {
+    pthread_mutex_lock(&data_threads_lock);
+    if (--data_threads == 0) pthread_cond_broadcast(&data_threads_cond);
+    pthread_mutex_unlock(&data_threads_lock);
+}
+
+// before leaving, files still being written are finished
+static void waitDataThreads(void) {
+    pthread_mutex_lock(&data_threads_lock);
+    while (data_threads > 0) {
+        pthread_cond_wait(&data_threads_cond, &data_threads_lock);
+    }
+    pthread_mutex_unlock(&data_threads_lock);
+}
+
+#define MAX_CHECKS 64
+
+// end-to-end check of a single stream transfer: the data side posts the crc32c of what it wrote
+// or sent, the final reply brings the server's. The reader compares once both are in
+typedef struct {
+    uint32_t req_id;    // 0 for a free entry
+    int done;           // the data side is through
+    int threaded;       // a data thread posts it, the reader itself for an in-band download
+    int ok;             // and moved every byte
+    uint32_t crc;
+    int is_bg;
+    char path[256];
+} TransferCheck;
+
+static TransferCheck checks[MAX_CHECKS];
+static pthread_mutex_t checks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checks_cond = PTHREAD_COND_INITIALIZER;
+
+// checks_lock held
+static TransferCheck* findCheck(uint32_t req_id) {
+    for (int i = 0; i < MAX_CHECKS; i++) {
+        if (req_id != 0 && checks[i].req_id == req_id) {
+            return &checks[i];
+        }
+    }
+    return NULL;
+}
+
+// registered by the reader before the data side starts, a full table just goes unchecked
+static void expectCheck(uint32_t req_id, int is_bg, int threaded, const char* path) {
+    pthread_mutex_lock(&checks_lock);
+    TransferCheck* c = findCheck(req_id);
+    for (int i = 0; i < MAX_CHECKS && !c && req_id != 0; i++) {
+        if (checks[i].req_id == 0) c = &checks[i];
+    }
+    if (c) {
+        memset(c, 0, sizeof(*c));
+        c->req_id = req_id;
+        c->is_bg = is_bg;
+        c->threaded = threaded;
+        snprintf(c->path, sizeof(c->path), "%s", path);
+    }
+    pthread_mutex_unlock(&checks_lock);
+}
+
+static void postCheck(uint32_t req_id, int ok, uint32_t crc) {
+    pthread_mutex_lock(&checks_lock);
+    TransferCheck* c = findCheck(req_id);
+    if (c) {
+        c->done = 1;
+        c->ok = ok;
+        c->crc = crc;
+        pthread_cond_broadcast(&checks_cond);
+    }
+    pthread_mutex_unlock(&checks_lock);
+}
+
+// the final reply of req_id, after its data side is through. 1 with the error to show when the
+// server reports another checksum than ours. Called without the stdout lock, the data side may
+// need it to report its own errors
+static int settleCheck(uint32_t req_id, const char* reply, char* what, size_t len, char* path, size_t path_len, int* is_bg) {
+    pthread_mutex_lock(&checks_lock);
+    TransferCheck* c = findCheck(req_id);
+    while (c && !c->done && c->threaded) {
+        pthread_cond_wait(&checks_cond, &checks_lock);
+        c = findCheck(req_id);
+    }
+    int mismatch = 0;
+    if (c) {
+        const char* p = strstr(reply, "crc32c ");
+        unsigned int theirs;
+        // a data side that failed has already said so
+        if (c->done && c->ok && p && sscanf(p + 7, "%x", &theirs) == 1 && theirs != c->crc) {
+            snprintf(what, len, "Checksum mismatch (ours %08x, the server's %08x), the transfer failed:", c->crc, theirs);
+            snprintf(path, path_len, "%s", c->path);
+            *is_bg = c->is_bg;
+            mismatch = 1;
+        }
+        c->req_id = 0;
+    }
+    pthread_mutex_unlock(&checks_lock);
+    return mismatch;
+}
+
+// where a resumed upload goes on: the server's size when its bytes are a prefix of ours, else 0
+static uint64_t resumeFrom(FILE* fp, const resume_info* remote) {
+    struct stat st;
+    int fd = fileno(fp);
+    if (remote->size == 0 || fstat(fd, &st) < 0 || (uint64_t)st.st_size < remote->size) {
+        return 0;
+    }
+    off_t tail = remote->size < RESUME_TAIL ? (off_t)remote->size : RESUME_TAIL;
+    uint32_t crc;
+    if (crc32cRange(fd, remote->size - tail, tail, &crc) < 0 || crc != remote->tail_crc) {
+        return 0;
+    }
+    return remote->size;
+}
+
+// a resumed download keeps the bytes before start and drops whatever followed them
+static FILE* openDownloadTarget(const char* path, int resume, uint64_t start) {
+    int fd = open(path, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (resume && (ftruncate(fd, start) < 0 || lseek(fd, start, SEEK_SET) < 0)) {
+        close(fd);
+        return NULL;
+    }
+    return fdopen(fd, "wb");
+}
+
 void* backgroundUploadFunc(void* arg) {
     bg_download_args* args = (bg_download_args*)arg;
     int data_socket = -1;
     FILE *fp = NULL;
+    uint32_t crc = 0;
+    int sent_all = 0;
     
     data_socket = connectToServer(global_server_ip, args->port);
     if (data_socket < 0) {
@@ -54,31 +204,65 @@ void* backgroundUploadFunc(void* arg) {
         goto cleanup;
     }
 
+    uint64_t from = 0;
+    if (args->resume) {
+        resume_info remote;
+        if (readAll(data_socket, &remote, sizeof(remote)) != sizeof(remote)) {
+            goto cleanup; // the server already reported why
+        }
+        from = resumeFrom(fp, &remote);
+        if (writeAll(data_socket, &from, sizeof(from)) < 0 || fseeko(fp, from, SEEK_SET) < 0) {
+            goto cleanup;
+        }
+    }
+    // -z: we hold the file, so we sample it and tell the server which way it comes
+    int packed = 0;
+    struct stat st;
+    if (args->compress) {
+        packed = fstat(fileno(fp), &st) == 0 && worthCompressing(fileno(fp), from, st.st_size);
+        char codec = packed ? STREAM_PACKED : STREAM_PLAIN;
+        if (writeAll(data_socket, &codec, 1) < 0) {
+            goto cleanup;
+        }
+    }
+
     char buf[16384];
     size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
-        if (writeAll(data_socket, buf, (ssize_t)n) < 0) {
-            pthread_mutex_lock(&lock);
-            if (args->is_bg) {
-                fprintf(stderr, "\r\033[K[Error]> Upload: Network write failed\n[Client]> Enter command: ");
-            } else {
-                fprintf(stderr, "[Error]> Upload: Network write failed\n");
-            }
-            fflush(stderr);
-            pthread_mutex_unlock(&lock);
-            break;
+    if (args->delta) {
+        // the server's block signatures come first, only what matches none of them goes out
+        sent_all = sendDelta(data_socket, fileno(fp), &crc) == 0;
+    } else if (packed) {
+        sent_all = deflateRange(data_socket, fileno(fp), from, st.st_size, &crc) == 0;
+    } else {
+        sent_all = 1;
+        while (sent_all && (n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            sent_all = writeAll(data_socket, buf, (ssize_t)n) >= 0;
+            crc = crc32c(crc, buf, n);
+        }
+        sent_all = sent_all && !ferror(fp);
+    }
+    if (!sent_all) {
+        pthread_mutex_lock(&lock);
+        if (args->is_bg) {
+            fprintf(stderr, "\r\033[K[Error]> Upload: Network write failed\n[Client]> Enter command: ");
+        } else {
+            fprintf(stderr, "[Error]> Upload: Network write failed\n");
         }
+        fflush(stderr);
+        pthread_mutex_unlock(&lock);
     }
 
 cleanup:
     if (fp) fclose(fp);
     if (data_socket >= 0) close(data_socket);
+    postCheck(args->req_id, sent_all, crc);
 
     pthread_mutex_lock(&bg_lock);
     if (bg_ops_count > 0) bg_ops_count--;
     pthread_mutex_unlock(&bg_lock);
     
     free(args);
+    endDataThread();
     return NULL;
 }
 
@@ -86,6 +270,8 @@ void* backgroundDownloadFunc(void* arg) {
     bg_download_args* args = (bg_download_args*)arg;
     int data_socket = -1;
     FILE *fp = NULL;
+    uint32_t crc = 0;
+    int complete = 0;
     
     data_socket = connectToServer(global_server_ip, args->port);
     if (data_socket < 0) {
@@ -100,7 +286,17 @@ void* backgroundDownloadFunc(void* arg) {
         goto cleanup;
     }
 
-    fp = fopen(args->dest_path, "wb");
+    // a ranged stream starts with the offset the server sends from, a -z one then with its codec.
+    // The file is only touched after them
+    uint64_t start = 0;
+    if (args->resume && readAll(data_socket, &start, sizeof(start)) != sizeof(start)) {
+        goto cleanup;
+    }
+    char codec = STREAM_PLAIN;
+    if (args->compress && readAll(data_socket, &codec, 1) != 1) {
+        goto cleanup;
+    }
+    fp = openDownloadTarget(args->dest_path, args->resume, start);
     if (!fp) {
         pthread_mutex_lock(&lock);
         if (args->is_bg) {
@@ -114,8 +310,11 @@ void* backgroundDownloadFunc(void* arg) {
     }
 
     char buf[16384];
-    ssize_t n;
-    while ((n = read(data_socket, buf, sizeof(buf))) > 0) {
+    ssize_t n = 0;
+    if (codec == STREAM_PACKED && inflateStream(data_socket, fileno(fp), &crc) < 0) {
+        n = -1; // a stream cut short or a disk that refused it, the file is incomplete either way
+    }
+    while (codec != STREAM_PACKED && (n = read(data_socket, buf, sizeof(buf))) > 0) {
         size_t written = fwrite(buf, 1, n, fp);
         if (written < (size_t)n) {
             pthread_mutex_lock(&lock);
@@ -128,7 +327,9 @@ void* backgroundDownloadFunc(void* arg) {
             pthread_mutex_unlock(&lock);
             break; 
         }
+        crc = crc32c(crc, buf, n);
     }
+    complete = n == 0;
 
     if (n < 0) {
         pthread_mutex_lock(&lock);
@@ -142,24 +343,621 @@ void* backgroundDownloadFunc(void* arg) {
     }
 
 cleanup:
-    if (fp) fclose(fp);
+    // fclose flushes, only after it is the file really what we checksummed
+    if (fp && fclose(fp) != 0) complete = 0;
     if (data_socket >= 0) close(data_socket);
+    postCheck(args->req_id, complete, crc);
 
     pthread_mutex_lock(&bg_lock);
     if (bg_ops_count > 0) bg_ops_count--;
     pthread_mutex_unlock(&bg_lock);
     
     free(args);
+    endDataThread();
     return NULL;
 }
 
+// stdout lock held, as in the reader's reply handling
+static void printStreamError(int is_bg, const char* what, const char* path) {
+    if (is_bg) {
+        fprintf(stderr, "\r\033[K[Error]> %s '%s'\n[Client]> Enter command: ", what, path);
+    } else {
+        fprintf(stderr, "[Error]> %s '%s'\n", what, path);
+    }
+    fflush(stderr);
+}
+
+static void reportStreamError(int is_bg, const char* what, const char* path) {
+    pthread_mutex_lock(&lock);
+    printStreamError(is_bg, what, path);
+    pthread_mutex_unlock(&lock);
+}
+
+// download -p N: N connections to the one data port, each bringing a slice of the file
+typedef struct {
+    pthread_mutex_t mu;
+    int fd;             // target, created and preallocated by the first slice to arrive
+    int opened;
+    int remaining;      // connections still running, the last one wraps up
+    int failed;
+    int is_bg;
+    int port;
+    char dest_path[256];
+} ParallelDownload;
+
+static int pwriteAll(int fd, const char* buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+// the first header tells the size, the whole file is laid out before any slice lands in it
+static int rangeTarget(ParallelDownload* pd, uint64_t size) {
+    pthread_mutex_lock(&pd->mu);
+    if (!pd->opened) {
+        pd->opened = 1;
+        pd->fd = open(pd->dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (pd->fd < 0) {
+            reportStreamError(pd->is_bg, "Download: Cannot create", pd->dest_path);
+        } else if (posix_fallocate(pd->fd, 0, size) != 0 && ftruncate(pd->fd, size) < 0) {
+            pd->failed = 1;
+        }
+    }
+    int fd = pd->failed ? -1 : pd->fd;
+    pthread_mutex_unlock(&pd->mu);
+    return fd;
+}
+
+static void* rangeStreamFunc(void* arg) {
+    ParallelDownload* pd = (ParallelDownload*)arg;
+    int ok = 0;
+    // connect even when another stream failed, the server waits for all of them before it reports
+    int data_socket = connectToServer(global_server_ip, pd->port);
+    range_header range;
+    if (data_socket >= 0 && readAll(data_socket, &range, sizeof(range)) == sizeof(range)) {
+        int fd = rangeTarget(pd, range.size);
+        char buf[16384];
+        uint64_t got = 0;
+        uint32_t crc = 0, sent_crc;
+        ssize_t n;
+        ok = fd >= 0;
+        // the slice is followed by its CRC32C, nothing past the slice is read as data
+        while (ok && got < range.length) {
+            size_t want = range.length - got < sizeof(buf) ? range.length - got : sizeof(buf);
+            if ((n = read(data_socket, buf, want)) <= 0) break;
+            ok = pwriteAll(fd, buf, n, range.offset + got) == 0;
+            crc = crc32c(crc, buf, n);
+            got += n;
+        }
+        ok = ok && got == range.length &&
+             readAll(data_socket, &sent_crc, sizeof(sent_crc)) == sizeof(sent_crc) && sent_crc == crc;
+    }
+    if (data_socket >= 0) close(data_socket);
+
+    pthread_mutex_lock(&pd->mu);
+    if (!ok) pd->failed = 1;
+    int last = --pd->remaining == 0;
+    pthread_mutex_unlock(&pd->mu);
+    if (last) {
+        // no header at all means the server refused, its reply says why
+        if (pd->fd >= 0) {
+            close(pd->fd);
+            if (pd->failed) {
+                reportStreamError(pd->is_bg, "Download: a stream broke off or failed its checksum, incomplete", pd->dest_path);
+            }
+        }
+        pthread_mutex_lock(&bg_lock);
+        if (bg_ops_count > 0) bg_ops_count--;
+        pthread_mutex_unlock(&bg_lock);
+        pthread_mutex_destroy(&pd->mu);
+        free(pd);
+        endDataThread();
+    }
+    return NULL;
+}
+
+static void startParallelDownload(bg_download_args* args) {
+    ParallelDownload* pd = calloc(1, sizeof(ParallelDownload));
+    pthread_mutex_init(&pd->mu, NULL);
+    pd->fd = -1;
+    pd->is_bg = args->is_bg;
+    pd->port = args->port;
+    pd->remaining = args->streams;
+    snprintf(pd->dest_path, sizeof(pd->dest_path), "%s", args->dest_path);
+    int streams = args->streams;
+    free(args);
+    beginDataThread(); // the download counts once, whatever its number of streams
+    for (int i = 0; i < streams; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, rangeStreamFunc, pd);
+        pthread_detach(tid);
+    }
+}
+
+// upload -p N: the same slicing the other way round, each connection ends its slice with a CRC32C
+typedef struct {
+    pthread_mutex_t mu;
+    int fd;             // -1 when the file cannot be read, the connections then close right away
+    uint64_t size;
+    int streams;
+    int next;           // slice handed to the next connection
+    int remaining;
+    int failed;
+    int is_bg;
+    int port;
+    char src_path[256];
+} ParallelUpload;
+
+static int sendRange(int data_socket, ParallelUpload* pu, int index) {
+    uint64_t slice = (pu->size + pu->streams - 1) / pu->streams;
+    range_header range = { .size = pu->size };
+    range.offset = (uint64_t)index * slice < pu->size ? (uint64_t)index * slice : pu->size;
+    range.length = range.offset + slice < pu->size ? slice : pu->size - range.offset;
+    if (writeAll(data_socket, &range, sizeof(range)) < 0) return -1;
+    char buf[16384];
+    uint32_t crc = 0;
+    uint64_t sent = 0;
+    while (sent < range.length) {
+        size_t want = range.length - sent < sizeof(buf) ? range.length - sent : sizeof(buf);
+        ssize_t n = pread(pu->fd, buf, want, range.offset + sent);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || writeAll(data_socket, buf, n) < 0) return -1;
+        crc = crc32c(crc, buf, n);
+        sent += n;
+    }
+    return writeAll(data_socket, &crc, sizeof(crc)) < 0 ? -1 : 0;
+}
+
+static void* rangeUploadFunc(void* arg) {
+    ParallelUpload* pu = (ParallelUpload*)arg;
+    pthread_mutex_lock(&pu->mu);
+    int index = pu->next++;
+    pthread_mutex_unlock(&pu->mu);
+    // a connection without a header tells the server the upload is off, it drops the part file
+    int data_socket = connectToServer(global_server_ip, pu->port);
+    int ok = data_socket >= 0 && pu->fd >= 0 && sendRange(data_socket, pu, index) == 0;
+    if (data_socket >= 0) close(data_socket);
+
+    pthread_mutex_lock(&pu->mu);
+    if (!ok) pu->failed = 1;
+    int last = --pu->remaining == 0;
+    pthread_mutex_unlock(&pu->mu);
+    if (last) {
+        if (pu->fd >= 0) {
+            close(pu->fd);
+            if (pu->failed) {
+                reportStreamError(pu->is_bg, "Upload: a stream broke off while sending", pu->src_path);
+            }
+        }
+        pthread_mutex_lock(&bg_lock);
+        if (bg_ops_count > 0) bg_ops_count--;
+        pthread_mutex_unlock(&bg_lock);
+        pthread_mutex_destroy(&pu->mu);
+        free(pu);
+        endDataThread();
+    }
+    return NULL;
+}
+
+// stdout lock held by the reader
+static void startParallelUpload(bg_download_args* args) {
+    ParallelUpload* pu = calloc(1, sizeof(ParallelUpload));
+    pthread_mutex_init(&pu->mu, NULL);
+    pu->is_bg = args->is_bg;
+    pu->port = args->port;
+    pu->streams = args->streams;
+    pu->remaining = args->streams;
+    snprintf(pu->src_path, sizeof(pu->src_path), "%s", args->dest_path);
+    free(args);
+    struct stat st;
+    pu->fd = open(pu->src_path, O_RDONLY);
+    if (pu->fd >= 0 && fstat(pu->fd, &st) == 0) {
+        pu->size = st.st_size;
+    } else {
+        printStreamError(pu->is_bg, "Upload: Cannot open", pu->src_path);
+        if (pu->fd >= 0) close(pu->fd);
+        pu->fd = -1;
+    }
+    beginDataThread();
+    int streams = pu->streams;
+    for (int i = 0; i < streams; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, rangeUploadFunc, pu);
+        pthread_detach(tid);
+    }
+}
+
+#define MAX_STREAMS 64
+
+// in-band transfer waiting for its final reply, a download writes the DATA frames of its id to fp
+typedef struct {
+    uint32_t req_id;    // 0 for a free entry
+    int is_bg;
+    int is_upload;
+    int streaming;      // the server announced the stream
+    FILE* fp;
+    uint32_t crc;       // of what a download wrote so far
+    char path[256];
+} InbandTransfer;
+
+static InbandTransfer transfers[MAX_STREAMS];
+static pthread_mutex_t transfers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// registered before the command leaves, -1 when full and the transfer takes a data port instead
+static int trackTransfer(uint32_t req_id, int is_bg, int is_upload) {
+    int ret = -1;
+    pthread_mutex_lock(&transfers_lock);
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        if (transfers[i].req_id == 0) {
+            memset(&transfers[i], 0, sizeof(transfers[i]));
+            transfers[i].req_id = req_id;
+            transfers[i].is_bg = is_bg;
+            transfers[i].is_upload = is_upload;
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&transfers_lock);
+    return ret;
+}
+
+// transfers_lock held
+static InbandTransfer* findTransfer(uint32_t req_id) {
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        if (req_id != 0 && transfers[i].req_id == req_id) {
+            return &transfers[i];
+        }
+    }
+    return NULL;
+}
+
+// "DATA_STREAM <path> [<start>]", a start only comes with a ranged download. Stdout lock held
+static void openDownloadStream(uint32_t req_id, const char* info) {
+    char path[256];
+    unsigned long long start = 0;
+    int n = sscanf(info, "%255s %llu", path, &start);
+    if (n < 1) return;
+    pthread_mutex_lock(&transfers_lock);
+    InbandTransfer* t = findTransfer(req_id);
+    if (t) {
+        snprintf(t->path, sizeof(t->path), "%s", path);
+        t->streaming = 1;
+        t->fp = openDownloadTarget(path, n == 2, start);
+        if (!t->fp) {
+            printStreamError(t->is_bg, "Download: Cannot create", path);
+        }
+        expectCheck(req_id, t->is_bg, 0, path);
+    }
+    pthread_mutex_unlock(&transfers_lock);
+}
+
+static void markStreaming(uint32_t req_id) {
+    pthread_mutex_lock(&transfers_lock);
+    InbandTransfer* t = findTransfer(req_id);
+    if (t) t->streaming = 1;
+    pthread_mutex_unlock(&transfers_lock);
+}
+
+// one DATA frame, the empty one closing the stream. A file we cannot write just drops the rest
+static void feedDownloadStream(uint32_t req_id, const char* buf, size_t len) {
+    pthread_mutex_lock(&transfers_lock);
+    InbandTransfer* t = findTransfer(req_id);
+    if (t && t->fp) {
+        if (len > 0 && fwrite(buf, 1, len, t->fp) < len) {
+            reportStreamError(t->is_bg, "Disk write error on", t->path);
+            fclose(t->fp);
+            t->fp = NULL;
+            postCheck(req_id, 0, 0);
+        } else if (len > 0) {
+            t->crc = crc32c(t->crc, buf, len);
+        } else {
+            int ok = fclose(t->fp) == 0;
+            t->fp = NULL;
+            postCheck(req_id, ok, t->crc);
+        }
+    } else if (t && len == 0) {
+        postCheck(req_id, 0, 0);
+    }
+    pthread_mutex_unlock(&transfers_lock);
+}
+
+// the final reply of an in-band transfer, sent once all of its data went through
+static void finishTransfer(uint32_t req_id, int refused) {
+    pthread_mutex_lock(&transfers_lock);
+    InbandTransfer* t = findTransfer(req_id);
+    if (t) {
+        if (t->fp) fclose(t->fp);
+        if (t->is_upload && !t->streaming) {
+            // a resumed upload failing before its announcement, the server still holds the stream open
+            msg_header done = { .type = DATA, .req_id = req_id };
+            stampHeader(&done);
+            pthread_mutex_lock(&send_lock);
+            writeAll(server_socket, &done, sizeof(done));
+            pthread_mutex_unlock(&send_lock);
+        }
+        if (t->is_bg && !refused) {
+            pthread_mutex_lock(&bg_lock);
+            if (bg_ops_count > 0) bg_ops_count--;
+            pthread_mutex_unlock(&bg_lock);
+        }
+        t->req_id = 0;
+        t->fp = NULL;
+    }
+    pthread_mutex_unlock(&transfers_lock);
+}
+
+// the file goes out as DATA frames tagged with the upload's id, between the frames of everything
+// else the client sends. The empty closing frame is sent even when reading fails
+void* streamUploadFunc(void* arg) {
+    bg_download_args* args = (bg_download_args*)arg;
+    FILE* fp = fopen(args->dest_path, "rb");
+    if (!fp) {
+        char what[320];
+        snprintf(what, sizeof(what), "Upload: Cannot open (%s)", strerror(errno));
+        reportStreamError(args->is_bg, what, args->dest_path);
+    }
+
+    char* buf = malloc(DATA_CHUNK);
+    msg_header data = { .type = DATA, .req_id = args->req_id, .is_background = (uint8_t)args->is_bg };
+    stampHeader(&data);
+    int ok = 1;
+    size_t n;
+    uint32_t crc = 0;
+    uint64_t from = 0;
+    if (args->resume) {
+        // the first frame says where the data starts, an unreadable file starts over at 0
+        from = fp ? resumeFrom(fp, &args->remote) : 0;
+        if (fp && fseeko(fp, from, SEEK_SET) < 0) from = 0;
+        data.payloadLength = sizeof(from);
+        pthread_mutex_lock(&send_lock);
+        ok = writeAll(server_socket, &data, sizeof(data)) >= 0 && writeAll(server_socket, &from, sizeof(from)) >= 0;
+        pthread_mutex_unlock(&send_lock);
+    }
+    // -z: frames are packed one by one, those that do not shrink go out as they are
+    struct stat st;
+    char* zbuf = NULL;
+    if (args->compress && fp && fstat(fileno(fp), &st) == 0 && worthCompressing(fileno(fp), from, st.st_size)) {
+        zbuf = malloc(DATA_CHUNK);
+    }
+    while (ok && fp && buf && (n = fread(buf, 1, DATA_CHUNK, fp)) > 0) {
+        ssize_t z = zbuf ? packChunk(buf, n, zbuf, DATA_CHUNK) : -1;
+        data.status = z > 0 ? (uint32_t)n : 0;
+        data.payloadLength = z > 0 ? (uint64_t)z : (uint64_t)n;
+        pthread_mutex_lock(&send_lock);
+        ok = writeAll(server_socket, &data, sizeof(data)) >= 0 &&
+             writeAll(server_socket, z > 0 ? zbuf : buf, data.payloadLength) >= 0;
+        pthread_mutex_unlock(&send_lock);
+        crc = crc32c(crc, buf, n);
+    }
+    data.status = 0;
+    data.payloadLength = 0;
+    pthread_mutex_lock(&send_lock);
+    if (ok && writeAll(server_socket, &data, sizeof(data)) < 0) ok = 0;
+    pthread_mutex_unlock(&send_lock);
+    if (!ok) {
+        reportStreamError(args->is_bg, "Upload: Network write failed for", args->dest_path);
+    }
+    postCheck(args->req_id, ok && fp && !ferror(fp), crc);
+
+    if (fp) fclose(fp);
+    free(buf);
+    free(zbuf);
+    free(args);
+    endDataThread();
+    return NULL;
+}
+
+// response_lock held. A final reply retires the command carrying the same id
+static int retireRequest(uint32_t req_id) {
+    for (int i = 0; i < inflight; i++) {
+        if (inflight_ids[i] == req_id) {
+            memmove(&inflight_ids[i], &inflight_ids[i + 1], (inflight - i - 1) * sizeof(uint32_t));
+            inflight--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// blocks until at most limit commands are waiting for their reply
+static void waitInflight(int limit) {
+    pthread_mutex_lock(&response_lock);
+    while (inflight > limit && !should_exit) {
+        pthread_cond_wait(&response_cond, &response_lock);
+    }
+    pthread_mutex_unlock(&response_lock);
+}
+
+// with several commands in flight the id tells which one a reply belongs to
+static void printTag(const char* who, uint32_t req_id) {
+    if (max_inflight > 1 && req_id != 0) {
+        printf("[%s #%u]> ", who, req_id);
+    } else {
+        printf("[%s]> ", who);
+    }
+}
+
+// the read whose chunks are being printed, the one Ctrl+C stops. Written under the stdout lock
+static volatile uint32_t read_stream = 0;
+static volatile uint32_t read_cancelled = 0;
+
+// a foreground reply as the user sees it, lock held
+static void printReply(uint32_t type, uint32_t req_id, const char* buf, size_t len) {
+    if (type == TEXT) {
+        printTag("Server", req_id);
+        printf("%.*s\n", (int)len, buf);
+    } else if (type == LSRES) {
+        int num_entries = len / sizeof(FileEntry);
+        const FileEntry *entries = (const FileEntry *)buf;
+        for (int i = 0; i < num_entries; i++) {
+            printf("%-11s %-20s %10ld bytes\n", 
+                entries[i].perms, entries[i].name, (long)entries[i].size);
+        }
+    } else if (type == READCMD) {
+        // one chunk of a read, the empty one closes it
+        if (len > 0) {
+            if (read_stream != req_id) {
+                printTag("Server", req_id);
+                printf("Content:\n");
+                read_stream = req_id;
+            }
+            fwrite(buf, 1, len, stdout);
+        } else if (read_stream == req_id) {
+            printf("\n");
+            if (read_cancelled == req_id) {
+                printf("[Client]> Read stopped\n");
+                read_cancelled = 0;
+            }
+            read_stream = 0;
+        }
+    }
+}
+
+// unpacks a BATCHRES, every reply is prefixed with the line number of its command
+static void printBatch(uint32_t req_id, const char* buf, size_t len) {
+    batch_summary summary;
+    if (len < sizeof(summary)) {
+        printf("[Error]> Malformed batch response\n");
+        return;
+    }
+    memcpy(&summary, buf, sizeof(summary));
+    size_t off = sizeof(summary);
+    while (off + sizeof(batch_record) <= len) {
+        batch_record rec;
+        memcpy(&rec, buf + off, sizeof(rec));
+        off += sizeof(rec);
+        if (rec.length > len - off) break;
+        // the chunks after the first of a read carry on where it stopped
+        if (rec.type != READCMD || read_stream != req_id) {
+            printf("(%u)%s", rec.index + 1, rec.type == LSRES ? "\n" : " ");
+        }
+        printReply(rec.type, req_id, buf + off, rec.length);
+        off += rec.length;
+    }
+    printTag("Server", req_id);
+    printf("Batch: %u of %u commands run, %u failed\n", summary.run, summary.total, summary.failed);
+}
+
+// "batch <file> [-e]": one command per line, -e stops at the first failing one
+static char* loadBatch(const char* command, uint64_t* len, uint32_t* flags) {
+    char path[256];
+    char opt[8] = "";
+    if (sscanf(command, "batch %255s %7s", path, opt) < 1) {
+        printf("[Client]> Usage: batch <file> [-e]\n");
+        return NULL;
+    }
+    *flags = (strcmp(opt, "-e") == 0) ? BATCH_STOP_ON_ERROR : 0;
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        printf("[Error]> Batch: Cannot open '%s' (%s)\n", path, strerror(errno));
+        return NULL;
+    }
+    char* payload = NULL;
+    size_t used = 0;
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &line_cap, fp)) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        size_t l = strlen(line);
+        if (l == 0) continue;
+        char* p = realloc(payload, used + l + 1);
+        if (!p) break;
+        payload = p;
+        memcpy(payload + used, line, l + 1);
+        used += l + 1;
+    }
+    free(line);
+    fclose(fp);
+    if (!payload) {
+        printf("[Client]> Batch: '%s' holds no commands\n", path);
+        return NULL;
+    }
+    *len = used;
+    return payload;
+}
+
+// download ... -r: the server gets -range=<our size>:0:<crc32c of our tail> and sends the rest,
+// or the whole file when our copy is not a prefix of its own
+static void expandResume(char* command, size_t cap) {
+    char copy[256];
+    char* tok[MAXARGS + 1];
+    int n = 0, resume = 0;
+    snprintf(copy, sizeof(copy), "%s", command);
+    for (char* t = strtok(copy, " "); t && n <= MAXARGS; t = strtok(NULL, " ")) {
+        if (strcmp(t, "-r") == 0) {
+            resume = 1;
+        } else {
+            tok[n++] = t;
+        }
+    }
+    if (!resume || n < 3) {
+        return;
+    }
+    char range[64] = "";
+    int fd = open(tok[2], O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        off_t tail = st.st_size < RESUME_TAIL ? st.st_size : RESUME_TAIL;
+        uint32_t crc;
+        if (crc32cRange(fd, st.st_size - tail, tail, &crc) == 0) {
+            snprintf(range, sizeof(range), " -range=%lld:0:%08x", (long long)st.st_size, crc);
+        }
+    }
+    if (fd >= 0) close(fd);
+    // nothing usable locally, a plain download it is
+    size_t len = snprintf(command, cap, "%s %s %s%s", tok[0], tok[1], tok[2], range);
+    for (int i = 3; i < n && len < cap; i++) {
+        len += snprintf(command + len, cap - len, " %s", tok[i]);
+    }
+}
+
+// "DATA_PORT <port> <path>" and the flags of the stream: -r, -z, -d or -p N
+static int parseDataPort(const char* reply, bg_download_args* args) {
+    char copy[PAYLOAD];
+    char* save;
+    snprintf(copy, sizeof(copy), "%s", reply);
+    char* tok = strtok_r(copy, " ", &save);
+    char* port = strtok_r(NULL, " ", &save);
+    char* path = strtok_r(NULL, " ", &save);
+    if (!tok || strcmp(tok, "DATA_PORT") != 0 || !port || !path) {
+        return -1;
+    }
+    args->port = atoi(port);
+    snprintf(args->dest_path, sizeof(args->dest_path), "%s", path);
+    while ((tok = strtok_r(NULL, " ", &save))) {
+        if (strcmp(tok, "-r") == 0) {
+            args->resume = 1;
+        } else if (strcmp(tok, "-z") == 0) {
+            args->compress = 1;
+        } else if (strcmp(tok, "-d") == 0) {
+            args->delta = 1;
+        } else if (strcmp(tok, "-p") == 0 && (tok = strtok_r(NULL, " ", &save))) {
+            args->streams = atoi(tok);
+        }
+    }
+    return 0;
+}
+
 void* readThreadFunc(void* arg) {
     while (!should_exit) {
         msg_header resp_hdr;
         // Attempt to read header
         if (readAll(server_socket, &resp_hdr, sizeof(resp_hdr)) <= 0) {
             should_exit = 1;
-            pthread_cond_signal(&response_cond); // Wake writer so it can exit
+            pthread_cond_broadcast(&response_cond); // Wake writer so it can exit
+            break;
+        }
+        if (checkHeader(&resp_hdr) < 0) {
+            fprintf(stderr, "[Error]> The server speaks another protocol version, disconnecting\n");
+            should_exit = 1;
+            pthread_cond_broadcast(&response_cond);
             break;
         }
         
@@ -175,14 +973,49 @@ void* readThreadFunc(void* arg) {
         
         resp_buf[resp_hdr.payloadLength] = '\0';
 
+        if (resp_hdr.status != 0 && (resp_hdr.type == DATA || resp_hdr.type == LSRES || resp_hdr.type == READCMD)) {
+            // a packed payload, status holds its inflated length
+            char* unpacked = resp_hdr.status <= MAX_UNPACKED ? malloc(resp_hdr.status + 1) : NULL;
+            ssize_t n = unpacked ? unpackChunk(resp_buf, resp_hdr.payloadLength, unpacked, resp_hdr.status) : -1;
+            free(resp_buf);
+            if (n != (ssize_t)resp_hdr.status) {
+                fprintf(stderr, "[Error]> Cannot unpack a reply from the server\n");
+                free(unpacked);
+                should_exit = 1;
+                pthread_cond_broadcast(&response_cond);
+                break;
+            }
+            resp_buf = unpacked;
+            resp_buf[n] = '\0';
+            resp_hdr.payloadLength = n;
+        }
+
+        if (resp_hdr.type == DATA) {
+            // file bytes, nothing to show
+            feedDownloadStream(resp_hdr.req_id, resp_buf, resp_hdr.payloadLength);
+            free(resp_buf);
+            continue;
+        }
+
+        // a transfer's final reply waits for our side of it, before the stdout lock its data
+        // thread may still need
+        char check_err[160], check_path[256];
+        int check_bg = 0;
+        int check_failed = resp_hdr.type == TEXT &&
+            settleCheck(resp_hdr.req_id, resp_buf, check_err, sizeof(check_err), check_path, sizeof(check_path), &check_bg);
+
         pthread_mutex_lock(&lock);
         
-        printf("\r\033[K");
+        // the prompt is cleared for a new reply, not in the middle of a read's output
+        if (resp_hdr.type != READCMD || read_stream != resp_hdr.req_id) {
+            printf("\r\033[K");
+        }
         
 
         if (resp_hdr.type == TEXT) {
             if (resp_hdr.is_background) {
-                printf("[Background]> %s\n", resp_buf);
+                printTag("Background", resp_hdr.req_id);
+                printf("%s\n", resp_buf);
                 if (is_writing_content) {
                     printf("[Client]> (Still recording file content... hit Ctrl+D to finish)\n");
                 } else {
@@ -190,43 +1023,92 @@ void* readThreadFunc(void* arg) {
                 }
                 fflush(stdout);
             } else {
-                printf("[Server]> %s\n", resp_buf);
+                printTag("Server", resp_hdr.req_id);
+                printf("%s\n", resp_buf);
+            }
+            if (check_failed) {
+                fflush(stdout);
+                printStreamError(check_bg, check_err, check_path);
             }
-        } else if (resp_hdr.type == LSRES) {
-            int num_entries = resp_hdr.payloadLength / sizeof(FileEntry);
-            FileEntry *entries = (FileEntry *)resp_buf;
-            for (int i = 0; i < num_entries; i++) {
-                printf("%-11s %-20s %10ld bytes\n", 
-                    entries[i].perms, entries[i].name, (long)entries[i].size);
+        } else if (resp_hdr.type == LSRES || resp_hdr.type == READCMD) {
+            printReply(resp_hdr.type, resp_hdr.req_id, resp_buf, resp_hdr.payloadLength);
+        } else if (resp_hdr.type == BATCHRES) {
+            printBatch(resp_hdr.req_id, resp_buf, resp_hdr.payloadLength);
+        } else if (resp_hdr.type == QUEUED) {
+            // the transfer waits on the server, its own replies come later under the same id
+            printTag(resp_hdr.is_background ? "Background" : "Server", resp_hdr.req_id);
+            printf("%s\n", resp_buf);
+            if (resp_hdr.is_background) {
+                printf("[Client]> Enter command: ");
+                fflush(stdout);
             }
-        } else if (resp_hdr.type == READCMD) {
-            if (resp_hdr.payloadLength > 0) {
-                printf("[Server]> Content:\n"); 
-                fwrite(resp_buf, 1, resp_hdr.payloadLength, stdout);
-                printf("\n");
-            } else {
-                printf("[Server]> File is empty\n");
+        } else if (resp_hdr.type == BUSY) {
+            // status holds how long the server asks us to stay away
+            printTag(resp_hdr.is_background ? "Background" : "Server", resp_hdr.req_id);
+            printf("Busy: %s, retry in %u ms\n", resp_buf, resp_hdr.status);
+            if (resp_hdr.is_background) {
+                pthread_mutex_lock(&bg_lock);
+                if (bg_ops_count > 0) bg_ops_count--; // it never started
+                pthread_mutex_unlock(&bg_lock);
+                printf("[Client]> Enter command: ");
+                fflush(stdout);
             }
         }
-        else if (resp_hdr.type == DOWNLOAD_RES) {
-            bg_download_args *bg_args = malloc(sizeof(bg_download_args));
-            // Server sends: "DATA_PORT <port> <dest_path>"
+        else if (resp_hdr.type == DOWNLOAD_RES && strncmp(resp_buf, "DATA_STREAM ", 12) == 0) {
+            openDownloadStream(resp_hdr.req_id, resp_buf + 12);
+        } else if (resp_hdr.type == UPLOAD_RES && strncmp(resp_buf, "DATA_STREAM ", 12) == 0) {
+            bg_download_args *bg_args = calloc(1, sizeof(bg_download_args));
+            bg_args->is_bg = resp_hdr.is_background;
+            bg_args->req_id = resp_hdr.req_id;
+            // a resumed upload is announced with the size and tail checksum of the server's copy
+            unsigned long long size;
+            unsigned int crc;
+            if (sscanf(resp_buf + 12, "%255s %llu %x", bg_args->dest_path, &size, &crc) == 3) {
+                bg_args->resume = 1;
+                bg_args->remote.size = size;
+                bg_args->remote.tail_crc = crc;
+            }
+            // a trailing -z: the server takes packed frames
+            const char* last = strrchr(resp_buf + 12, ' ');
+            bg_args->compress = last && strcmp(last + 1, "-z") == 0;
+            markStreaming(resp_hdr.req_id);
+            expectCheck(resp_hdr.req_id, bg_args->is_bg, 1, bg_args->dest_path);
+            pthread_t bg_tid;
+            beginDataThread();
+            pthread_create(&bg_tid, NULL, streamUploadFunc, bg_args);
+            pthread_detach(bg_tid);
+        } else if (resp_hdr.type == DOWNLOAD_RES) {
+            bg_download_args *bg_args = calloc(1, sizeof(bg_download_args));
             bg_args->is_bg = resp_hdr.is_background;
-            if (sscanf(resp_buf, "DATA_PORT %d %s", &bg_args->port, bg_args->dest_path) == 2) {
-                pthread_t bg_tid;
-                pthread_create(&bg_tid, NULL, backgroundDownloadFunc, bg_args);
-                pthread_detach(bg_tid);
+            if (parseDataPort(resp_buf, bg_args) == 0) {
+                if (bg_args->streams > 1) {
+                    startParallelDownload(bg_args);
+                } else {
+                    bg_args->req_id = resp_hdr.req_id;
+                    expectCheck(resp_hdr.req_id, bg_args->is_bg, 1, bg_args->dest_path);
+                    pthread_t bg_tid;
+                    beginDataThread();
+                    pthread_create(&bg_tid, NULL, backgroundDownloadFunc, bg_args);
+                    pthread_detach(bg_tid);
+                }
             } else {
                 printf("[Error]> Failed to parse download response: %s\n", resp_buf);
                 free(bg_args);
             }
         } else if (resp_hdr.type == UPLOAD_RES) {
-            bg_download_args *bg_args = malloc(sizeof(bg_download_args));
+            bg_download_args *bg_args = calloc(1, sizeof(bg_download_args));
             bg_args->is_bg = resp_hdr.is_background;
-            if (sscanf(resp_buf, "DATA_PORT %d %s", &bg_args->port, bg_args->dest_path) == 2) {
-                pthread_t bg_tid;
-                pthread_create(&bg_tid, NULL, backgroundUploadFunc, bg_args);
-                pthread_detach(bg_tid);
+            if (parseDataPort(resp_buf, bg_args) == 0) {
+                if (bg_args->streams > 1) {
+                    startParallelUpload(bg_args);
+                } else {
+                    bg_args->req_id = resp_hdr.req_id;
+                    expectCheck(resp_hdr.req_id, bg_args->is_bg, 1, bg_args->dest_path);
+                    pthread_t bg_tid;
+                    beginDataThread();
+                    pthread_create(&bg_tid, NULL, backgroundUploadFunc, bg_args);
+                    pthread_detach(bg_tid);
+                }
             } else {
                 printf("[Error]> Failed to parse upload response\n");
                 free(bg_args);
@@ -234,12 +1116,19 @@ void* readThreadFunc(void* arg) {
         }
 
         pthread_mutex_unlock(&lock);
+
+        if (resp_hdr.type == TEXT || resp_hdr.type == BUSY) {
+            finishTransfer(resp_hdr.req_id, resp_hdr.type == BUSY);
+        }
         
         if (!resp_hdr.is_background) {
-            if (resp_hdr.type != DOWNLOAD_RES && resp_hdr.type != UPLOAD_RES) {            
+            // a read is answered once its last, empty chunk is in
+            int partial = resp_hdr.type == READCMD && resp_hdr.payloadLength > 0;
+            if (resp_hdr.type != DOWNLOAD_RES && resp_hdr.type != UPLOAD_RES && resp_hdr.type != QUEUED && !partial) {
                 pthread_mutex_lock(&response_lock);
-                waiting_for_response = 0;
-                pthread_cond_signal(&response_cond);
+                if (retireRequest(resp_hdr.req_id)) {
+                    pthread_cond_broadcast(&response_cond);
+                }
                 pthread_mutex_unlock(&response_lock);
             }
         }
@@ -250,14 +1139,78 @@ void* readThreadFunc(void* arg) {
     return NULL;
 }
 
+// Ctrl+C stops the read being printed, otherwise it ends the client as it always did.
+// SIGINT is blocked everywhere else, it only lands here
+void* interruptThreadFunc(void* arg) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    int sig;
+    while (sigwait(&set, &sig) == 0) {
+        uint32_t req_id = read_stream;
+        if (req_id == 0) break;
+        msg_header cancel = { .type = CANCEL, .req_id = req_id };
+        stampHeader(&cancel);
+        read_cancelled = req_id;
+        pthread_mutex_lock(&send_lock);
+        writeAll(server_socket, &cancel, sizeof(cancel));
+        pthread_mutex_unlock(&send_lock);
+    }
+    signal(SIGINT, SIG_DFL);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    raise(SIGINT);
+    return NULL;
+}
+
+static int sendWriteChunk(msg_header* chunk, const char* buf) {
+    stampHeader(chunk);
+    pthread_mutex_lock(&send_lock);
+    int ok = writeAll(server_socket, chunk, sizeof(*chunk)) >= 0 &&
+             (chunk->payloadLength == 0 || writeAll(server_socket, buf, chunk->payloadLength) >= 0);
+    pthread_mutex_unlock(&send_lock);
+    return ok ? 0 : -1;
+}
+
+// stdin goes out as WRITECMD chunks of up to DATA_CHUNK as it is read, an empty one ends the
+// write. Nothing past one chunk is held, however much is piped in. -1 if the server is gone
+static int streamWrite(uint32_t req_id) {
+    pthread_mutex_lock(&lock);
+    printf("[Client]> Enter content (Ctrl+D to finish):\n");
+    fflush(stdout);
+    is_writing_content = 1;
+    pthread_mutex_unlock(&lock);
+
+    char* buf = malloc(DATA_CHUNK);
+    msg_header chunk = { .type = WRITECMD, .req_id = req_id };
+    int ret = 0, eof = !buf;
+    while (!eof && ret == 0) {
+        size_t len = 0;
+        while (len < DATA_CHUNK) {
+            ssize_t n = read(STDIN_FILENO, buf + len, DATA_CHUNK - len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                eof = 1;
+                break;
+            }
+            len += n;
+        }
+        if (len > 0) {
+            chunk.payloadLength = len;
+            ret = sendWriteChunk(&chunk, buf);
+        }
+    }
+    is_writing_content = 0;
+    free(buf);
+    chunk.payloadLength = 0;
+    if (ret == 0) ret = sendWriteChunk(&chunk, NULL);
+    return ret;
+}
+
 void* writeThreadFunc(void* arg) {
+    uint32_t next_req_id = 0;
     while (!should_exit) {
-        // Wait until the previous response is finished OR all bg ops are done
-        pthread_mutex_lock(&response_lock);
-        while (waiting_for_response && !should_exit) {
-            pthread_cond_wait(&response_cond, &response_lock);
-        }
-        pthread_mutex_unlock(&response_lock);
+        // Wait for a free slot in the window, with a window of 1 that is the previous response
+        waitInflight(max_inflight - 1);
 
         if (should_exit) break;
 
@@ -271,6 +1224,8 @@ void* writeThreadFunc(void* arg) {
         
         char command[256];
         if (fgets(command, sizeof(command), stdin) == NULL) {
+            waitInflight(0); // the input ended, not the replies still on their way
+            waitDataThreads();
             should_exit = 1;
             break;
         }
@@ -286,50 +1241,46 @@ void* writeThreadFunc(void* arg) {
                 continue;
             }
             pthread_mutex_unlock(&bg_lock);
+            waitInflight(0);
+            waitDataThreads();
             should_exit = 1;
             break;
         }
 
         int is_background = (strstr(command, " -b") != NULL);
-        msg_header hdr = { .is_background = (uint8_t)is_background };
+        msg_header hdr = { .is_background = (uint8_t)is_background, .req_id = ++next_req_id };
         char *payload = NULL;
-        uint32_t total_len = 0;
-
-        if (strncmp(command, "write ", 6) == 0) {
-            pthread_mutex_lock(&lock);
-            printf("[Client]> Enter content (Ctrl+D to finish):\n");
-            fflush(stdout);
-            is_writing_content = 1;
-            pthread_mutex_unlock(&lock);
-            
-            char *write_buf = NULL;
-            size_t write_len = 0;
-            char temp[1024];
-            ssize_t n;
-            
-            while ((n = read(STDIN_FILENO, temp, sizeof(temp))) > 0) {
-                char *new_ptr = realloc(write_buf, write_len + n);
-                if (!new_ptr) break;
-                write_buf = new_ptr;
-                memcpy(write_buf + write_len, temp, n);
-                write_len += n;
-            }
-            is_writing_content = 0;
 
-            size_t cmd_len = strlen(command) + 1;
-            total_len = cmd_len + write_len;
-            payload = malloc(total_len);
-            memcpy(payload, command, cmd_len);
-            if (write_buf) memcpy(payload + cmd_len, write_buf, write_len);
-            
+        int is_write = strncmp(command, "write ", 6) == 0;
+        if (is_write) {
+            // the content streams behind the command once it is out, see streamWrite
             hdr.type = WRITECMD;
-            hdr.payloadLength = total_len;
-            free(write_buf);
+            hdr.payloadLength = strlen(command) + 1;
+            payload = malloc(hdr.payloadLength);
+            strcpy(payload, command);
+        } else if (strncmp(command, "batch", 5) == 0 && (command[5] == ' ' || command[5] == '\0')) {
+            uint32_t flags = 0;
+            payload = loadBatch(command, &hdr.payloadLength, &flags);
+            if (!payload) {
+                next_req_id--;
+                continue;
+            }
+            hdr.type = BATCH;
+            hdr.status = flags;
         } else {
+            if (strncmp(command, "download ", 9) == 0) {
+                expandResume(command, sizeof(command));
+            }
             hdr.type = CMDREQ;
-            hdr.payloadLength = (uint32_t)strlen(command) + 1;
+            hdr.status = CMD_PACKED_REPLIES;
+            hdr.payloadLength = strlen(command) + 1;
             payload = malloc(hdr.payloadLength); 
             strcpy(payload, command);
+            int is_upload = strncmp(command, "upload ", 7) == 0;
+            if (inband_data && (strncmp(command, "download ", 9) == 0 || is_upload) &&
+                trackTransfer(hdr.req_id, is_background, is_upload) == 0) {
+                hdr.status |= CMD_INBAND_DATA;
+            }
         }
 
         if (is_background) {
@@ -342,20 +1293,38 @@ void* writeThreadFunc(void* arg) {
             pthread_mutex_unlock(&lock);
             
             // Don't wait for response on background commands
-            pthread_mutex_lock(&response_lock);
-            waiting_for_response = 0;
-            pthread_mutex_unlock(&response_lock);
         } else {
-            // Wait for response on foreground commands
+            // tracked before sending, the reply may be back before writeAll returns
             pthread_mutex_lock(&response_lock);
-            waiting_for_response = 1;
+            inflight_ids[inflight++] = hdr.req_id;
             pthread_mutex_unlock(&response_lock);
         }
 
-        writeAll(server_socket, &hdr, sizeof(hdr));
-        writeAll(server_socket, payload, hdr.payloadLength);
+        stampHeader(&hdr);
+        pthread_mutex_lock(&send_lock);
+        int sent = writeAll(server_socket, &hdr, sizeof(hdr)) >= 0 &&
+                   writeAll(server_socket, payload, hdr.payloadLength) >= 0;
+        pthread_mutex_unlock(&send_lock);
+        if (!sent) {
+            free(payload);
+            should_exit = 1;
+            break;
+        }
 
         free(payload);
+
+        if (is_write && streamWrite(hdr.req_id) < 0) {
+            should_exit = 1;
+            break;
+        }
+
+        // the server streams files from a forked child, whatever follows could race with
+        // the transfer, so a foreground one still completes before the next command leaves.
+        // A read too, its content would come interleaved with the next replies
+        if (!is_background && (strncmp(command, "download ", 9) == 0 || strncmp(command, "upload ", 7) == 0 ||
+                               strncmp(command, "read ", 5) == 0)) {
+            waitInflight(0);
+        }
     }
     return NULL;
 }
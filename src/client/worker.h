@@ -1,8 +1,11 @@
 #ifndef WORKER_H
 #define WORKER_H
 
+#define MAX_INFLIGHT 64   // upper bound of --window
+
 
 void* readThreadFunc(void* arg);
 void* writeThreadFunc(void* arg);
+void* interruptThreadFunc(void* arg);
 
 #endif
\ No newline at end of file
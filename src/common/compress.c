@@ -0,0 +1,125 @@
+#include "common/compress.h"
+#include "common/utility.h"
+#include "common/crc32c.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+
+#define SAMPLE_SIZE 16384
+#define SAMPLE_COUNT 4
+#define STREAM_CHUNK 65536
+#define STREAM_LEVEL 1          // the link is the bottleneck we fight, not the cpu
+
+// deflates a few blocks spread over the range and only says yes when they shrink by a tenth,
+// logs and csv easily do, media and archives never do and would just burn cpu on both ends
+bool worthCompressing(int fd, off_t start, off_t end) {
+    if (end - start < SAMPLE_SIZE) {
+        return false;
+    }
+    unsigned char in[SAMPLE_SIZE];
+    unsigned char out[SAMPLE_SIZE + 1024];
+    off_t step = (end - start - SAMPLE_SIZE) / (SAMPLE_COUNT - 1);
+    size_t raw = 0, packed = 0;
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        ssize_t n = pread(fd, in, SAMPLE_SIZE, start + i * step);
+        if (n <= 0) {
+            return false;
+        }
+        uLongf out_len = sizeof(out);
+        if (compress2(out, &out_len, in, n, STREAM_LEVEL) != Z_OK) {
+            return false;
+        }
+        raw += n;
+        packed += out_len;
+    }
+    return packed * 10 < raw * 9;
+}
+
+// one deflate stream of start..end to out_fd, read with pread so the file offset stays put.
+// crc gets the crc32c of the plain bytes
+int deflateRange(int out_fd, int file_fd, off_t start, off_t end, uint32_t* crc) {
+    unsigned char in[STREAM_CHUNK];
+    unsigned char out[STREAM_CHUNK];
+    z_stream zs = {0};
+    if (deflateInit(&zs, STREAM_LEVEL) != Z_OK) {
+        return -1;
+    }
+    int ret = -1;
+    int flush = Z_NO_FLUSH;
+    while (flush != Z_FINISH) {
+        size_t want = (end - start) < STREAM_CHUNK ? (size_t)(end - start) : STREAM_CHUNK;
+        ssize_t n = want ? pread(file_fd, in, want, start) : 0;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || (n == 0 && want > 0)) goto out;
+        *crc = crc32c(*crc, in, n);
+        start += n;
+        flush = (start >= end) ? Z_FINISH : Z_NO_FLUSH;
+        zs.next_in = in;
+        zs.avail_in = n;
+        do {
+            zs.next_out = out;
+            zs.avail_out = sizeof(out);
+            deflate(&zs, flush);
+            size_t have = sizeof(out) - zs.avail_out;
+            if (have > 0 && writeAll(out_fd, out, have) < 0) goto out;
+        } while (zs.avail_out == 0);
+    }
+    ret = 0;
+out:
+    deflateEnd(&zs);
+    return ret;
+}
+
+// inflates the stream coming in on in_fd into out_fd, a stream cut before its end is an error.
+// crc gets the crc32c of what was written
+int inflateStream(int in_fd, int out_fd, uint32_t* crc) {
+    unsigned char in[STREAM_CHUNK];
+    unsigned char out[STREAM_CHUNK];
+    z_stream zs = {0};
+    if (inflateInit(&zs) != Z_OK) {
+        return -1;
+    }
+    int ret = -1;
+    int z = Z_OK;
+    while (z != Z_STREAM_END) {
+        ssize_t n = read(in_fd, in, sizeof(in));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) goto out;
+        zs.next_in = in;
+        zs.avail_in = n;
+        do {
+            zs.next_out = out;
+            zs.avail_out = sizeof(out);
+            z = inflate(&zs, Z_NO_FLUSH);
+            if (z != Z_OK && z != Z_STREAM_END && z != Z_BUF_ERROR) goto out;
+            size_t have = sizeof(out) - zs.avail_out;
+            if (have > 0 && writeAll(out_fd, out, have) < 0) goto out;
+            *crc = crc32c(*crc, out, have);
+        } while (zs.avail_out == 0 && z != Z_STREAM_END);
+    }
+    ret = 0;
+out:
+    inflateEnd(&zs);
+    return ret;
+}
+
+// packed size, or -1 when the payload is too small or would not shrink and goes out as is
+ssize_t packChunk(const void* in, size_t len, void* out, size_t cap) {
+    if (len < PACK_MIN_SIZE) {
+        return -1;
+    }
+    uLongf out_len = cap;
+    if (compress2(out, &out_len, in, len, STREAM_LEVEL) != Z_OK || out_len >= len) {
+        return -1;
+    }
+    return out_len;
+}
+
+ssize_t unpackChunk(const void* in, size_t len, void* out, size_t cap) {
+    uLongf out_len = cap;
+    if (uncompress(out, &out_len, in, len) != Z_OK) {
+        return -1;
+    }
+    return out_len;
+}
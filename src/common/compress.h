@@ -0,0 +1,26 @@
+// zlib codec for the -z transfers and the read/ls replies. Port mode streams one deflate
+// stream over the data socket, frames (DATA, READCMD, LSRES) are packed one by one and carry
+// their inflated length in the header status, 0 meaning the payload went out as is
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PACK_MIN_SIZE 512       // smaller payloads are not worth a deflate header
+#define MAX_UNPACKED (64 << 20) // refuse frames claiming to inflate past this
+
+// a -z data port stream opens with one of these, the sender samples the file to pick
+#define STREAM_PACKED 'Z'
+#define STREAM_PLAIN '-'
+
+bool worthCompressing(int fd, off_t start, off_t end);
+int deflateRange(int out_fd, int file_fd, off_t start, off_t end, uint32_t* crc);
+int inflateStream(int in_fd, int out_fd, uint32_t* crc);
+ssize_t packChunk(const void* in, size_t len, void* out, size_t cap);
+ssize_t unpackChunk(const void* in, size_t len, void* out, size_t cap);
+
+#endif
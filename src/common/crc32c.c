@@ -0,0 +1,124 @@
+#include "common/crc32c.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // reflected Castagnoli polynomial
+
+typedef uint32_t (*crc_func)(uint32_t crc, const unsigned char* p, size_t len);
+
+static uint32_t crc_table[256];
+static crc_func crc_impl;
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+// one byte per step, for cpus without a crc instruction
+static uint32_t crc32cTable(uint32_t crc, const unsigned char* p, size_t len) {
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// SSE4.2 crc32 computes exactly this polynomial, eight bytes per instruction
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHw(uint32_t crc, const unsigned char* p, size_t len) {
+    uint64_t c = crc;
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+    return c;
+}
+
+static int hasCrcInstruction(void) {
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+// the ARMv8 CRC extension, crc32c* are the Castagnoli variants
+__attribute__((target("+crc")))
+static uint32_t crc32cHw(uint32_t crc, const unsigned char* p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+
+static int hasCrcInstruction(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static void buildTable(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+    crc_impl = crc32cTable;
+#if defined(__x86_64__) || defined(__aarch64__)
+    if (hasCrcInstruction()) {
+        crc_impl = crc32cHw;
+    }
+#endif
+}
+
+// crc of a previous call continues over buf, start with 0
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+    pthread_once(&crc_table_once, buildTable);
+    return ~crc_impl(~crc, buf, len);
+}
+
+// continues crc over len bytes at start, without moving the file offset. -1 if the file is shorter
+int crc32cUpdate(int fd, off_t start, off_t len, uint32_t* crc) {
+    char buf[65536];
+    uint32_t c = *crc;
+    while (len > 0) {
+        size_t want = len < (off_t)sizeof(buf) ? (size_t)len : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, start);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c = crc32c(c, buf, n);
+        start += n;
+        len -= n;
+    }
+    *crc = c;
+    return 0;
+}
+
+int crc32cRange(int fd, off_t start, off_t len, uint32_t* out) {
+    *out = 0;
+    return crc32cUpdate(fd, start, len, out);
+}
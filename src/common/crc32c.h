@@ -0,0 +1,15 @@
+// CRC32C (Castagnoli), the checksum both ends compare before resuming a transfer and once it
+// is through. Uses the SSE4.2 or ARMv8 crc instructions when the cpu has them
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+int crc32cUpdate(int fd, off_t start, off_t len, uint32_t* crc);
+int crc32cRange(int fd, off_t start, off_t len, uint32_t* out);
+
+#endif
@@ -0,0 +1,258 @@
+#include "common/delta.h"
+#include "common/crc32c.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define MIN_BLOCK 2048
+#define MAX_BLOCK 65536         // never past DELTA_LITERAL_MAX, one buffer serves both
+#define MAX_BLOCKS (1 << 24)
+
+typedef struct {
+    uint32_t weak;
+    uint32_t block;
+} weak_entry;
+
+// about sqrt(size) like rsync, the signatures and what a change costs to resend stay balanced
+static uint32_t blockSize(uint64_t size) {
+    uint32_t bs = MIN_BLOCK;
+    while (bs < MAX_BLOCK && (uint64_t)bs * bs < size) bs <<= 1;
+    return bs;
+}
+
+// rsync's rolling checksum, a sums the bytes and b weighs each one by its distance to the end
+static uint32_t weakSum(const unsigned char* p, size_t len, uint32_t* a, uint32_t* b) {
+    uint32_t s1 = 0, s2 = 0;
+    for (size_t i = 0; i < len; i++) {
+        s1 += p[i];
+        s2 += (uint32_t)(len - i) * p[i];
+    }
+    *a = s1 & 0xFFFF;
+    *b = s2 & 0xFFFF;
+    return *a | (*b << 16);
+}
+
+static int preadAll(int fd, void* buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char*)buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// server side: the signatures of every block of its copy, basis_fd -1 when it has none
+int sendSignatures(int sock, int basis_fd, uint64_t size, delta_header* dh) {
+    if (basis_fd < 0) size = 0;
+    dh->size = size;
+    dh->block_size = blockSize(size);
+    dh->blocks = (size + dh->block_size - 1) / dh->block_size;
+    if (dh->blocks > MAX_BLOCKS) {
+        dh->size = 0; // too big to describe, the client sends it all
+        dh->blocks = 0;
+    }
+    int ret = -1;
+    block_sig* sigs = malloc((dh->blocks ? dh->blocks : 1) * sizeof(*sigs));
+    unsigned char* buf = malloc(dh->block_size);
+    if (!sigs || !buf) goto out;
+    for (uint32_t i = 0; i < dh->blocks; i++) {
+        off_t off = (off_t)i * dh->block_size;
+        size_t len = dh->size - off < dh->block_size ? dh->size - off : dh->block_size;
+        uint32_t a, b;
+        if (preadAll(basis_fd, buf, len, off) < 0) goto out;
+        sigs[i].weak = weakSum(buf, len, &a, &b);
+        sigs[i].crc = crc32c(0, buf, len);
+        sigs[i].crc2 = crc32(0L, buf, len);
+    }
+    if (writeAll(sock, dh, sizeof(*dh)) < 0 ||
+        (dh->blocks && writeAll(sock, sigs, dh->blocks * sizeof(*sigs)) < 0)) goto out;
+    ret = 0;
+out:
+    free(sigs);
+    free(buf);
+    return ret;
+}
+
+static int compareWeak(const void* a, const void* b) {
+    const weak_entry* x = a;
+    const weak_entry* y = b;
+    if (x->weak != y->weak) return x->weak < y->weak ? -1 : 1;
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+// block of the server's copy holding exactly p, -1 when none does
+static int64_t findBlock(const weak_entry* index, size_t n, const block_sig* sigs, uint32_t weak,
+                         const unsigned char* p, size_t len) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (index[mid].weak < weak) lo = mid + 1;
+        else hi = mid;
+    }
+    int strong = 0;
+    uint32_t crc = 0, crc2 = 0;
+    for (; lo < n && index[lo].weak == weak; lo++) {
+        // the strong sums only once the cheap one matched
+        if (!strong) {
+            crc = crc32c(0, p, len);
+            crc2 = crc32(0L, p, len);
+            strong = 1;
+        }
+        const block_sig* s = &sigs[index[lo].block];
+        if (s->crc == crc && s->crc2 == crc2) return index[lo].block;
+    }
+    return -1;
+}
+
+static int sendOp(int sock, uint32_t type, uint32_t block, uint32_t count) {
+    delta_op op = { .type = type, .block = block, .count = count };
+    return writeAll(sock, &op, sizeof(op)) < 0 ? -1 : 0;
+}
+
+// a pending run of copies goes out before anything that follows it
+static int flushCopies(int sock, delta_op* run) {
+    if (run->count == 0) return 0;
+    int ret = sendOp(sock, DELTA_COPY, run->block, run->count);
+    run->count = 0;
+    return ret;
+}
+
+static int addCopy(int sock, delta_op* run, uint32_t block) {
+    if (run->count > 0 && run->block + run->count == block) {
+        run->count++;
+        return 0;
+    }
+    if (flushCopies(sock, run) < 0) return -1;
+    run->block = block;
+    run->count = 1;
+    return 0;
+}
+
+static int sendLiteral(int sock, delta_op* run, const unsigned char* p, size_t len) {
+    if (len > 0 && flushCopies(sock, run) < 0) return -1;
+    while (len > 0) {
+        size_t chunk = len < DELTA_LITERAL_MAX ? len : DELTA_LITERAL_MAX;
+        if (sendOp(sock, DELTA_LITERAL, 0, chunk) < 0 || writeAll(sock, p, chunk) < 0) return -1;
+        p += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// client side: reads the server's signatures and describes file_fd in terms of its blocks.
+// crc gets the crc32c of the whole file, the server checks the rebuilt one against it
+int sendDelta(int sock, int file_fd, uint32_t* crc) {
+    delta_header dh;
+    if (readAll(sock, &dh, sizeof(dh)) != sizeof(dh)) return -1;
+    uint32_t bs = dh.block_size;
+    if (bs < MIN_BLOCK || bs > MAX_BLOCK || dh.blocks > MAX_BLOCKS || dh.blocks != (dh.size + bs - 1) / bs) {
+        return -1;
+    }
+    int ret = -1;
+    unsigned char* data = MAP_FAILED;
+    size_t size = 0;
+    size_t full = dh.size / bs; // a short last block is not looked for, at worst it goes as a literal
+    block_sig* sigs = malloc((dh.blocks ? dh.blocks : 1) * sizeof(*sigs));
+    weak_entry* index = malloc((full ? full : 1) * sizeof(*index));
+    struct stat st;
+    if (!sigs || !index || fstat(file_fd, &st) < 0) goto out;
+    if (dh.blocks && readAll(sock, sigs, dh.blocks * sizeof(*sigs)) != (ssize_t)(dh.blocks * sizeof(*sigs))) goto out;
+    for (size_t i = 0; i < full; i++) {
+        index[i].weak = sigs[i].weak;
+        index[i].block = i;
+    }
+    qsort(index, full, sizeof(*index), compareWeak);
+
+    size = st.st_size;
+    if (size > 0 && (data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file_fd, 0)) == MAP_FAILED) goto out;
+    delta_op run = { .type = DELTA_COPY };
+    size_t pos = 0, lit = 0;
+    uint32_t a = 0, b = 0, weak = 0;
+    int rolling = 0;
+    while (full > 0 && pos + bs <= size) {
+        if (!rolling) {
+            weak = weakSum(data + pos, bs, &a, &b);
+            rolling = 1;
+        }
+        int64_t block = findBlock(index, full, sigs, weak, data + pos, bs);
+        if (block >= 0) {
+            if (sendLiteral(sock, &run, data + lit, pos - lit) < 0 || addCopy(sock, &run, block) < 0) goto out;
+            pos += bs;
+            lit = pos;
+            rolling = 0;
+            continue;
+        }
+        if (pos - lit >= DELTA_LITERAL_MAX) {
+            if (sendLiteral(sock, &run, data + lit, pos - lit) < 0) goto out;
+            lit = pos;
+        }
+        if (pos + bs < size) {
+            uint32_t gone = data[pos], next = data[pos + bs];
+            a = (a - gone + next) & 0xFFFF;
+            b = (b - bs * gone + a) & 0xFFFF;
+            weak = a | (b << 16);
+        }
+        pos++;
+    }
+    *crc = size ? crc32c(0, data, size) : 0;
+    if (sendLiteral(sock, &run, data + lit, size - lit) < 0 || flushCopies(sock, &run) < 0 ||
+        sendOp(sock, DELTA_END, 0, *crc) < 0) goto out;
+    ret = 0;
+out:
+    if (data != MAP_FAILED) munmap(data, size);
+    free(sigs);
+    free(index);
+    return ret;
+}
+
+static int emit(int out_fd, const void* buf, size_t len, uint32_t* crc, uint64_t* total) {
+    if (writeAll(out_fd, buf, len) < 0) return -1;
+    *crc = crc32c(*crc, buf, len);
+    *total += len;
+    return 0;
+}
+
+// server side: rebuilds the new file into out_fd from the blocks of basis_fd and the client's
+// literals. 0 once the result matches the checksum the client ends with
+int applyDelta(int sock, int basis_fd, const delta_header* dh, int out_fd, uint64_t* total, uint64_t* literal, uint32_t* file_crc) {
+    unsigned char* buf = malloc(DELTA_LITERAL_MAX);
+    uint32_t crc = 0;
+    int ret = -1;
+    *total = 0;
+    *literal = 0;
+    if (!buf) return -1;
+    for (;;) {
+        delta_op op;
+        if (readAll(sock, &op, sizeof(op)) != sizeof(op)) break;
+        if (op.type == DELTA_END) {
+            ret = op.count == crc ? 0 : -1;
+            *file_crc = crc;
+            break;
+        } else if (op.type == DELTA_LITERAL) {
+            if (op.count == 0 || op.count > DELTA_LITERAL_MAX ||
+                readAll(sock, buf, op.count) != (ssize_t)op.count) break;
+            *literal += op.count;
+            if (emit(out_fd, buf, op.count, &crc, total) < 0) break;
+        } else if (op.type == DELTA_COPY) {
+            if (op.count == 0 || op.block >= dh->blocks || op.count > dh->blocks - op.block) break;
+            uint32_t i;
+            for (i = op.block; i < op.block + op.count; i++) {
+                off_t off = (off_t)i * dh->block_size;
+                size_t len = dh->size - off < dh->block_size ? dh->size - off : dh->block_size;
+                if (preadAll(basis_fd, buf, len, off) < 0 || emit(out_fd, buf, len, &crc, total) < 0) break;
+            }
+            if (i < op.block + op.count) break;
+        } else {
+            break;
+        }
+    }
+    free(buf);
+    return ret;
+}
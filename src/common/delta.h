@@ -0,0 +1,16 @@
+// rsync style delta for upload -d. Rolling weak sums find the blocks of the server's copy
+// anywhere in the new file, a strong sum confirms them, and only what matched nothing travels
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "common/utility.h"
+
+int sendSignatures(int sock, int basis_fd, uint64_t size, delta_header* dh);
+int sendDelta(int sock, int file_fd, uint32_t* crc);
+int applyDelta(int sock, int basis_fd, const delta_header* dh, int out_fd, uint64_t* total, uint64_t* literal, uint32_t* file_crc);
+
+#endif
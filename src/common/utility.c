@@ -1,3 +1,5 @@
+#define _GNU_SOURCE     // F_OFD_SETLKW
+
 #include "common/utility.h"
 #include <arpa/inet.h>
 #include <errno.h>
@@ -5,6 +7,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>     // For fcntl and flock structures
+#include <stdlib.h>
 
 
 // inet_pton - convert IPv4 and IPv6 addresses from text to binary form
@@ -32,8 +35,11 @@ ssize_t readAll(int fd, void *buf, size_t len) {
         ssize_t n = read(fd, (char*)buf + recvd, len - recvd);
         if (n == 0)
             return 0;      
-        if (n < 0)
+        if (n < 0) {
+            // half a message is already consumed, giving up now would desync the stream
+            if (errno == EINTR && recvd > 0) continue;
             return -1;
+        }
         recvd += n;
     }
     return recvd;
@@ -165,6 +171,39 @@ int lock_fd(int fd, LockType type) {
 
     return 0; 
 }
+// open file description lock: it belongs to the open file rather than the process, so it
+// travels with the fd passed to another process and lasts until the last copy is closed
+int lock_ofd(int fd, LockType type) {
+    if (fd < 0) return -1;
+
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl)); // l_pid must be 0 for OFD locks
+    fl.l_whence = SEEK_SET;
+    fl.l_type = (type == LOCK_EXCLUSIVE) ? F_WRLCK : F_RDLCK;
+
+    if (fcntl(fd, F_OFD_SETLKW, &fl) < 0) {
+        perror("fcntl lock_ofd");
+        return -1;
+    }
+
+    return 0;
+}
+// lock_ofd without the wait, -1 with errno EAGAIN when someone else holds the file
+int trylock_ofd(int fd, LockType type) {
+    if (fd < 0) return -1;
+
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_whence = SEEK_SET;
+    fl.l_type = (type == LOCK_EXCLUSIVE) ? F_WRLCK : F_RDLCK;
+
+    if (fcntl(fd, F_OFD_SETLK, &fl) < 0) {
+        if (errno == EACCES) errno = EAGAIN;
+        return -1;
+    }
+
+    return 0;
+}
 int unlock_fd(int fd) {
     if (fd < 0) return -1;
 
@@ -181,3 +220,42 @@ int unlock_fd(int fd) {
 
     return 0;
 }
+
+void stampHeader(msg_header* hdr) {
+    hdr->magic = PROTOCOL_MAGIC;
+    hdr->version = PROTOCOL_VERSION;
+}
+
+// only the first HEADER_PREFIX_LEN bytes need to be in. An older peer's header is shorter than ours,
+// waiting for all of it before looking could stall both sides
+int checkVersion(const msg_header* hdr) {
+    if (hdr->magic != PROTOCOL_MAGIC || hdr->version != PROTOCOL_VERSION) {
+        fprintf(stderr, "Peer speaks another protocol (magic %04x version %u, we speak %u)\n",
+                hdr->magic, hdr->version, PROTOCOL_VERSION);
+        return -1;
+    }
+    return 0;
+}
+
+// 0 for a frame we can take: our protocol version and a payload we are willing to hold in memory
+int checkHeader(const msg_header* hdr) {
+    if (checkVersion(hdr) < 0) {
+        return -1;
+    }
+    if (hdr->payloadLength > MAX_PAYLOAD_LEN) {
+        fprintf(stderr, "Frame payload of %llu bytes refused\n", (unsigned long long)hdr->payloadLength);
+        return -1;
+    }
+    return 0;
+}
+
+// a file offset as typed, digits only and within off_t. atoi would wrap past 2GB
+int parseOffset(const char* s, uint64_t* out) {
+    char* end;
+    if (*s < '0' || *s > '9') return -1;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno != 0 || *end != '\0' || v > (unsigned long long)INT64_MAX) return -1;
+    *out = v;
+    return 0;
+}
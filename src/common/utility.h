@@ -4,7 +4,7 @@
 #include <stdint.h>
 
 #define ABS_PATH 1024
-#define MAXARGS 5
+#define MAXARGS 8
 #define PAYLOAD 1024
 #define MAX_USERNAME_LEN 20
 
@@ -14,8 +14,29 @@
 
 #define SOCKT_MAX 128
 
+// every frame opens with the magic and the version. A peer from before the version field put its
+// msg_type there, the magic keeps it from passing for a version
+#define PROTOCOL_MAGIC 0x4654
+#define PROTOCOL_VERSION 3
+#define HEADER_PREFIX_LEN 4            // magic and version, a server checks them before waiting for the rest
+#define MAX_PAYLOAD_LEN (1ULL << 30)   // largest frame payload either side accepts
+
 typedef enum { LOCK_SHARED, LOCK_EXCLUSIVE } LockType;
-typedef enum {TEXT, LSRES, CMDREQ, READCMD, WRITECMD, BACKGROUND, DOWNLOAD_RES, UPLOAD_RES} msg_type;
+typedef enum {TEXT, LSRES, CMDREQ, READCMD, WRITECMD, BACKGROUND, DOWNLOAD_RES, UPLOAD_RES, BATCH, BATCHRES, BUSY, DATA, QUEUED, CANCEL} msg_type;
+
+#define BATCH_STOP_ON_ERROR 0x1 // BATCH requests carry their flags in the header status
+// a BUSY reply carries the milliseconds to wait before retrying in the header status
+// a QUEUED reply is not final, status holds the position and the transfer's replies follow once it starts
+#define CMD_INBAND_DATA 0x1     // download/upload CMDREQ: the file travels as DATA frames on this connection
+#define CMD_PACKED_REPLIES 0x2  // CMDREQ: READCMD/LSRES may come back zlib packed
+// a DATA, READCMD or LSRES frame with a nonzero status is zlib packed, status holds its inflated length
+#define DATA_CHUNK 65536        // largest DATA payload, frames of concurrent streams interleave at this size
+#define RESUME_TAIL 65536       // bytes before the resume point whose checksum both sides compare
+// DATA frames carry the req_id of the download/upload that opened the stream, an empty one ends it
+// a read streams its bytes as READCMD frames of up to DATA_CHUNK, an empty one ends it. A CANCEL
+// with the read's req_id and no payload stops it early, no reply of its own comes back
+// a WRITECMD carries the command only, the content follows as WRITECMD frames with its req_id and
+// an empty one ends it
 
 int validate_ipv4(const char* ip);
 int validate_port(int port);
@@ -27,16 +48,80 @@ int sendMessage(int fd, const char* msg);
 int lock_file(const char *path, LockType type);
 void unlock_file(int fd);
 int lock_fd(int fd, LockType type);
+int lock_ofd(int fd, LockType type);
+int trylock_ofd(int fd, LockType type);
 int unlock_fd(int fd);
+int parseOffset(const char* s, uint64_t* out);
 
 
 typedef struct {
+    uint16_t magic;         // PROTOCOL_MAGIC
+    uint16_t version;       // PROTOCOL_VERSION
     msg_type type;
     uint32_t status;
-    uint32_t payloadLength;
+    uint32_t req_id;        // set by the client, echoed in every reply to it. 0 for unsolicited notifications
+    uint64_t payloadLength;
     uint8_t  is_background;
 } msg_header;
 
+void stampHeader(msg_header* hdr);
+int checkVersion(const msg_header* hdr);
+int checkHeader(const msg_header* hdr);
+
+// BATCH payload: NUL separated commands. BATCHRES payload: a batch_summary, then one
+// batch_record per reply frame the commands produced, each followed by length bytes of payload
+typedef struct {
+    uint32_t total;     // commands in the batch
+    uint32_t run;       // commands executed, less than total once a failure stopped the batch
+    uint32_t failed;
+} batch_summary;
+
+typedef struct {
+    uint32_t index;     // 0 based position of the command in the batch
+    uint32_t type;      // msg_type the reply would have had outside a batch
+    uint32_t status;
+    uint32_t length;
+} batch_record;
+
+// resumed upload: the server tells what it already holds, the client answers with the
+// uint64_t offset it sends from, 0 when the tails differ and the file starts over
+typedef struct {
+    uint64_t size;
+    uint32_t tail_crc;  // crc32c of the last min(size, RESUME_TAIL) bytes
+    uint32_t reserved;
+} resume_info;
+
+// -p N: every data connection starts with the slice of the file it carries, an upload slice
+// is followed by its CRC32C
+#define MAX_PARALLEL_STREAMS 16
+typedef struct {
+    uint64_t size;      // whole file, the receiving side preallocates it
+    uint64_t offset;
+    uint64_t length;
+} range_header;
+
+// upload -d: the server describes the blocks of its copy, a delta_header followed by one
+// block_sig per block. The client answers with delta_ops, a DELTA_LITERAL followed by its bytes
+#define DELTA_LITERAL_MAX 65536
+typedef struct {
+    uint64_t size;          // the server's copy, 0 when there is none
+    uint32_t block_size;
+    uint32_t blocks;        // the last one may be short
+} delta_header;
+
+typedef struct {
+    uint32_t weak;          // rolling checksum
+    uint32_t crc;           // crc32c and zlib's crc32 of the block, together the strong sum
+    uint32_t crc2;
+} block_sig;
+
+enum { DELTA_COPY = 1, DELTA_LITERAL, DELTA_END };
+typedef struct {
+    uint32_t type;
+    uint32_t block;         // DELTA_COPY: first block of the server's copy
+    uint32_t count;         // blocks to copy, literal bytes, or for DELTA_END the crc32c of the new file
+} delta_op;
+
 typedef struct {
     char name[56];
     char perms[11];
@@ -47,6 +132,12 @@ typedef struct {
     int port;
     char dest_path[256];
     int is_bg;
+    uint32_t req_id;    // stream id of an in-band transfer
+    int resume;         // the data starts with the resume handshake
+    int streams;        // parallel transfer over this many connections
+    int compress;       // -z: the data stream opens with STREAM_PACKED or STREAM_PLAIN
+    int delta;          // -d: the data connection carries the delta exchange
+    resume_info remote; // what the server holds, for an in-band upload resume
 } bg_download_args;
 
 #endif
\ No newline at end of file
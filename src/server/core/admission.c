@@ -0,0 +1,270 @@
+// admission control: every session and transfer takes a slot of the registry before it is served.
+// Refused clients get a BUSY frame with a retry hint instead of a process of their own, transfers
+// over the limits wait in the registry's queue first and only get BUSY once it is full
+
+#define _GNU_SOURCE
+
+#include "core/admission.h"
+#include "net/net.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define SESSION_RETRY_MS 1000
+#define TRANSFER_RETRY_MS 500
+
+typedef struct {
+    int sessions;
+    int from_addr;      // sessions coming from the address being admitted
+    int transfers;
+    int user_transfers; // transfers of the user being admitted
+    int free_slot;
+} AdmissionCounts;
+
+// registry->mux held
+static void countAdmitted(uint32_t addr, const char* user, AdmissionCounts* c) {
+    memset(c, 0, sizeof(*c));
+    c->free_slot = -1;
+    for (int i = 0; i < MAX_ADMITTED; i++) {
+        AdmissionSlot* s = &registry->admitted[i];
+        if (s->kind == ADMIT_FREE) {
+            if (c->free_slot < 0) c->free_slot = i;
+        } else if (s->kind == ADMIT_SESSION) {
+            c->sessions++;
+            if (s->addr == addr) c->from_addr++;
+        } else {
+            c->transfers++;
+            if (user && strcmp(s->user, user) == 0) c->user_transfers++;
+        }
+    }
+}
+
+// registry->mux held. Processes killed before they could give their slot back
+static int reclaimStale(void) {
+    int reclaimed = 0;
+    for (int i = 0; i < MAX_ADMITTED; i++) {
+        AdmissionSlot* s = &registry->admitted[i];
+        if (s->kind != ADMIT_FREE && s->pid != getpid() && kill(s->pid, 0) < 0 && errno == ESRCH) {
+            s->kind = ADMIT_FREE;
+            reclaimed++;
+        }
+    }
+    return reclaimed;
+}
+
+static const char* overLimit(Server* server, AdmissionKind kind, const AdmissionCounts* c) {
+    if (c->free_slot < 0) {
+        return "Server full";
+    }
+    if (kind == ADMIT_SESSION) {
+        if (server->max_sessions > 0 && c->sessions >= server->max_sessions) {
+            return "Too many sessions";
+        }
+        if (server->max_per_ip > 0 && c->from_addr >= server->max_per_ip) {
+            return "Too many sessions from your address";
+        }
+    } else if (server->max_transfers > 0 && c->transfers >= server->max_transfers) {
+        return "Too many transfers in progress";
+    } else if (server->max_user_transfers > 0 && c->user_transfers >= server->max_user_transfers) {
+        return "Too many of your transfers in progress";
+    }
+    return NULL;
+}
+
+// jittered so clients refused together don't all come back together
+static uint32_t retryAfter(AdmissionKind kind) {
+    uint32_t base = (kind == ADMIT_SESSION) ? SESSION_RETRY_MS : TRANSFER_RETRY_MS;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return base + (uint32_t)(ts.tv_nsec / 1000) % base;
+}
+
+static int admit(Server* server, AdmissionKind kind, uint32_t addr, uint32_t* retry_ms, const char** reason) {
+    AdmissionCounts c;
+    sem_wait(&registry->mux);
+    countAdmitted(addr, NULL, &c);
+    const char* refused = overLimit(server, kind, &c);
+    // the scan for dead owners costs a syscall per slot, only pay it before turning someone away
+    if (refused && reclaimStale() > 0) {
+        countAdmitted(addr, NULL, &c);
+        refused = overLimit(server, kind, &c);
+    }
+    if (refused) {
+        sem_post(&registry->mux);
+        *retry_ms = retryAfter(kind);
+        *reason = refused;
+        return -1;
+    }
+    AdmissionSlot* s = &registry->admitted[c.free_slot];
+    s->kind = kind;
+    s->pid = getpid();
+    s->addr = addr;
+    s->user[0] = '\0';
+    sem_post(&registry->mux);
+    return c.free_slot;
+}
+
+int admitSession(Server* server, uint32_t addr, uint32_t* retry_ms, const char** reason) {
+    return admit(server, ADMIT_SESSION, addr, retry_ms, reason);
+}
+
+// registry->mux held. Queue order: foreground before background, then first come first served
+static int servedBefore(const QueuedTransfer* q, int priority, uint32_t ticket) {
+    return q->priority < priority || (q->priority == priority && q->ticket < ticket);
+}
+
+// registry->mux held. Whether a waiting transfer could start right now
+static int runnable(Server* server, const QueuedTransfer* q) {
+    AdmissionCounts c;
+    countAdmitted(0, q->user, &c);
+    return overLimit(server, ADMIT_TRANSFER, &c) == NULL;
+}
+
+// a new transfer passes *ticket == 0, one already queued its ticket. Returns the slot, -1 when
+// refused or ADMIT_QUEUED with *ticket and its 1-based *position set. Without ticket (NULL)
+// nothing is queued. A transfer only starts when none served before it could start instead
+int admitTransfer(Server* server, const char* user, int priority, uint32_t* ticket, int* position,
+                  uint32_t* retry_ms, const char** reason) {
+    uint32_t mine = (ticket && *ticket) ? *ticket : UINT32_MAX;
+    AdmissionCounts c;
+    sem_wait(&registry->mux);
+    countAdmitted(0, user, &c);
+    const char* refused = overLimit(server, ADMIT_TRANSFER, &c);
+    if (refused && reclaimStale() > 0) {
+        countAdmitted(0, user, &c);
+        refused = overLimit(server, ADMIT_TRANSFER, &c);
+    }
+    int ahead = 0;
+    QueuedTransfer* own = NULL;
+    QueuedTransfer* free_entry = NULL;
+    for (int i = 0; i < MAX_QUEUED; i++) {
+        QueuedTransfer* q = &registry->queued[i];
+        if (q->ticket == 0) {
+            if (!free_entry) free_entry = q;
+        } else if (q->ticket == mine) {
+            own = q;
+        } else if (servedBefore(q, priority, mine)) {
+            ahead++;
+            if (!refused && runnable(server, q)) refused = "Other transfers are waiting";
+        }
+    }
+    if (!refused) {
+        AdmissionSlot* s = &registry->admitted[c.free_slot];
+        s->kind = ADMIT_TRANSFER;
+        s->pid = getpid();
+        s->addr = 0;
+        snprintf(s->user, sizeof(s->user), "%s", user);
+        if (own) own->ticket = 0;
+        sem_post(&registry->mux);
+        return c.free_slot;
+    }
+    if (!own && ticket && c.free_slot >= 0 && free_entry) {
+        own = free_entry;
+        if (++registry->next_ticket == 0) registry->next_ticket = 1;
+        own->ticket = registry->next_ticket;
+        own->pid = getpid();
+        own->priority = priority;
+        snprintf(own->user, sizeof(own->user), "%s", user);
+        *ticket = own->ticket;
+    }
+    sem_post(&registry->mux);
+    *reason = refused;
+    if (own) {
+        *position = ahead + 1;
+        return ADMIT_QUEUED;
+    }
+    *retry_ms = retryAfter(ADMIT_TRANSFER);
+    return -1;
+}
+
+// the sessions holding queued transfers look again whether one of theirs may start. Entries
+// whose process is gone would hold up everyone behind them and are dropped
+static void wakeQueued(void) {
+    sem_wait(&registry->mux);
+    for (int i = 0; i < MAX_QUEUED; i++) {
+        QueuedTransfer* q = &registry->queued[i];
+        if (q->ticket != 0 && kill(q->pid, SIGUSR1) < 0 && errno == ESRCH) {
+            q->ticket = 0;
+        }
+    }
+    sem_post(&registry->mux);
+}
+
+// a session going away gives up its place in the queue
+void dropQueuedTransfer(uint32_t ticket) {
+    if (ticket == 0) return;
+    sem_wait(&registry->mux);
+    for (int i = 0; i < MAX_QUEUED; i++) {
+        if (registry->queued[i].ticket == ticket) registry->queued[i].ticket = 0;
+    }
+    sem_post(&registry->mux);
+    wakeQueued();
+}
+
+// called by the parent right after fork. A child that is already done has freed the slot,
+// which then is left alone
+void handOverAdmission(int slot, pid_t pid) {
+    if (slot < 0) return;
+    sem_wait(&registry->mux);
+    AdmissionSlot* s = &registry->admitted[slot];
+    if (s->kind != ADMIT_FREE && s->pid == getpid()) {
+        s->pid = pid;
+    }
+    sem_post(&registry->mux);
+}
+
+void releaseAdmission(int slot) {
+    if (slot < 0) return;
+    sem_wait(&registry->mux);
+    int was_transfer = registry->admitted[slot].kind == ADMIT_TRANSFER;
+    registry->admitted[slot].kind = ADMIT_FREE;
+    sem_post(&registry->mux);
+    if (was_transfer) wakeQueued();
+}
+
+void releaseAdmissionsOf(pid_t pid) {
+    int transfers = 0;
+    sem_wait(&registry->mux);
+    for (int i = 0; i < MAX_ADMITTED; i++) {
+        if (registry->admitted[i].kind != ADMIT_FREE && registry->admitted[i].pid == pid) {
+            if (registry->admitted[i].kind == ADMIT_TRANSFER) transfers++;
+            registry->admitted[i].kind = ADMIT_FREE;
+        }
+    }
+    sem_post(&registry->mux);
+    if (transfers > 0) wakeQueued();
+}
+
+// straight from the accept path: never blocks, a client that can't take the reply just loses it
+int refuseBusy(int fd, uint32_t retry_ms, const char* reason) {
+    msg_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = BUSY;
+    hdr.status = retry_ms;
+    hdr.payloadLength = strlen(reason) + 1;
+    stampHeader(&hdr);
+    if (send(fd, &hdr, sizeof(hdr), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(hdr) ||
+        send(fd, reason, hdr.payloadLength, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)hdr.payloadLength) {
+        return -1;
+    }
+    return 0;
+}
+
+void printAdmission(Server* server) {
+    AdmissionCounts c;
+    int queued = 0;
+    sem_wait(&registry->mux);
+    countAdmitted(0, NULL, &c);
+    for (int i = 0; i < MAX_QUEUED; i++) {
+        if (registry->queued[i].ticket != 0) queued++;
+    }
+    sem_post(&registry->mux);
+    printf("[Admission] sessions %d/%d, transfers %d/%d, queued %d/%d, per address limit %d, per user limit %d (0 = unlimited)\n",
+           c.sessions, server->max_sessions, c.transfers, server->max_transfers, queued, MAX_QUEUED,
+           server->max_per_ip, server->max_user_transfers);
+}
@@ -0,0 +1,23 @@
+// admission control for the accept path and for transfers, the live counts sit in the shared
+// registry so every process serving clients enforces the same limits
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "core/server.h"
+
+int admitSession(Server* server, uint32_t addr, uint32_t* retry_ms, const char** reason);
+#define ADMIT_QUEUED -2
+
+int admitTransfer(Server* server, const char* user, int priority, uint32_t* ticket, int* position,
+                  uint32_t* retry_ms, const char** reason);
+void dropQueuedTransfer(uint32_t ticket);
+void handOverAdmission(int slot, pid_t pid);
+void releaseAdmission(int slot);
+void releaseAdmissionsOf(pid_t pid);
+int refuseBusy(int fd, uint32_t retry_ms, const char* reason);
+void printAdmission(Server* server);
+#endif
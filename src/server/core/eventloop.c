@@ -0,0 +1,369 @@
+// runs every client session inside one process, each session is a small state machine fed by epoll
+// instead of a forked process blocked in readAll()
+
+#define _GNU_SOURCE
+
+#include "core/eventloop.h"
+#include "core/admission.h"
+#include "handler/handlers.h"
+#include "net/net.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENTS 256
+#define TICK_MS 1000            // pace at which deferred commands are retried
+#define CLIENT_SEND_TIMEOUT 5   // seconds a stuck client may hold the loop while we reply
+
+typedef enum { CONN_READ_HEADER, CONN_READ_PAYLOAD, CONN_DEFERRED } ConnState;
+
+typedef struct {
+    int fd;
+    ConnState state;
+    msg_header hdr;
+    size_t got;             // bytes of the current header or payload received so far
+    char* payload;
+    char* retry;            // untouched copy of a deferred command, dispatch tokenizes in place
+    ClientSession session;
+} Conn;
+
+static int epoll_fd = -1;
+static int listen_fd = -1;
+static Conn** conns = NULL; // indexed by fd
+static int conns_cap = 0;
+static Server* loop_server = NULL;
+
+static int watchConn(Conn* c, uint32_t events, int op) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = c->fd;
+    if (epoll_ctl(epoll_fd, op, c->fd, &ev) < 0) {
+        perror("[eventLoop] epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static Conn* addConn(int fd) {
+    if (fd >= conns_cap) {
+        int cap = conns_cap ? conns_cap : 64;
+        while (cap <= fd) cap *= 2;
+        Conn** grown = realloc(conns, cap * sizeof(Conn*));
+        if (!grown) return NULL;
+        memset(grown + conns_cap, 0, (cap - conns_cap) * sizeof(Conn*));
+        conns = grown;
+        conns_cap = cap;
+    }
+    Conn* c = calloc(1, sizeof(Conn));
+    if (!c) return NULL;
+    c->fd = fd;
+    c->state = CONN_READ_HEADER;
+    c->session.state = STATE_NOT_LOGGED_IN;
+    c->session.helper_fd = -1;
+    c->session.admission_slot = -1;
+    if (watchConn(c, EPOLLIN, EPOLL_CTL_ADD) < 0) {
+        free(c);
+        return NULL;
+    }
+    conns[fd] = c;
+    return c;
+}
+
+static void dropConn(Conn* c) {
+    // explicit removal, forked transfer children may still hold a copy of the fd
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    conns[c->fd] = NULL;
+    closeClientSession(c->fd, &c->session);
+    free(c->payload);
+    free(c->retry);
+    free(c);
+}
+
+static void runMessage(Server* server, Conn* c) {
+    printf("[eventLoop] fd %d Received Type: %d, Size: %llu\n", c->fd, c->hdr.type, (unsigned long long)c->hdr.payloadLength);
+
+    char* retry = NULL;
+    if (c->hdr.type == CMDREQ || (c->hdr.type == WRITECMD && c->hdr.req_id != c->session.write.req_id)) {
+        retry = strdup(c->payload); // a write's command, not one of its chunks
+    }
+    dispatch_deferred = 0;
+    dispatchCommands(c->fd, &c->hdr, c->payload, server, &c->session);
+    free(c->payload);
+    c->payload = NULL;
+
+    if (dispatch_deferred && retry) {
+        // park the session, nothing more is read from it until the command completes
+        c->retry = retry;
+        c->state = CONN_DEFERRED;
+        watchConn(c, EPOLLRDHUP, EPOLL_CTL_MOD);
+        return;
+    }
+    free(retry);
+}
+
+// drains whatever the socket holds, dispatching every complete message. -1 means drop the session
+static int readConn(Server* server, Conn* c) {
+    while (c->state != CONN_DEFERRED) {
+        char* dst;
+        size_t need;
+        if (c->state == CONN_READ_HEADER) {
+            dst = (char*)&c->hdr + c->got;
+            need = sizeof(c->hdr) - c->got;
+        } else {
+            dst = c->payload + c->got;
+            need = c->hdr.payloadLength - c->got;
+        }
+
+        ssize_t n = recv(c->fd, dst, need, MSG_DONTWAIT);
+        if (n == 0) {
+            printf("[eventLoop] Client on fd %d closed connection\n", c->fd);
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror("[eventLoop] recv");
+            return -1;
+        }
+        c->got += n;
+
+        if (c->state == CONN_READ_HEADER) {
+            if (c->got >= HEADER_PREFIX_LEN && checkVersion(&c->hdr) < 0) return -1;
+            if (c->got < sizeof(c->hdr)) continue;
+            if (checkHeader(&c->hdr) < 0) return -1;
+            c->got = 0;
+            c->payload = malloc(c->hdr.payloadLength + 1); // +1 for safety null terminator
+            if (!c->payload) return -1;
+            if (c->hdr.payloadLength > 0) {
+                c->state = CONN_READ_PAYLOAD;
+                continue;
+            }
+        } else if (c->got < c->hdr.payloadLength) {
+            continue;
+        }
+
+        c->payload[c->hdr.payloadLength] = '\0';
+        c->state = CONN_READ_HEADER;
+        c->got = 0;
+        runMessage(server, c);
+    }
+    return 0;
+}
+
+static void retryDeferred(Server* server) {
+    for (int fd = 0; fd < conns_cap; fd++) {
+        Conn* c = conns[fd];
+        if (!c || c->state != CONN_DEFERRED) continue;
+
+        c->payload = c->retry;
+        c->retry = NULL;
+        c->state = CONN_READ_HEADER;
+        runMessage(server, c);
+        if (c->state != CONN_DEFERRED) {
+            // level triggered, anything pipelined meanwhile wakes us up again
+            watchConn(c, EPOLLIN, EPOLL_CTL_MOD);
+        }
+    }
+}
+
+static void acceptClients(Server* server) {
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int client_sfd = accept(listen_fd, (struct sockaddr*)&addr, &len);
+        if (client_sfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        // replies are still written with blocking writeAll, bound how long one peer can stall the loop
+        struct timeval tv = { .tv_sec = CLIENT_SEND_TIMEOUT, .tv_usec = 0 };
+        setsockopt(client_sfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        uint32_t retry_ms;
+        const char* reason;
+        int slot = admitSession(server, addr.sin_addr.s_addr, &retry_ms, &reason);
+        if (slot < 0) {
+            printf("[Admission] Refusing %s: %s\n", inet_ntoa(addr.sin_addr), reason);
+            refuseBusy(client_sfd, retry_ms, reason);
+            close(client_sfd);
+            continue;
+        }
+        Conn* c = addConn(client_sfd);
+        if (!c) {
+            fprintf(stderr, "[eventLoop] Cannot track client fd %d\n", client_sfd);
+            releaseAdmission(slot);
+            close(client_sfd);
+            continue;
+        }
+        c->session.admission_slot = slot;
+        printf("[eventLoop] Accepted client on fd %d\n", client_sfd);
+    }
+}
+
+// the listener is the new server's now, keep serving what we hold until it is gone
+static void stopAccepting(Server* server) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    server->sfd = -1;
+    int left = 0;
+    for (int fd = 0; fd < conns_cap; fd++) {
+        if (conns[fd]) left++;
+    }
+    printf("[Drain] Stopped accepting, %d session(s) left\n", left);
+}
+
+static int sessionsLeft(void) {
+    for (int fd = 0; fd < conns_cap; fd++) {
+        if (conns[fd]) return 1;
+    }
+    return live_children > 0;
+}
+
+static void watchFd(int fd) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("[eventLoop] epoll_ctl");
+    }
+}
+
+static long monotonicMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+int runEventLoop(Server* server) {
+    // a peer vanishing mid reply must not take every other session down with it
+    signal(SIGPIPE, SIG_IGN);
+    setup_signal_handling();
+
+    // SIGUSR1 is only let through while waiting, so a notification can't slip between check and wait
+    sigset_t blocked, wait_mask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &blocked, &wait_mask);
+    sigdelset(&wait_mask, SIGUSR1);
+
+    listen_fd = server->sfd;
+    loop_server = server;
+    int flags = fcntl(listen_fd, F_GETFL, 0);
+    fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK);
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = listen_fd };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("epoll_ctl listen");
+        return -1;
+    }
+    ev.data.fd = STDIN_FILENO;
+    if (server->has_console && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0) {
+        // e.g. stdin redirected from a regular file, the console is simply unavailable
+        fprintf(stderr, "[eventLoop] Console input not available\n");
+        server->has_console = 0;
+    }
+    if (server->handoff_fd >= 0) watchFd(server->handoff_fd);
+
+    struct epoll_event events[MAX_EVENTS];
+    long last_tick = monotonicMs();
+    int running = 1;
+
+    while (running) {
+        if (drain_requested && listen_fd >= 0) stopAccepting(server);
+        if (listen_fd < 0 && !sessionsLeft()) {
+            printf("[Drain] Every session is done\n");
+            break;
+        }
+        int n = epoll_pwait(epoll_fd, events, MAX_EVENTS, TICK_MS, &wait_mask);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("epoll_pwait");
+                break;
+            }
+            n = 0;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                acceptClients(server);
+            } else if (fd == server->handoff_fd || fd == server->handoff_conn) {
+                // serviceHandoff() closes the fds it is done with, epoll forgets them by itself
+                int pending = server->handoff_conn;
+                serviceHandoff(server, fd);
+                if (server->handoff_conn >= 0 && server->handoff_conn != pending) watchFd(server->handoff_conn);
+            } else if (server->has_console && fd == STDIN_FILENO) {
+                int ret = handleConsoleInput(server);
+                if (ret == 1) running = 0;
+                else if (ret < 0) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                    server->has_console = 0;
+                }
+            } else if (fd < conns_cap && conns[fd]) {
+                Conn* c = conns[fd];
+                if (c->state == CONN_DEFERRED) {
+                    if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) dropConn(c);
+                } else if (readConn(server, c) < 0) {
+                    dropConn(c);
+                }
+            }
+        }
+
+        if (transfer_signal_received) {
+            transfer_signal_received = 0;
+            for (int fd = 0; fd < conns_cap; fd++) {
+                if (conns[fd]) check_for_notifications(fd, &conns[fd]->session);
+            }
+        }
+
+        long now = monotonicMs();
+        if (now - last_tick >= TICK_MS) {
+            last_tick = now;
+            retryDeferred(server);
+        }
+    }
+
+    for (int fd = 0; fd < conns_cap; fd++) {
+        if (conns[fd]) dropConn(conns[fd]);
+    }
+    free(conns);
+    conns = NULL;
+    conns_cap = 0;
+    close(epoll_fd);
+    epoll_fd = -1;
+    return 0;
+}
+
+// called in children forked from a handler, they only need the one client they serve
+void releaseEngineFds(int keep_fd) {
+    if (epoll_fd < 0) return; // fork engine, the child already owns a single client
+
+    close(epoll_fd);
+    epoll_fd = -1;
+    if (listen_fd >= 0) close(listen_fd);
+    if (loop_server->handoff_fd >= 0) close(loop_server->handoff_fd);
+    if (loop_server->handoff_conn >= 0) close(loop_server->handoff_conn);
+    for (int fd = 0; fd < conns_cap; fd++) {
+        if (!conns[fd]) continue;
+        closeUploadStreams(&conns[fd]->session);
+        if (fd != keep_fd) close(fd);
+    }
+}
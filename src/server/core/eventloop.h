@@ -0,0 +1,10 @@
+// epoll based connection engine, alternative to the fork per client model of startServer
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "core/server.h"
+
+int runEventLoop(Server* server);
+void releaseEngineFds(int keep_fd);
+#endif
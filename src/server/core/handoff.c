@@ -0,0 +1,173 @@
+// listener handoff between two server binaries over <root>/tmp/handoff.sock. Only root can
+// connect to it, the new binary is started with sudo like the old one was
+
+#define _GNU_SOURCE
+
+#include "core/handoff.h"
+#include "net/net.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define HANDOFF_SOCK_REL "/tmp/handoff.sock"
+#define HANDOFF_GO 'G'
+
+static void handoffPath(const char* root_dir, const char* suffix, char* path, size_t len) {
+    snprintf(path, len, "%s/%s%s", root_dir, HANDOFF_SOCK_REL, suffix);
+}
+
+// bound next to the real path like the helper socket, published once this server serves
+int openHandoffListener(Server* server) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    handoffPath(server->Root, ".new", addr.sun_path, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("handoff socket");
+        return -1;
+    }
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        chmod(addr.sun_path, 0600) < 0 ||
+        listen(fd, 1) < 0) {
+        perror("handoff listener");
+        close(fd);
+        return -1;
+    }
+    server->handoff_fd = fd;
+    return 0;
+}
+
+int publishHandoffSocket(const char* root_dir) {
+    char from[PATH_MAX], to[PATH_MAX];
+    handoffPath(root_dir, ".new", from, sizeof(from));
+    handoffPath(root_dir, "", to, sizeof(to));
+    if (rename(from, to) < 0) {
+        perror("publish handoff socket");
+        return -1;
+    }
+    return 0;
+}
+
+// old side: the new server connected, give it our listeners. We keep accepting on them until
+// it confirms it serves, so no connection waits on a server that failed to start
+int acceptHandoff(Server* server) {
+    int conn = accept4(server->handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+        if (errno != EINTR && errno != EAGAIN) perror("handoff accept");
+        return -1;
+    }
+    if (server->handoff_conn >= 0) {
+        fprintf(stderr, "[Handoff] A takeover is already in progress, refusing another one\n");
+        close(conn);
+        return -1;
+    }
+
+    HandoffInfo info;
+    memset(&info, 0, sizeof(info));
+    snprintf(info.ip, sizeof(info.ip), "%s", server->Ip);
+    info.port = server->Port;
+    info.workers = server->workers;
+    info.nfds = server->workers > 0 ? server->workers : 1;
+    int* fds = server->workers > 0 ? server->worker_sfds : &server->sfd;
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = &info, .iov_len = sizeof(info) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * info.nfds),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * info.nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * info.nfds);
+
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(info)) {
+        perror("handoff sendmsg");
+        close(conn);
+        return -1;
+    }
+    server->handoff_conn = conn;
+    printf("[Handoff] Sent %d listener(s) to the new server, waiting for it to start\n", info.nfds);
+    return 0;
+}
+
+// 1 once the new server serves, 0 if it went away before that and we simply carry on
+int readHandoffAck(Server* server) {
+    char go = 0;
+    ssize_t n;
+    while ((n = read(server->handoff_conn, &go, 1)) < 0 && errno == EINTR);
+    close(server->handoff_conn);
+    server->handoff_conn = -1;
+    if (n == 1 && go == HANDOFF_GO) {
+        printf("[Handoff] New server is serving, draining our sessions\n");
+        return 1;
+    }
+    fprintf(stderr, "[Handoff] Takeover aborted, still serving\n");
+    return 0;
+}
+
+// new side, before anything is bound. Returns the connection confirmHandoff() answers on
+int receiveHandoff(const char* root_dir, HandoffInfo* info, int* fds) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    handoffPath(root_dir, "", addr.sun_path, sizeof(addr.sun_path));
+
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn < 0) {
+        perror("handoff socket");
+        return -1;
+    }
+    if (connect(conn, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect to running server");
+        close(conn);
+        return -1;
+    }
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = { .iov_base = info, .iov_len = sizeof(*info) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, 0)) < 0 && errno == EINTR);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(*info) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        info->nfds < 1 || info->nfds > HANDOFF_MAX_FDS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * info->nfds)) {
+        fprintf(stderr, "[Handoff] Malformed handoff from the running server\n");
+        close(conn);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * info->nfds);
+    return conn;
+}
+
+// new side, chrooted and listening: move the sockets in place and let the old server drain
+int confirmHandoff(Server* server) {
+    if (publishHelperSocket("") < 0 || publishHandoffSocket("") < 0) {
+        return -1;
+    }
+    char go = HANDOFF_GO;
+    int ret = write(server->handoff_conn, &go, 1) == 1 ? 0 : -1;
+    close(server->handoff_conn);
+    server->handoff_conn = -1;
+    printf("[Handoff] Took over from the previous server\n");
+    return ret;
+}
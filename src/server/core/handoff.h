@@ -0,0 +1,24 @@
+// hot restart: a new server binary connects to the running one, takes its listening sockets
+// over SCM_RIGHTS and attaches to the same registry, the old one then drains its sessions and exits
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "core/server.h"
+
+#define HANDOFF_MAX_FDS 64
+
+typedef struct {
+    char ip[16];
+    int port;
+    int workers;    // listeners are SO_REUSEPORT ones, one per worker, when > 0
+    int nfds;
+} HandoffInfo;
+
+int openHandoffListener(Server* server);
+int publishHandoffSocket(const char* root_dir);
+int acceptHandoff(Server* server);
+int readHandoffAck(Server* server);
+int receiveHandoff(const char* root_dir, HandoffInfo* info, int* fds);
+int confirmHandoff(Server* server);
+#endif
@@ -1,11 +1,14 @@
 // defines the server process, setupds sockets, accept loop and client creation
 
 
-#define _POSIX_C_SOURCE 200809L // needed for SA_RESTART macro and sigaction
+#define _GNU_SOURCE // needed for SA_RESTART macro, sigaction and SO_REUSEPORT
 
 #include "handler/handlers.h"
 #include "core/server.h"
 #include "helper/helper.h"
+#include "core/eventloop.h"
+#include "core/admission.h"
+#include "core/handoff.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -21,23 +24,29 @@
 #include <signal.h>
 
 #include <sys/select.h>
+#include <time.h>
 
 #include <errno.h>
 
-Server* createServer(char* root, int port, char* ip) {
+#define LISTEN_BACKLOG SOMAXCONN  // bursts queue in the kernel instead of being refused
+#define MAX_RESPAWN_RATE 1         // seconds a crashing worker slot waits before being forked again
+
+static volatile sig_atomic_t reap_in_loop = 0; // the pool parent reaps by itself to learn which worker died
+static volatile sig_atomic_t child_exited = 0;
+static pid_t helper_child = 0; // forked by main in this very process, not a client handler
+
+volatile sig_atomic_t drain_requested = 0;
+volatile sig_atomic_t live_children = 0;
+
+// creates a socket bound to the server address, with reuseport several of them can share it
+static int bindListener(Server* server, int reuseport) {
     struct sockaddr_in addr; // used to bind socket to address using bind()
-    Server* server = malloc(sizeof(Server)); 
-    // we use -> cuz server is a pointer, equivalent to (*server).Port
-    server -> Port = port;
-    snprintf(server -> Root, sizeof(server -> Root), "%s", root);
-    snprintf(server->Ip, sizeof(server->Ip), "%s", ip); // automatically puts \0, better than strncopy
 
     int s = socket(AF_INET, SOCK_STREAM, 0); // creates an endpoint for communicating and returns a file descriptor, -1 if error 
     if (s < 0) {
         perror("socket");
-        return NULL;
+        return -1;
     }
-    server -> sfd = s;
 
     addr.sin_family = AF_INET;
     // network byte order = Big-endian (most significant byte first)
@@ -50,20 +59,57 @@ Server* createServer(char* root, int port, char* ip) {
             fprintf(stderr, "Invalid IP format\n");
         else
             perror("inet_pton");
-        close(server->sfd);
-        return NULL;
+        close(s);
+        return -1;
     }
     memset(addr.sin_zero, 0, sizeof(addr.sin_zero)); // zeroing the padding
     int opt = 1;
-    if (setsockopt(server->sfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) { // avoids address already in use after stopping server
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) { // avoids address already in use after stopping server
         perror("setsockopt");
-        close(server->sfd);
-        return NULL;
+        close(s);
+        return -1;
+    }
+    // the kernel then hashes incoming connections across every socket bound to the port
+    if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        close(s);
+        return -1;
     }
     // cast to sockaddr from sockaddr_in
-    if (bind(server -> sfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) { // assigns address to file descriptor 
+    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) == -1) { // assigns address to file descriptor 
         perror("bind");
-        close(server->sfd);
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static Server* newServer(char* root, int port, char* ip) {
+    Server* server = malloc(sizeof(Server)); 
+    // we use -> cuz server is a pointer, equivalent to (*server).Port
+    server -> Port = port;
+    server -> engine = ENGINE_FORK;
+    server -> workers = 0;
+    server -> worker_sfds = NULL;
+    server -> has_console = 1;
+    server -> max_sessions = 0;
+    server -> max_per_ip = 0;
+    server -> max_transfers = 0;
+    server -> max_user_transfers = 0;
+    server -> data_timeout = DEFAULT_DATA_TIMEOUT;
+    server -> handoff_fd = -1;
+    server -> handoff_conn = -1;
+    server -> handed_off = 0;
+    server -> helper_pid = 0;
+    snprintf(server -> Root, sizeof(server -> Root), "%s", root);
+    snprintf(server->Ip, sizeof(server->Ip), "%s", ip); // automatically puts \0, better than strncopy
+    return server;
+}
+
+Server* createServer(char* root, int port, char* ip) {
+    Server* server = newServer(root, port, ip);
+    server -> sfd = bindListener(server, 0);
+    if (server -> sfd < 0) {
         return NULL;
     }
     int created = createRootDirectory(server->Root, 0755); // rwx-rx-rx
@@ -72,42 +118,127 @@ Server* createServer(char* root, int port, char* ip) {
     }
     return server;
 }  
-int startServer(Server* server) {
-    if (listen(server -> sfd, 20) == -1) {
-        perror("listen");
-        close(server->sfd);
-        return -1;
+
+// takeover: the listeners come from the server being replaced, already bound and listening
+Server* adoptServer(char* root, int port, char* ip, int workers, int* fds) {
+    Server* server = newServer(root, port, ip);
+    if (workers > 0) {
+        server->worker_sfds = malloc(workers * sizeof(int));
+        if (!server->worker_sfds) return NULL;
+        memcpy(server->worker_sfds, fds, workers * sizeof(int));
+        server->workers = workers;
     }
-    sleep(1);
-    printf("Server listening on %s:%d\n", server->Ip, server->Port);
-    printf("Type 'exit' to shut down the server.\n");
-    
+    server->sfd = fds[0];
+    if (createRootDirectory(server->Root, 0755) < 0) {
+        return NULL;
+    }
+    return server;
+}
+
+// done before dropping privileges so low ports still work, one SO_REUSEPORT listener per worker
+int openWorkerListeners(Server* server, int workers) {
+    // the plain listener would keep the port for itself, replace it
+    close(server->sfd);
+    server->worker_sfds = malloc(workers * sizeof(int));
+    if (!server->worker_sfds) return -1;
+
+    for (int i = 0; i < workers; i++) {
+        server->worker_sfds[i] = bindListener(server, 1);
+        if (server->worker_sfds[i] < 0) {
+            while (--i >= 0) close(server->worker_sfds[i]);
+            free(server->worker_sfds);
+            server->worker_sfds = NULL;
+            return -1;
+        }
+    }
+    server->workers = workers;
+    server->sfd = server->worker_sfds[0];
+    return 0;
+}
+
+void closeServerListeners(Server* server) {
+    if (!server->handed_off) {
+        if (server->workers > 0) {
+            for (int i = 0; i < server->workers; i++) close(server->worker_sfds[i]);
+        } else {
+            close(server->sfd);
+        }
+    }
+    if (server->handoff_fd >= 0) close(server->handoff_fd);
+    if (server->handoff_conn >= 0) close(server->handoff_conn);
+    server->handoff_fd = -1;
+    server->handoff_conn = -1;
+}
+
+// the accepted connection or the new server's answer, 1 when the listeners were taken over
+int serviceHandoff(Server* server, int fd) {
+    if (fd == server->handoff_fd) {
+        acceptHandoff(server);
+        return 0;
+    }
+    if (readHandoffAck(server) == 1) {
+        server->handed_off = 1;
+        drain_requested = 1;
+        // a further restart takes over from the new server, its own socket is published by now
+        close(server->handoff_fd);
+        server->handoff_fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+static void onDrainSignal(int signo) {
+    drain_requested = 1;
+}
+
+static int runForkLoop(Server* server) {
     fd_set read_fds;
-    int max_fds = server->sfd;
 
     while (1)
     {
+        if (drain_requested && server->sfd >= 0) {
+            // a newer server accepts from now on, our handler children finish on their own
+            close(server->sfd);
+            server->sfd = -1;
+            printf("[Drain] Stopped accepting, %d handler(s) left\n", (int)live_children);
+        }
+        if (server->sfd < 0 && live_children <= 0) {
+            printf("[Drain] Every session is done\n");
+            break;
+        }
         // macro to clear sete of fds at each iter 
         FD_ZERO(&read_fds);
-        FD_SET(server->sfd, &read_fds); // socket
-        FD_SET(STDIN_FILENO, &read_fds); // input 
+        int max_fds = 0;
+        int watched[] = { server->sfd, server->has_console ? STDIN_FILENO : -1,
+                          server->handoff_fd, server->handoff_conn };
+        for (int i = 0; i < 4; i++) {
+            if (watched[i] < 0) continue;
+            FD_SET(watched[i], &read_fds);
+            if (watched[i] > max_fds) max_fds = watched[i];
+        }
+        // draining, wake up now and then to see whether the last handler exited
+        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
 
-        if (select(max_fds + 1, &read_fds, NULL, NULL, NULL) < 0) {
+        int ready = select(max_fds + 1, &read_fds, NULL, NULL, server->sfd < 0 ? &tv : NULL);
+        if (ready < 0) {
             if (errno == EINTR) continue; 
             perror("select");
             break;
         }
-        if (FD_ISSET(STDIN_FILENO, &read_fds)) {
-            char buffer[256];
-            if (fgets(buffer, sizeof(buffer), stdin)) {
-                buffer[strcspn(buffer, "\n")] = 0;
-                if (strcmp(buffer, "exit") == 0) {
-                    printf("Termination command received. Shutting down...\n");
-                    break;
-                }
-            }
+        if (ready == 0) continue;
+        if (server->has_console && FD_ISSET(STDIN_FILENO, &read_fds)) {
+            int ret = handleConsoleInput(server);
+            if (ret == 1) break;
+            if (ret < 0) server->has_console = 0; // stdin closed, stop polling it
         }
-        if (FD_ISSET(server->sfd, &read_fds)) {
+        if (server->handoff_conn >= 0 && FD_ISSET(server->handoff_conn, &read_fds)) {
+            serviceHandoff(server, server->handoff_conn);
+            continue;
+        }
+        if (server->handoff_fd >= 0 && FD_ISSET(server->handoff_fd, &read_fds)) {
+            serviceHandoff(server, server->handoff_fd);
+        }
+        if (server->sfd >= 0 && FD_ISSET(server->sfd, &read_fds)) {
             struct sockaddr_in addr;
             socklen_t len = sizeof(addr);
             int client_sfd = accept(server->sfd, (struct sockaddr*)&addr, &len); // storing client info for logging
@@ -115,22 +246,36 @@ int startServer(Server* server) {
                 if (errno != EINTR) perror("accept");
                 continue;
             } 
+            // refused before the fork, a connection storm then costs a send and a close each
+            uint32_t retry_ms;
+            const char* reason;
+            int slot = admitSession(server, addr.sin_addr.s_addr, &retry_ms, &reason);
+            if (slot < 0) {
+                printf("[Admission] Refusing %s: %s\n", inet_ntoa(addr.sin_addr), reason);
+                refuseBusy(client_sfd, retry_ms, reason);
+                close(client_sfd);
+                continue;
+            }
             pid_t pid = fork();
             if (pid < 0) {
                 perror("fork");
+                releaseAdmission(slot);
                 close(client_sfd);
                 continue;
             }
             // child 
             if (pid == 0) {
                 close(server->sfd); // close as child won't be accepting any request
+                if (server->handoff_fd >= 0) close(server->handoff_fd);
+                if (server->handoff_conn >= 0) close(server->handoff_conn);
                 // call handle client 
-                handleClient(client_sfd,server);
+                handleClient(client_sfd, server, slot);
                 close(client_sfd); 
                 _exit(0); // performs no cleanup 
             } else { 
                 // parent 
-
+                live_children++;
+                handOverAdmission(slot, pid);
                 close(client_sfd); // no need here
             }
         }
@@ -138,11 +283,215 @@ int startServer(Server* server) {
     return 0;
 }
 
+static int serveClients(Server* server) {
+    if (server->engine == ENGINE_EPOLL) {
+        return runEventLoop(server);
+    }
+    return runForkLoop(server);
+}
+
+// a dead worker can't log its users out, free their slots so they can log in again
+static void releaseRegistryEntriesOf(pid_t pid) {
+    if (registry == NULL) return;
+    sem_wait(&registry->mux);
+    for (int i = 0; i < MAX_USERS; i++) {
+        if (registry->online_users[i].is_active && registry->online_users[i].handler_pid == pid) {
+            registry->online_users[i].is_active = 0;
+        }
+    }
+    sem_post(&registry->mux);
+}
+
+static pid_t spawnWorker(Server* server, int idx) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork worker");
+        return -1;
+    }
+    if (pid == 0) {
+        reap_in_loop = 0; // workers reap their own transfer children
+        live_children = 0;
+        for (int i = 0; i < server->workers; i++) {
+            if (i != idx) close(server->worker_sfds[i]);
+        }
+        server->sfd = server->worker_sfds[idx];
+        server->has_console = 0; // only the parent reads the console
+        // only the parent takes part in a takeover, it tells us to drain with SIGUSR2
+        if (server->handoff_fd >= 0) close(server->handoff_fd);
+        if (server->handoff_conn >= 0) close(server->handoff_conn);
+        server->handoff_fd = -1;
+        server->handoff_conn = -1;
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sigemptyset(&sa.sa_mask);
+        sa.sa_handler = onDrainSignal; // no SA_RESTART, a worker blocked in select must notice
+        sigaction(SIGUSR2, &sa, NULL);
+        printf("[Worker %d] PID %d accepting\n", idx, getpid());
+        int status = serveClients(server);
+        _exit(status < 0 ? 1 : 0);
+    }
+    return pid;
+}
+
+// parent of the pool: owns the console and keeps every worker slot alive
+static int runWorkerPool(Server* server) {
+    pid_t* pids = calloc(server->workers, sizeof(pid_t));
+    time_t* spawned_at = calloc(server->workers, sizeof(time_t));
+    if (!pids || !spawned_at) {
+        free(pids);
+        free(spawned_at);
+        return -1;
+    }
+
+    reap_in_loop = 1;
+    for (int i = 0; i < server->workers; i++) {
+        pids[i] = spawnWorker(server, i);
+        spawned_at[i] = time(NULL);
+    }
+
+    while (1) {
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        int max_fds = 0;
+        int watched[] = { server->has_console ? STDIN_FILENO : -1, server->handoff_fd, server->handoff_conn };
+        for (int i = 0; i < 3; i++) {
+            if (watched[i] < 0) continue;
+            FD_SET(watched[i], &read_fds);
+            if (watched[i] > max_fds) max_fds = watched[i];
+        }
+        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+
+        int ret = select(max_fds + 1, &read_fds, NULL, NULL, &tv);
+        if (ret < 0 && errno != EINTR) {
+            perror("select");
+            break;
+        }
+        if (ret > 0 && server->has_console && FD_ISSET(STDIN_FILENO, &read_fds)) {
+            int cmd = handleConsoleInput(server);
+            if (cmd == 1) break;
+            if (cmd < 0) server->has_console = 0;
+        }
+        if (ret > 0 && server->handoff_conn >= 0 && FD_ISSET(server->handoff_conn, &read_fds) &&
+            serviceHandoff(server, server->handoff_conn) == 1) {
+            // the listeners are the new server's now, workers finish the sessions they hold
+            for (int i = 0; i < server->workers; i++) {
+                close(server->worker_sfds[i]);
+                if (pids[i] > 0) kill(pids[i], SIGUSR2);
+            }
+        } else if (ret > 0 && server->handoff_fd >= 0 && FD_ISSET(server->handoff_fd, &read_fds)) {
+            serviceHandoff(server, server->handoff_fd);
+        }
+
+        if (child_exited) {
+            child_exited = 0;
+            pid_t pid;
+            int status;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                int slot = -1;
+                for (int i = 0; i < server->workers; i++) {
+                    if (pids[i] == pid) slot = i;
+                }
+                if (slot < 0) {
+                    printf("Child %d exited with status %d\n", pid, status);
+                    continue;
+                }
+                printf("[Pool] Worker %d (PID %d) exited with status %d%s\n", slot, pid, status,
+                       server->handed_off ? "" : ", respawning");
+                releaseRegistryEntriesOf(pid);
+                releaseAdmissionsOf(pid);
+                pids[slot] = 0;
+            }
+        }
+        if (server->handed_off) {
+            int left = 0;
+            for (int i = 0; i < server->workers; i++) {
+                if (pids[i] > 0) left++;
+            }
+            if (left == 0) {
+                printf("[Drain] Every worker is done\n");
+                break;
+            }
+            continue;
+        }
+        // the listener of a dead slot stays open here, so its queued connections wait for the new worker
+        for (int i = 0; i < server->workers; i++) {
+            if (pids[i] <= 0 && time(NULL) - spawned_at[i] >= MAX_RESPAWN_RATE) {
+                pids[i] = spawnWorker(server, i);
+                spawned_at[i] = time(NULL);
+            }
+        }
+    }
+
+    for (int i = 0; i < server->workers; i++) {
+        if (pids[i] > 0) {
+            printf("[Pool] Stopping worker %d (PID %d)\n", i, pids[i]);
+            kill(pids[i], SIGTERM);
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+    free(pids);
+    free(spawned_at);
+    return 0;
+}
+
+int startServer(Server* server) {
+    int nlisteners = server->workers > 0 ? server->workers : 1;
+    int* listeners = server->workers > 0 ? server->worker_sfds : &server->sfd;
+    for (int i = 0; i < nlisteners; i++) {
+        if (listen(listeners[i], LISTEN_BACKLOG) == -1) {
+            perror("listen");
+            close(listeners[i]);
+            return -1;
+        }
+    }
+    sleep(1);
+    printf("Server listening on %s:%d (%s engine", server->Ip, server->Port,
+           server->engine == ENGINE_EPOLL ? "epoll" : "fork");
+    if (server->workers > 0) printf(", %d workers", server->workers);
+    printf(")\n");
+    printf("Type 'exit' to shut down the server.\n");
+    helper_child = server->helper_pid;
+
+    // taking over: everything is listening, the old server may stop accepting now
+    if (server->handoff_conn >= 0 && confirmHandoff(server) < 0) {
+        fprintf(stderr, "[Handoff] Cannot complete the takeover\n");
+        return -1;
+    }
+
+    if (server->workers > 0) {
+        return runWorkerPool(server);
+    }
+    return serveClients(server);
+}
+
+// reads one line typed on the server console, returns 1 when the server should shut down
+int handleConsoleInput(Server* server) {
+    char buffer[256];
+    if (!fgets(buffer, sizeof(buffer), stdin)) {
+        return -1;
+    }
+    buffer[strcspn(buffer, "\n")] = 0;
+    if (strcmp(buffer, "exit") == 0) {
+        printf("Termination command received. Shutting down...\n");
+        return 1;
+    }
+    if (strcmp(buffer, "status") == 0) {
+        printHelperPool();
+        printAdmission(server);
+    }
+    return 0;
+}
+
 void sigchld_handler(int signo) {
+    if (reap_in_loop) {
+        child_exited = 1;
+        return;
+    }
     pid_t pid;
     int status;
     char buf[100];
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (pid != helper_child) live_children--;
         int len = snprintf(buf, sizeof(buf), "Child %d exited with status %d\n", pid, status);
         write(STDOUT_FILENO, buf, len);
     }
@@ -211,6 +560,16 @@ int dropPriviledges(struct passwd* pw){
 }
 
 void performFullCleanup(Server* server, pid_t helperPid) {
+    if (server && server->handed_off) {
+        // registry, helper socket and lock file now belong to the server that took over.
+        // Our helper notices we are gone and stops its pool by itself
+        printf("\n[Cleanup] Handed off, leaving the registry to the new server\n");
+        closeServerListeners(server);
+        free(server->worker_sfds);
+        free(server);
+        printf("[Cleanup] Done.\n");
+        return;
+    }
     printf("\n[Cleanup] Starting graceful shutdown...\n");
 
     if (helperPid > 0) {
@@ -223,6 +582,8 @@ void performFullCleanup(Server* server, pid_t helperPid) {
         for (int i = 0; i < MAX_USERS; i++) {
             if (registry->online_users[i].is_active) {
                 pid_t pid = registry->online_users[i].handler_pid;
+                // with the epoll engine the sessions live inside this very process
+                if (pid == getpid()) continue;
                 printf("[Cleanup] Killing handler for %s (PID: %d)\n", 
                         registry->online_users[i].username, pid);
                 
@@ -237,7 +598,8 @@ void performFullCleanup(Server* server, pid_t helperPid) {
     SharedMemCleanup(); 
 
     if (server) {
-        close(server->sfd);
+        closeServerListeners(server);
+        free(server->worker_sfds);
         free(server);
     }
 
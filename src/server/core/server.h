@@ -5,15 +5,43 @@
 
 #include <sys/types.h> // for mode_t
 #include <pwd.h>
+#include <signal.h>
+
+#define DEFAULT_DATA_TIMEOUT 60
+
+// fork: one process per client (default), epoll: one event loop multiplexes every session
+typedef enum { ENGINE_FORK, ENGINE_EPOLL } ServerEngine;
+
 typedef struct { 
     int Port;
     char Root[256]; 
     char Ip[16]; // 15 bytes + 1 for \0
     int sfd;
+    ServerEngine engine;
+    int workers;        // pre-forked workers, 0 when the parent accepts by itself
+    int* worker_sfds;   // one SO_REUSEPORT listener per worker
+    int has_console;    // only the process owning stdin reads console commands
+    int max_sessions;   // admission limits, 0 = unlimited
+    int max_per_ip;
+    int max_transfers;
+    int max_user_transfers;
+    int data_timeout;   // seconds a data connection may sit idle, 0 = forever
+    int handoff_fd;     // a restarted server connects here to take over, -1 outside the top process
+    int handoff_conn;   // takeover in progress, on the old side or the new one
+    int handed_off;     // the listeners now belong to a newer server, only draining is left
+    pid_t helper_pid;
 } Server;
 
+extern volatile sig_atomic_t drain_requested; // stop accepting, exit once the sessions held are done
+extern volatile sig_atomic_t live_children;   // handler and transfer children not reaped yet
+
 Server* createServer(char* root, int port, char* ip);
+Server* adoptServer(char* root, int port, char* ip, int workers, int* fds);
+int openWorkerListeners(Server* server, int workers);
+void closeServerListeners(Server* server);
 int startServer(Server* server);
+int handleConsoleInput(Server* server);
+int serviceHandoff(Server* server, int fd);
 int createRootDirectory(const char* pathname, mode_t mode);
 int dropPriviledges(struct passwd* pw);
 struct passwd* userLookUp();
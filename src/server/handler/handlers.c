@@ -6,10 +6,15 @@
 #include "core/server.h"
 #include "helper/helper.h"
 #include "utils/utils.h"
-
+#include "core/eventloop.h"
+#include "core/admission.h"
 
 
 #include "net/net.h"
+#include "common/crc32c.h"
+#include "common/compress.h"
+#include "common/delta.h"
+#include "utils/copy.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h> // strtok
@@ -21,9 +26,25 @@
 #include <stdlib.h>  // For malloc() and free()
 #include <arpa/inet.h> // For htonl() and ntohl()
 #include <signal.h>
+#include <sys/mman.h> // memfd_create
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sched.h>  // sched_yield
+#include <sys/stat.h>
+#include <fcntl.h>    // splice
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h> // SIOCOUTQ
 
 
 #define BUFFERSIZE 256
+#define QUEUE_RECHECK_MS 1000
+#define CRC_CHUNK (1 << 20)     // sendfile steps, each checksummed while its pages are hot
+#define READ_BUFFER (1 << 20)   // a read stream pulls the file in steps of this size
+#define LOCK_RETRY_MS 50        // how often a handler of its own asks again for a locked file
+#define STREAM_STOPPED -2       // an in-band stream closed early between frames, the session is fine
+#define STREAM_BROKEN -3        // an in-band frame was cut halfway, the session was shut down
 
 
 
@@ -52,10 +73,15 @@ command commands[] = {
     {"transfer_request", handleTransferRequest},
     {"accept", handleAcceptTransfer},
     {"reject", handleRejectTransfer},
+    {"transfers", handleTransfers},
     {NULL, NULL}
 };
 
 volatile sig_atomic_t transfer_signal_received = 0;
+// set by a handler that cannot complete without blocking, the event loop retries the command later
+int dispatch_deferred = 0;
+// the handler's frames go to handleBatch's memfd, not to the client
+static int batch_capture = 0;
 
 void handle_sigusr1(int sig) {
     transfer_signal_received = 1;
@@ -74,9 +100,112 @@ void setup_signal_handling() {
     }
 }
 
-    
+
+// the admission slot a queued transfer was let in with, its handler takes it instead of asking again
+static int granted_slot = -1;
+
+static QueuedCommand* nextQueued(ClientSession* session) {
+    QueuedCommand* next = NULL;
+    for (int i = 0; i < MAX_SESSION_QUEUED; i++) {
+        QueuedCommand* q = &session->queued[i];
+        if (q->ticket == 0) continue;
+        if (!next || q->priority < next->priority || (q->priority == next->priority && q->ticket < next->ticket)) {
+            next = q;
+        }
+    }
+    return next;
+}
+
+// a transfer ended somewhere, the queued ones of this session run their command again while
+// the scheduler lets them in, in queue order
+static void startQueuedTransfers(int client_sfd, ClientSession* session) {
+    QueuedCommand* next;
+    while ((next = nextQueued(session)) != NULL) {
+        uint32_t retry_ms;
+        const char* reason;
+        int position;
+        int slot = admitTransfer(next->server, session->username, next->priority, &next->ticket, &position, &retry_ms, &reason);
+        if (slot == ADMIT_QUEUED) {
+            return;
+        }
+        QueuedCommand q = *next;
+        memset(next, 0, sizeof(*next));
+        current_req_id = q.hdr.req_id;
+        if (slot < 0) {
+            // the queue entry went away under us, the client can still retry
+            sendProtocolMsgBg(client_sfd, BUSY, retry_ms, reason, q.priority);
+        } else {
+            granted_slot = slot;
+            dispatchCommands(client_sfd, &q.hdr, q.command, q.server, session);
+            if (granted_slot >= 0) {
+                releaseAdmission(granted_slot); // refused before it got to admission this time
+                granted_slot = -1;
+            }
+        }
+        free(q.command);
+    }
+}
+
+static int hasQueuedCommands(ClientSession* session) {
+    return nextQueued(session) != NULL;
+}
+
+void dropQueuedCommands(ClientSession* session) {
+    for (int i = 0; i < MAX_SESSION_QUEUED; i++) {
+        QueuedCommand* q = &session->queued[i];
+        if (q->ticket == 0) continue;
+        dropQueuedTransfer(q->ticket);
+        free(q->command);
+        memset(q, 0, sizeof(*q));
+    }
+}
+
+// what a job looks like to its parties, progress while it runs and the outcome once it is over
+static void describeJob(const TransferJob* job, char* out, size_t size) {
+    int n = snprintf(out, size, "[NOTIFICATION] Transfer %d (%s, %s -> %s)", job->id, job->filename, job->sender, job->receiver);
+    if (n < 0 || (size_t)n >= size) return;
+    if (job->state == JOB_RUNNING) {
+        unsigned pct = job->total ? (unsigned)(job->done * 100 / job->total) : 0;
+        snprintf(out + n, size - n, ": %llu of %llu bytes (%u%%), %.1f MB/s", (unsigned long long)job->done,
+                 (unsigned long long)job->total, pct, job->rate / 1e6);
+    } else {
+        snprintf(out + n, size - n, " %s: %s", job->state == JOB_DONE ? "done" : "failed", job->msg);
+    }
+}
+
+// background copies this user sends or receives that reported since we last looked. A finished
+// one is freed once both parties saw how it ended
+static void notifyJobs(int client_fds, ClientSession* session) {
+    char msgs[MAX_TRANSFER_JOBS][512];
+    int count = 0;
+    sem_wait(&registry->mux);
+    for (int i = 0; i < MAX_TRANSFER_JOBS; i++) {
+        TransferJob* job = &registry->jobs[i];
+        if (job->id == 0) continue;
+        uint32_t tick = job->tick;
+        int is_sender = strcmp(job->sender, session->username) == 0;
+        int is_receiver = strcmp(job->receiver, session->username) == 0;
+        if ((is_sender && job->seen_sender != tick) || (is_receiver && job->seen_receiver != tick)) {
+            describeJob(job, msgs[count++], sizeof(msgs[0]));
+        }
+        if (is_sender) job->seen_sender = tick;
+        if (is_receiver) job->seen_receiver = tick;
+        if (job->state != JOB_RUNNING && job->seen_sender == tick && job->seen_receiver == tick) {
+            memset(job, 0, sizeof(*job));
+        }
+    }
+    sem_post(&registry->mux);
+
+    current_req_id = 0; // not a reply to anything
+    for (int i = 0; i < count; i++) {
+        sendProtocolMsgBg(client_fds, TEXT, 0, msgs[i], 1);
+    }
+}
+
 void check_for_notifications(int client_fds, ClientSession* session) {
     if (session->state != STATE_LOGGED_IN) return;
+    startQueuedTransfers(client_fds, session);
+    notifyJobs(client_fds, session);
 
     TransferRequest to_notify[MAX_TRANSFERS];
     int is_rejection[MAX_TRANSFERS]; // 1 rej, 0 pend
@@ -124,6 +253,7 @@ void check_for_notifications(int client_fds, ClientSession* session) {
                 to_notify[i].id, to_notify[i].id, to_notify[i].id);
         }
         
+        current_req_id = 0; // not a reply to anything
         sendProtocolMsgBg(client_fds, TEXT, 0, msg, 1);
     }
 }
@@ -138,16 +268,29 @@ void cleanup_user_requests(const char* username) {
             memset(registry->pending[i].sender, 0, 32);
         }
     }
+    // nobody is left to tell about finished jobs of this user
+    for (int i = 0; i < MAX_TRANSFER_JOBS; i++) {
+        TransferJob* job = &registry->jobs[i];
+        if (job->id == 0 || job->state == JOB_RUNNING) continue;
+        if (strcmp(job->sender, username) == 0) job->seen_sender = job->tick;
+        if (strcmp(job->receiver, username) == 0) job->seen_receiver = job->tick;
+        if (job->seen_sender == job->tick && job->seen_receiver == job->tick) {
+            memset(job, 0, sizeof(*job));
+        }
+    }
     sem_post(&registry->mux);
 }
-void handleClient(int client_sfd, Server* server) {
+void handleClient(int client_sfd, Server* server, int admission_slot) {
     printf("Handling client request\n");
 
     setup_signal_handling();
+    signal(SIGPIPE, SIG_IGN); // an in-band upload whose child died must not end the session
     
     ClientSession session;
     memset(&session, 0, sizeof(session));
     session.state = STATE_NOT_LOGGED_IN;
+    session.helper_fd = -1;
+    session.admission_slot = admission_slot;
 
    
     while (1) {
@@ -155,8 +298,28 @@ void handleClient(int client_sfd, Server* server) {
             check_for_notifications(client_sfd, &session);
             transfer_signal_received = 0;
         }
+        // a wakeup landing between the check and the read would be lost, queued transfers look again now and then
+        if (hasQueuedCommands(&session)) {
+            struct pollfd pfd = { .fd = client_sfd, .events = POLLIN };
+            int ready = poll(&pfd, 1, QUEUE_RECHECK_MS);
+            if (ready <= 0) {
+                transfer_signal_received = 1; // timed out or woken up
+                continue;
+            }
+        }
         msg_header hdr;
-        ssize_t n = readAll(client_sfd, &hdr, sizeof(hdr));
+        ssize_t n = readAll(client_sfd, &hdr, HEADER_PREFIX_LEN);
+        if (n > 0 && checkVersion(&hdr) < 0) {
+            break;
+        }
+        if (n > 0) {
+            // past the prefix the header is ours to finish, a signal cannot make us drop half of it
+            while ((n = readAll(client_sfd, (char*)&hdr + HEADER_PREFIX_LEN, sizeof(hdr) - HEADER_PREFIX_LEN)) < 0 && errno == EINTR);
+            if (n < 0) {
+                printf("[handleClient] Error reading from client\n");
+                break;
+            }
+        }
         if (n < 0) {
             if (errno == EINTR) {
                 // if read was intrpt by signal then restart the loop and check for nots
@@ -169,30 +332,44 @@ void handleClient(int client_sfd, Server* server) {
             printf("[handleClient] Client closed connection\n");
             break;
         }
+        if (checkHeader(&hdr) < 0) {
+            break;
+        }
         char *payload = NULL;
         if (hdr.payloadLength > 0) {
             payload = malloc(hdr.payloadLength + 1); // +1 for safety null terminator
-            if (readAll(client_sfd, payload, hdr.payloadLength) <= 0) {
+            // pipelined clients make a header waiting for its payload common, a notification
+            // signal landing in between is picked up after this message
+            ssize_t r;
+            while ((r = readAll(client_sfd, payload, hdr.payloadLength)) < 0 && errno == EINTR);
+            if (r <= 0) {
                 free(payload);
                 break;
             }
             payload[hdr.payloadLength] = '\0'; 
         }
-        printf("[handleClient] Received Type: %d, Size: %u\n", hdr.type, hdr.payloadLength);
+        printf("[handleClient] Received Type: %d, Size: %llu\n", hdr.type, (unsigned long long)hdr.payloadLength);
         dispatchCommands(client_sfd, &hdr, payload, server, &session);
         if (payload) free(payload);
     }
 
+    closeClientSession(client_sfd, &session);
+}
+
+void closeClientSession(int client_sfd, ClientSession* session) {
     // remove online user from registry upon disconection
-    if (session.state == STATE_LOGGED_IN) {
+    if (session->state == STATE_LOGGED_IN) {
 
         // clean shmem entries to avoid freezing server
-        cleanup_user_requests(session.username);
+        cleanup_user_requests(session->username);
 
-        printf("[handleClient] Cleaning up registry for %s\n", session.username);
+        printf("[handleClient] Cleaning up registry for %s\n", session->username);
         sem_wait(&registry->mux);
         for(int i=0; i<MAX_USERS; i++) {
-            if(registry->online_users[i].handler_pid == getpid()) {
+            // the epoll engine keeps many sessions per pid, so the username must match too
+            if(registry->online_users[i].is_active &&
+               registry->online_users[i].handler_pid == getpid() &&
+               strcmp(registry->online_users[i].username, session->username) == 0) {
                 registry->online_users[i].is_active = 0;
                 break;
             }
@@ -200,6 +377,11 @@ void handleClient(int client_sfd, Server* server) {
         sem_post(&registry->mux);
     }
 
+    closeUploadStreams(session);
+    dropQueuedCommands(session);
+    closeHelperChannel(session);
+    releaseAdmission(session->admission_slot);
+    session->admission_slot = -1;
     close(client_sfd);
 }
 int tokenizeCommand(char* input, char* argv[]) {
@@ -214,6 +396,23 @@ int tokenizeCommand(char* input, char* argv[]) {
 }
 void dispatchCommands(int client_sfd, msg_header* hdr, char* payload, Server* server, ClientSession* session) {
     char* argv[MAXARGS];
+    current_req_id = hdr->req_id;
+    if (hdr->type == BATCH) {
+        handleBatch(client_sfd, hdr, payload, server, session);
+        return;
+    }
+    if (hdr->type == DATA) {
+        handleUploadData(hdr, payload, session);
+        return;
+    }
+    if (hdr->type == CANCEL) {
+        handleCancel(hdr, session);
+        return;
+    }
+    if (hdr->type == WRITECMD && session->write.req_id != 0 && hdr->req_id == session->write.req_id) {
+        handleWriteData(client_sfd, hdr, payload, session);
+        return;
+    }
     int argc = tokenizeCommand(payload, argv);
     if (argc == 0) {
         sendProtocolMsg(client_sfd, TEXT, 0, "Problems with command? add args");
@@ -229,6 +428,132 @@ void dispatchCommands(int client_sfd, msg_header* hdr, char* payload, Server* se
     sendProtocolMsg(client_sfd, TEXT, -1, "Command not found");
     
 }
+// these open a data connection or wait on another user, neither fits in a single reply
+static int allowedInBatch(const char* cmd) {
+    static const char* excluded[] = {"download", "upload", "write", "transfer_request", NULL};
+    size_t len = strcspn(cmd, " ");
+    for (int i = 0; excluded[i] != NULL; i++) {
+        if (strlen(excluded[i]) == len && strncmp(excluded[i], cmd, len) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int appendBatchRecord(char** out, size_t* len, size_t* cap, batch_record* rec, const char* data) {
+    size_t need = *len + sizeof(*rec) + rec->length;
+    if (need > *cap) {
+        size_t grown = *cap ? *cap : 4096;
+        while (grown < need) grown *= 2;
+        char* p = realloc(*out, grown);
+        if (!p) return -1;
+        *out = p;
+        *cap = grown;
+    }
+    memcpy(*out + *len, rec, sizeof(*rec));
+    if (rec->length > 0) {
+        memcpy(*out + *len + sizeof(*rec), data, rec->length);
+    }
+    *len = need;
+    return 0;
+}
+
+// each command runs through the usual handlers with a memfd standing in for the client socket,
+// the frames it would have sent are then packed into one BATCHRES reply
+void handleBatch(int client_sfd, msg_header* hdr, char* payload, Server* server, ClientSession* session) {
+    uint32_t req_id = hdr->req_id;
+    int stop_on_error = hdr->status & BATCH_STOP_ON_ERROR;
+    char* out = NULL;
+    size_t out_len = sizeof(batch_summary), out_cap = 0;
+    batch_summary summary = {0};
+    int stopped = 0;
+
+    int capture_fd = memfd_create("batch", MFD_CLOEXEC);
+    if (capture_fd < 0) {
+        perror("memfd_create");
+        sendProtocolMsg(client_sfd, TEXT, -1, "Internal error: cannot run batch");
+        return;
+    }
+    out_cap = 4096;
+    out = malloc(out_cap);
+    if (!out) {
+        sendProtocolMsg(client_sfd, TEXT, -1, "Internal error: cannot run batch");
+        goto out;
+    }
+
+    char* end = payload ? payload + hdr->payloadLength : NULL;
+    for (char* cmd = payload; cmd && cmd < end; ) {
+        size_t len = strnlen(cmd, end - cmd);
+        char* next = cmd + len + 1;
+        if (len == 0) {
+            cmd = next;
+            continue;
+        }
+        uint32_t index = summary.total++;
+        if (stopped) {
+            cmd = next;
+            continue;
+        }
+        summary.run++;
+
+        int failed = 0;
+        if (!allowedInBatch(cmd)) {
+            char msg[BUFFERSIZE];
+            snprintf(msg, sizeof(msg), "%.*s: not allowed inside a batch", (int)strcspn(cmd, " "), cmd);
+            batch_record rec = { .index = index, .type = TEXT, .status = (uint32_t)-1, .length = strlen(msg) + 1 };
+            if (appendBatchRecord(&out, &out_len, &out_cap, &rec, msg) < 0) goto nomem;
+            failed = 1;
+        } else {
+            if (ftruncate(capture_fd, 0) < 0 || lseek(capture_fd, 0, SEEK_SET) < 0) {
+                perror("batch capture reset");
+                sendProtocolMsg(client_sfd, TEXT, -1, "Internal error: cannot run batch");
+                goto out;
+            }
+            msg_header sub = { .type = CMDREQ, .payloadLength = len + 1, .req_id = req_id };
+            batch_capture = 1;
+            dispatchCommands(capture_fd, &sub, cmd, server, session);
+            batch_capture = 0;
+
+            lseek(capture_fd, 0, SEEK_SET);
+            msg_header frame;
+            while (readAll(capture_fd, &frame, sizeof(frame)) == sizeof(frame)) {
+                char* data = NULL;
+                if (frame.payloadLength > 0) {
+                    data = malloc(frame.payloadLength);
+                    if (!data || readAll(capture_fd, data, frame.payloadLength) <= 0) {
+                        free(data);
+                        break;
+                    }
+                }
+                batch_record rec = { .index = index, .type = frame.type, .status = frame.status, .length = frame.payloadLength };
+                int ret = appendBatchRecord(&out, &out_len, &out_cap, &rec, data);
+                free(data);
+                if (ret < 0 || out_len > MAX_PAYLOAD_LEN) goto nomem;
+                if (frame.status != 0) failed = 1;
+            }
+        }
+        if (failed) {
+            summary.failed++;
+            stopped = stop_on_error;
+        }
+        cmd = next;
+    }
+
+    memcpy(out, &summary, sizeof(summary));
+    msg_header res = { .type = BATCHRES, .status = summary.failed ? -1 : 0, .payloadLength = out_len };
+    current_req_id = req_id;
+    sendProtocolFrame(client_sfd, &res, out);
+    goto out;
+
+nomem:
+    fprintf(stderr, "[handleBatch] Out of memory collecting replies\n");
+    current_req_id = req_id;
+    sendProtocolMsg(client_sfd, TEXT, -1, "Internal error: batch reply too large");
+out:
+    free(out);
+    close(capture_fd);
+}
+
 void handleCreateUser(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr) {
    // parse username for only strings and then talk with helper, then signal client
     if (argc != 3) {
@@ -239,7 +564,7 @@ void handleCreateUser(int client_sfd, int argc, char* argv[], Server* server, Cl
         sendProtocolMsg(client_sfd, TEXT, -1, "Invalid username");
         return;
     }
-    int helper_fd = connectToHelper();
+    int helper_fd = rootHelperChannel(session);
     if (helper_fd < 0) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Internal error: Helper unreachable");
         return;
@@ -247,9 +572,9 @@ void handleCreateUser(int client_sfd, int argc, char* argv[], Server* server, Cl
 
     helper_response res;
     int status = sendHelperRequest(helper_fd, CREATE_USER, argc - 1, &argv[1], NULL, &res);
+    releaseRootHelperChannel(session, helper_fd);
     sendProtocolMsg(client_sfd, TEXT, status, res.msg);
     
-    close(helper_fd);
 }
 
 void handleLogin(int client_sfd, int argc, char* argv[], Server* Server, ClientSession* session, msg_header* hdr) {
@@ -266,7 +591,7 @@ void handleLogin(int client_sfd, int argc, char* argv[], Server* Server, ClientS
         sendProtocolMsg(client_sfd, TEXT, -1,  "Invalid username");
         return;
     }
-    int helper_fd = connectToHelper();
+    int helper_fd = helperChannel(session);
     if (helper_fd < 0) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Internal error");
         return;
@@ -286,6 +611,7 @@ void handleLogin(int client_sfd, int argc, char* argv[], Server* Server, ClientS
         session->state = STATE_LOGGED_IN;
         session->uid = res.data.login.uid;
         session->gid = res.data.login.gid;
+        session->helper_dedicated = res.data.login.dedicated;
         strcpy(session->workdir, "/");
         strncpy(session->home, res.data.login.home, sizeof(session->home));
         strncpy(session->username, argv[1], sizeof(session->username));
@@ -308,7 +634,6 @@ void handleLogin(int client_sfd, int argc, char* argv[], Server* Server, ClientS
     } else {
         sendProtocolMsg(client_sfd, TEXT, -1, res.msg);
     }
-    close(helper_fd);
 }
 
 void handleCd(int client_sfd, int argc, char* argv[], Server* Server, ClientSession* session, msg_header* hdr) {
@@ -321,7 +646,7 @@ void handleCd(int client_sfd, int argc, char* argv[], Server* Server, ClientSess
         sendProtocolMsg(client_sfd, TEXT, -1, "Usage: cd <path>");
         return;
     }
-    int helper_fd = connectToHelper();
+    int helper_fd = helperChannel(session);
     if (helper_fd < 0) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Internal error");
         return;
@@ -346,10 +671,25 @@ void handleCd(int client_sfd, int argc, char* argv[], Server* Server, ClientSess
     } else {
         sendProtocolMsg(client_sfd, TEXT, -1, res.msg);
     }
-    close(helper_fd);
 
 }
 
+// READCMD/LSRES payload, zlib packed when the client takes that and the payload shrinks
+static void sendReplyPayload(int client_sfd, const msg_header* hdr, uint32_t type, void* payload, uint64_t len) {
+    msg_header reply = { .type = type, .status = 0, .payloadLength = len };
+    void* packed = NULL;
+    if ((hdr->status & CMD_PACKED_REPLIES) && len >= PACK_MIN_SIZE && len <= MAX_UNPACKED && (packed = malloc(len))) {
+        ssize_t n = packChunk(payload, len, packed, len);
+        if (n > 0) {
+            reply.status = len;
+            reply.payloadLength = n;
+            payload = packed;
+        }
+    }
+    sendProtocolFrame(client_sfd, &reply, payload);
+    free(packed);
+}
+
 void handleLs(int client_sfd, int argc, char* argv[], Server* Server, ClientSession* session, msg_header* hdr) {
     if (session->state != STATE_LOGGED_IN) {
         fprintf(stderr, "[handleClient] User attempting Ls command  without loggin in\n");
@@ -360,7 +700,7 @@ void handleLs(int client_sfd, int argc, char* argv[], Server* Server, ClientSess
         sendProtocolMsg(client_sfd, TEXT, -1, "Usage: ls <path>");
         return;
     }
-    int helper_fd = connectToHelper();
+    int helper_fd = helperChannel(session);
     if (helper_fd < 0) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Internal server error: Helper unreachable");
         return;
@@ -370,25 +710,16 @@ void handleLs(int client_sfd, int argc, char* argv[], Server* Server, ClientSess
     if (status != 0) {
         fprintf(stderr, "%s\n", res.msg);
         sendProtocolMsg(client_sfd, TEXT, -1, res.msg);
-        close(helper_fd);
         return;
     }
     else if (res.payload_len > 0) {
         void* entries = malloc(res.payload_len);
         if (!entries) {
             sendProtocolMsg(client_sfd, TEXT, -1, "Server memory error");
-            close(helper_fd);
             return;
         }
-        if (readAll(helper_fd, entries, res.payload_len) == res.payload_len) {
-            msg_header client_hdr = {
-                .type = LSRES,
-                .status = 0,
-                .payloadLength = res.payload_len
-            };
-            
-            writeAll(client_sfd, &client_hdr, sizeof(client_hdr));
-            writeAll(client_sfd, entries, res.payload_len);
+        if (readAll(helper_fd, entries, res.payload_len) == (ssize_t)res.payload_len) {
+            sendReplyPayload(client_sfd, hdr, LSRES, entries, res.payload_len);
         } else {
             sendProtocolMsg(client_sfd, TEXT, -1, "Failed to read data from Helper");
         }
@@ -396,7 +727,6 @@ void handleLs(int client_sfd, int argc, char* argv[], Server* Server, ClientSess
     } else {
         sendProtocolMsg(client_sfd, TEXT, 0, "Directory is empty");
     }
-    close(helper_fd);
 }
 
 /*
@@ -424,7 +754,7 @@ void handleCreateFile(int client_sfd, int argc, char* argv[], Server* Server, Cl
             return;
         }
     }
-    int helper_fd = connectToHelper();
+    int helper_fd = helperChannel(session);
     if (helper_fd < 0) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Internal error: Helper unreachable");
         return;
@@ -433,7 +763,6 @@ void handleCreateFile(int client_sfd, int argc, char* argv[], Server* Server, Cl
     int status = sendHelperRequest(helper_fd, CREATE_FILE, argc - 1, &argv[1], session, &res);
     sendProtocolMsg(client_sfd, TEXT, status, res.msg);
     
-    close(helper_fd);
 }
 
 // chmod <path> <permissions (in octal)>: Set the <path> le permissions to <permissions>
@@ -447,7 +776,7 @@ void handleChmod(int client_sfd, int argc, char* argv[], Server* Server, ClientS
         sendProtocolMsg(client_sfd, TEXT, -1, "Usage: chmod <path> <permissions>");
         return;
     }
-    int helper_fd = connectToHelper();
+    int helper_fd = helperChannel(session);
     if (helper_fd < 0) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Internal error: Helper unreachable");
         return;
@@ -456,7 +785,6 @@ void handleChmod(int client_sfd, int argc, char* argv[], Server* Server, ClientS
     int status = sendHelperRequest(helper_fd, CHMOD, argc - 1, &argv[1], session, &res);
     sendProtocolMsg(client_sfd, TEXT, status, res.msg);
     
-    close(helper_fd);
 }
 
 void handleDelete(int client_sfd, int argc, char* argv[], Server* Server, ClientSession* session, msg_header* hdr) {
@@ -469,7 +797,7 @@ void handleDelete(int client_sfd, int argc, char* argv[], Server* Server, Client
         sendProtocolMsg(client_sfd, TEXT, -1, "Usage: delete <path>");
         return;
     }
-    int helper_fd = connectToHelper();
+    int helper_fd = helperChannel(session);
     if (helper_fd < 0) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Internal error: Helper unreachable");
         return;
@@ -478,7 +806,6 @@ void handleDelete(int client_sfd, int argc, char* argv[], Server* Server, Client
     int status = sendHelperRequest(helper_fd, DELETE, argc - 1, &argv[1], session, &res);
     sendProtocolMsg(client_sfd, TEXT, status, res.msg);
     
-    close(helper_fd);
 }
 
 void handleMove(int client_sfd, int argc, char* argv[], Server* Server, ClientSession* session, msg_header* hdr) {
@@ -491,7 +818,7 @@ void handleMove(int client_sfd, int argc, char* argv[], Server* Server, ClientSe
         sendProtocolMsg(client_sfd, TEXT, -1, "Usage: move <path1> <path2>");
         return;
     }
-    int helper_fd = connectToHelper();
+    int helper_fd = helperChannel(session);
     if (helper_fd < 0) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Internal error: Helper unreachable");
         return;
@@ -500,13 +827,99 @@ void handleMove(int client_sfd, int argc, char* argv[], Server* Server, ClientSe
     int status = sendHelperRequest(helper_fd, MOVE, argc - 1, &argv[1], session, &res);
     sendProtocolMsg(client_sfd, TEXT, status, res.msg);
     
-    close(helper_fd);
+}
+
+// the parent closes its end of the pipe on CANCEL, or when the session goes away
+static int readCancelled(int cancel_fd) {
+    struct pollfd pfd = { .fd = cancel_fd, .events = POLLIN };
+    return cancel_fd >= 0 && poll(&pfd, 1, 0) > 0;
+}
+
+// READCMD frames of up to DATA_CHUNK from a large buffer refilled with pread, then an empty one.
+// Each frame is packed on its own like any READCMD reply
+static void streamRead(int client_sfd, const msg_header* hdr, int file_fd, off_t start, off_t end, int cancel_fd) {
+    char* buf = malloc(READ_BUFFER);
+    if (!buf) {
+        sendProtocolMsg(client_sfd, TEXT, -1, "Server memory error");
+        return;
+    }
+    off_t pos = start;
+    while (pos < end) {
+        size_t want = end - pos < READ_BUFFER ? (size_t)(end - pos) : READ_BUFFER;
+        ssize_t n = pread(file_fd, buf, want, pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            break; // shrunk under us, what is there was sent
+        }
+        for (ssize_t off = 0; off < n; off += DATA_CHUNK) {
+            if (readCancelled(cancel_fd)) {
+                printf("[handleRead] Stream %u cancelled at byte %lld\n", hdr->req_id, (long long)(pos + off));
+                goto done;
+            }
+            size_t chunk = n - off < DATA_CHUNK ? (size_t)(n - off) : DATA_CHUNK;
+            sendReplyPayload(client_sfd, hdr, READCMD, buf + off, chunk);
+        }
+        pos += n;
+    }
+done:
+    free(buf);
+    msg_header last = { .type = READCMD, .status = 0, .payloadLength = 0 };
+    sendProtocolFrame(client_sfd, &last, NULL);
+}
+
+static void closeReadStream(ReadStream* stream) {
+    close(stream->cancel_fd);
+    stream->req_id = 0;
+    stream->cancel_fd = -1;
+}
+
+// nobody tells us when a read child is done, an entry whose pipe lost its reader is free again
+static int openReadStream(ClientSession* session, uint32_t req_id, int cancel_fd) {
+    for (int i = 0; i < MAX_READ_STREAMS; i++) {
+        ReadStream* stream = &session->reads[i];
+        if (stream->req_id != 0) {
+            struct pollfd pfd = { .fd = stream->cancel_fd, .events = POLLOUT };
+            if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLERR)) continue;
+            closeReadStream(stream);
+        }
+        stream->req_id = req_id;
+        stream->cancel_fd = cancel_fd;
+        return i;
+    }
+    return -1;
+}
+
+// a CANCEL for a read still streaming, one that is over already finds nothing to stop
+void handleCancel(msg_header* hdr, ClientSession* session) {
+    for (int i = 0; i < MAX_READ_STREAMS; i++) {
+        if (session->reads[i].req_id != 0 && session->reads[i].req_id == hdr->req_id) {
+            closeReadStream(&session->reads[i]);
+        }
+    }
+}
+
+// the helper does not wait for the lock of a read or write. An event loop would never get to the
+// write holding it if it waited, it retries the command later. Not one inside a batch, whose reply
+// is built in one go: that one fails. A handler of its own just waits
+static int waitForLock(int client_sfd, Server* server) {
+    if (server->engine == ENGINE_EPOLL && batch_capture) {
+        sendProtocolMsg(client_sfd, TEXT, -1, "File is locked by another stream, try again later");
+        return -1;
+    }
+    if (server->engine == ENGINE_EPOLL) {
+        dispatch_deferred = 1;
+        return -1;
+    }
+    usleep(LOCK_RETRY_MS * 1000);
+    return 0;
 }
 
 /*
-read <path>: Sends the content of <path> to the client who will print it in stdout. It is possible
-to specify the -offset=<num> option which will force the sending from the <num> byte of the
-file. Example: read -o set=10 <path>: Send the file starting from the offset byte 10.
+read [-offset=N] [-length=M] <path>: streams the content of <path> to the client, which prints it
+to stdout. -offset starts at byte N, -length stops after M bytes, without it the read goes to the
+end of the file. The bytes come as READCMD chunks closed by an empty one, the client may CANCEL.
+A child of its own sends them, as for a download, so a long read holds up nothing else.
+Example: read -offset=10 -length=100 <path>
 */
 void handleRead(int client_sfd, int argc, char* argv[], Server* Server, ClientSession* session, msg_header* hdr) {
     if (session->state != STATE_LOGGED_IN) {
@@ -514,92 +927,127 @@ void handleRead(int client_sfd, int argc, char* argv[], Server* Server, ClientSe
         sendProtocolMsg(client_sfd, TEXT, 0, "Log in first");
         return;
     }
-    int offset = 0;
-    char *path = NULL;
+    uint64_t offset = 0, length = 0;
+    int has_length = 0;
+    char *path = argv[argc - 1];
 
-    if (argc == 3) {
-        const char *prefix = "-offset=";
-        if (strncmp(argv[1], prefix, strlen(prefix)) == 0) {
-            offset = atoi(argv[1] + strlen(prefix));
-            path = argv[2];
-        } else {
-            sendProtocolMsg(client_sfd, TEXT, -1, "Usage: read -offset=N <path>");
-            return;
+    for (int i = 1; i < argc - 1; i++) {
+        if (strncmp(argv[i], "-offset=", 8) == 0 && parseOffset(argv[i] + 8, &offset) == 0) {
+            continue;
         }
-    } 
-    
-    else if (argc == 2) {
-        path = argv[1];
-        offset = 0;
-    } 
-    else {
-        sendProtocolMsg(client_sfd, TEXT, -1, "Usage: read [-offset=N] <path>");
+        if (strncmp(argv[i], "-length=", 8) == 0 && parseOffset(argv[i] + 8, &length) == 0) {
+            has_length = 1;
+            continue;
+        }
+        path = NULL;
+    }
+    if (argc < 2 || argc > 4 || !path) {
+        sendProtocolMsg(client_sfd, TEXT, -1, "Usage: read [-offset=N] [-length=M] <path>");
         return;
     }
 
-    int helper_fd = connectToHelper();
+    int helper_fd = helperChannel(session);
     if (helper_fd < 0) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Internal error: Helper unreachable");
         return;
     }
     helper_response res;
     char *helper_argv[] = { path };
-    int status = sendHelperRequestRW(helper_fd, READ, 1, helper_argv, offset, session, NULL, 0, &res);
-    if(status != 0) {
+    int status;
+    while ((status = sendHelperRequestRW(helper_fd, READ, 1, helper_argv, offset, session, NULL, 0, &res)) == HELPER_LOCKED) {
+        if (waitForLock(client_sfd, Server) < 0) return;
+    }
+    int file_fd = -1;
+    if (status != 0) {
         fprintf(stderr, "%s\n", res.msg);
         sendProtocolMsg(client_sfd, TEXT, -1, res.msg);
+        return;
     }
-    else if (res.payload_len > 0) {
-        void* buf = malloc(res.payload_len);
-        if (!buf) {
-            sendProtocolMsg(client_sfd, TEXT, -1, "Server memory error");
-        } else {
-            if (readAll(helper_fd, buf, res.payload_len) == (ssize_t)res.payload_len) {
-                msg_header client_hdr = {
-                    .type = READCMD,
-                    .status = 0,
-                    .payloadLength = res.payload_len
-                };
-                writeAll(client_sfd, &client_hdr, sizeof(client_hdr));
-                writeAll(client_sfd, buf, res.payload_len);
-            }
-            else {
-                sendProtocolMsg(client_sfd, TEXT, -1, "Failed to read data from Helper");
-            }
-            free(buf);  
-        }      
+    if ((file_fd = recvFd(helper_fd)) < 0) {
+        sendProtocolMsg(client_sfd, TEXT, -1, "Failed to read data from Helper");
+        return;
     }
-    else {
+    uint64_t end = res.payload_len;
+    if (has_length && length < end - offset) {
+        end = offset + length;
+    }
+    if (end == offset) {
         sendProtocolMsg(client_sfd, TEXT, 0, "File is empty");
+        close(file_fd);
+        return;
+    }
+    if (batch_capture) {
+        // the frames only go to the batch's memfd, nothing to wait for there
+        streamRead(client_sfd, hdr, file_fd, offset, end, -1);
+        close(file_fd);
+        return;
     }
-    
-    close(helper_fd);
 
+    int cancel_pipe[2];
+    if (pipe(cancel_pipe) < 0) {
+        perror("pipe read");
+        sendProtocolMsg(client_sfd, TEXT, -1, "Server error: cannot start the read");
+        close(file_fd);
+        return;
+    }
+    int idx = openReadStream(session, hdr->req_id, cancel_pipe[1]);
+    if (idx < 0) {
+        sendProtocolMsg(client_sfd, TEXT, -1, "Too many reads in progress");
+        close(cancel_pipe[0]);
+        close(cancel_pipe[1]);
+        close(file_fd);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork read");
+        sendProtocolMsg(client_sfd, TEXT, -1, "Fork failed");
+        closeReadStream(&session->reads[idx]);
+        close(cancel_pipe[0]);
+        close(file_fd);
+        return;
+    }
+    if (pid > 0) {
+        live_children++;
+        close(cancel_pipe[0]);
+        close(file_fd); // the child's copy keeps the shared lock
+        return;
+    }
+    releaseEngineFds(client_sfd);
+    closeUploadStreams(session); // our own cancel_fd included
+    closeHelperChannel(session);
+    release_socket_lock(client_sfd);
+    streamRead(client_sfd, hdr, file_fd, offset, end, cancel_pipe[0]);
+    _exit(0);
 }
+static void closeWriteStream(WriteStream* stream) {
+    if (stream->fd >= 0) close(stream->fd); // drops the exclusive lock
+    stream->req_id = 0;
+    stream->fd = -1;
+}
+
+/*
+write [-offset=N] <path>: the frame only carries the command, the content follows as WRITECMD
+chunks with the same req_id and an empty one ends it. The session keeps the file open between
+them so nothing larger than one chunk is held anywhere, the reply comes after the last one
+*/
 void handleWrite(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr) {
+    // the chunks come whatever we answer here, an open stream swallows them
+    if (session->write.req_id != 0) closeWriteStream(&session->write);
+    session->write.req_id = hdr->req_id;
+    session->write.fd = -1;
+
     if (session->state != STATE_LOGGED_IN) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Log in first");
         return;
     }
     
-    // strtok modifies the payload in-place, replacing spaces with '\0'
-    // so argv pointers reference the original buffer with null-terminated tokens
-    char *cmd_end = argv[argc - 1];  // last token
-    cmd_end += strlen(argv[argc - 1]); // point past it
-    cmd_end++;  // skip the null terminator that strtok inserted
-    
-    // file data begins after tokenized command
-    void *file_buf = (void*)cmd_end;
-    uint32_t data_len = hdr->payloadLength - (cmd_end - argv[0]);
-    
-    // Now parse the offset and path from argv as before
-    int offset = 0;
+    uint64_t offset = 0;
     char *path = NULL;
 
     if (argc == 3) {
         const char *prefix = "-offset=";
-        if (strncmp(argv[1], prefix, strlen(prefix)) == 0) {
-            offset = atoi(argv[1] + strlen(prefix));
+        if (strncmp(argv[1], prefix, strlen(prefix)) == 0 && parseOffset(argv[1] + strlen(prefix), &offset) == 0) {
             path = argv[2];
         } else {
             sendProtocolMsg(client_sfd, TEXT, -1, "Usage: write [-offset=N] <path>");
@@ -615,9 +1063,7 @@ void handleWrite(int client_sfd, int argc, char* argv[], Server* server, ClientS
         return;
     }
 
-    printf("Writing %u bytes to %s at offset %d\n", data_len, path, offset);
-
-    int helper_fd = connectToHelper();
+    int helper_fd = helperChannel(session);
     if (helper_fd < 0) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Internal error: Helper unreachable");
         return;
@@ -625,175 +1071,1098 @@ void handleWrite(int client_sfd, int argc, char* argv[], Server* server, ClientS
 
     helper_response res;
     char *helper_argv[] = { path };
-    int status = sendHelperRequestRW(helper_fd, WRITE, 1, helper_argv, offset, session, file_buf, data_len, &res);
+    int status;
+    while ((status = sendHelperRequestRW(helper_fd, WRITE, 1, helper_argv, offset, session, NULL, 0, &res)) == HELPER_LOCKED) {
+        if (waitForLock(client_sfd, server) < 0) {
+            session->write.req_id = 0; // the retry is a command again, not a chunk
+            return;
+        }
+    }
+    if (status != 0) {
+        sendProtocolMsg(client_sfd, TEXT, status, res.msg);
+        return;
+    }
+    if ((session->write.fd = recvFd(helper_fd)) < 0) {
+        sendProtocolMsg(client_sfd, TEXT, -1, "Failed to read data from Helper");
+        return;
+    }
+    session->write.pos = offset;
+}
 
-    sendProtocolMsg(client_sfd, TEXT, status, res.msg);
-    close(helper_fd);
+// a WRITECMD chunk of the open write, the empty one closes the file and answers. A failure is
+// answered at once and what still comes of that write is dropped
+void handleWriteData(int client_sfd, msg_header* hdr, char* payload, ClientSession* session) {
+    WriteStream* stream = &session->write;
+    if (hdr->payloadLength == 0) {
+        int ok = stream->fd >= 0;
+        closeWriteStream(stream);
+        if (ok) {
+            sendProtocolMsg(client_sfd, TEXT, 0, "Success");
+        }
+        return;
+    }
+    if (stream->fd < 0) return;
+    for (uint64_t done = 0; done < hdr->payloadLength; ) {
+        ssize_t n = pwrite(stream->fd, payload + done, hdr->payloadLength - done, stream->pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Write failed: %s", n < 0 ? strerror(errno) : "no space");
+            sendProtocolMsg(client_sfd, TEXT, -1, msg);
+            close(stream->fd);
+            stream->fd = -1;
+            return;
+        }
+        done += n;
+        stream->pos += n;
+    }
+}
+
+// set in a transfer child once a data connection gave up for lack of progress
+static volatile sig_atomic_t data_idle = 0;
+
+static void noteIdle(void) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT) data_idle = 1;
+}
+
+// a data connection gives up once nothing moved for that many seconds, accept on the listener
+// and every read and write on the accepted socket. 0 waits forever
+static void setDataTimeouts(int fd, int seconds) {
+    if (seconds <= 0) return;
+    struct timeval tv = { .tv_sec = seconds };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// in-band uploads come through a pipe, which has no timeout of its own
+static int waitReadable(int fd, int seconds) {
+    if (seconds <= 0) return 0;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int n;
+    while ((n = poll(&pfd, 1, seconds * 1000)) < 0 && errno == EINTR);
+    if (n == 0) {
+        errno = ETIMEDOUT;
+        data_idle = 1;
+    }
+    return n > 0 ? 0 : -1;
+}
+
+static void onDataAlarm(int sig) {
+    data_idle = 1;
+}
+
+#define ROOM_POLL_MS 20
+
+// an in-band frame only starts once the socket can take all of it, so a client that stops reading
+// is caught between two frames, where it can still be told. Idle means the queue did not shrink for
+// seconds. The kernel counts its overhead in sndbuf, about half of it is left for the bytes
+static int waitFrameRoom(int sfd, size_t frame, int seconds) {
+    int last = -1, idle_ms = 0;
+    while (seconds > 0) {
+        int sndbuf = 0, queued = 0;
+        socklen_t len = sizeof(sndbuf);
+        if (getsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) < 0 || ioctl(sfd, SIOCOUTQ, &queued) < 0) {
+            return 0; // nothing to measure, the alarm still guards the frame
+        }
+        if (queued == 0 || sndbuf / 2 - queued >= (int)frame) {
+            return 0;
+        }
+        if (queued < last) idle_ms = 0;
+        last = queued;
+        if (idle_ms >= seconds * 1000) {
+            data_idle = 1;
+            return -1;
+        }
+        poll(NULL, 0, ROOM_POLL_MS);
+        idle_ms += ROOM_POLL_MS;
+    }
+    return 0;
+}
+
+// socket -> pipe -> file without a trip through user space, splice needs a pipe on one end.
+// Returns 1 when the file system cannot splice, the caller copies the rest by hand
+static int spliceToFile(int sock, int file_fd, int timeout) {
+    struct stat st;
+    if (fstat(sock, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        // in-band uploads already come through a pipe
+        ssize_t n;
+        do {
+            if (waitReadable(sock, timeout) < 0) return -1;
+            n = splice(sock, NULL, file_fd, NULL, 65536, SPLICE_F_MOVE);
+            if (n < 0 && errno != EINTR) return errno == EINVAL ? 1 : -1;
+        } while (n != 0);
+        return 0;
+    }
+    int p[2];
+    if (pipe(p) < 0) {
+        return 1;
+    }
+    int ret = 0;
+    for (;;) {
+        ssize_t in = splice(sock, NULL, p[1], NULL, 65536, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in <= 0) {
+            if (in < 0) noteIdle();
+            ret = (in < 0) ? -1 : 0;
+            break;
+        }
+        while (in > 0) {
+            ssize_t out = splice(p[0], NULL, file_fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) {
+                ret = (out < 0 && errno == EINVAL) ? 1 : -1;
+                break;
+            }
+            in -= out;
+        }
+        if (in > 0) {
+            if (ret == 1) {
+                // what is left in the pipe goes first
+                char buffer[65536];
+                ssize_t n = read(p[0], buffer, in);
+                ret = (n == in && writeAll(file_fd, buffer, n) >= 0) ? 1 : -1;
+            }
+            break;
+        }
+    }
+    close(p[0]);
+    close(p[1]);
+    return ret;
+}
+
+static int copyToFile(int sock, int file_fd, int timeout) {
+    int ret = spliceToFile(sock, file_fd, timeout);
+    if (ret != 1) {
+        return ret;
+    }
+    char buffer[16384];
+    ssize_t n;
+    while (waitReadable(sock, timeout) == 0 && (n = read(sock, buffer, sizeof(buffer))) > 0) {
+        if (writeAll(file_fd, buffer, n) < 0) {
+            return -1;
+        }
+    }
+    if (data_idle) return -1;
+    if (n < 0) noteIdle();
+    return n < 0 ? -1 : 0;
+}
+
+// the upload stream into file_fd, crc gets the checksum of what landed there. -z over a data port
+// opens with the codec the client picked, in-band frames come unpacked already
+static int receiveStream(int sock, int file_fd, int compress, int timeout, uint32_t* crc) {
+    char codec = STREAM_PLAIN;
+    if (compress && readAll(sock, &codec, 1) != 1) {
+        noteIdle();
+        return -1;
+    }
+    if (codec == STREAM_PLAIN) {
+        // spliced bytes never pass through here, they are read back while still in the page cache
+        off_t from = lseek(file_fd, 0, SEEK_CUR);
+        struct stat st;
+        if (copyToFile(sock, file_fd, timeout) < 0 || fstat(file_fd, &st) < 0) {
+            return -1;
+        }
+        return crc32cUpdate(file_fd, from, st.st_size - from, crc);
+    }
+    if (codec != STREAM_PACKED || inflateStream(sock, file_fd, crc) < 0) {
+        noteIdle();
+        return -1;
+    }
+    return 0;
+}
+
+// trailing options of download/upload after the two paths
+typedef struct {
+    int is_bg;
+    int resume;         // upload -r: go on from what the server already holds
+    int ranged;         // download -range=: only part of the file is wanted
+    off_t offset;
+    off_t length;       // 0 means up to the end
+    int check_tail;     // offset only holds if the bytes before it match the client's copy
+    uint32_t tail_crc;
+    int streams;        // -p N, data connections sharing the file
+    int compress;       // -z, single stream only
+    int delta;          // upload -d: only what changed against the server's copy travels
+} TransferOpts;
+
+// -b, -p N, -z, -r and -d for uploads and -range=<offset>:<length>[:<crc32c of the bytes before offset>]
+// for downloads. The client builds the range from its own download -r
+static int parseTransferOpts(int argc, char* argv[], int is_download, TransferOpts* opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->streams = 1;
+    for (int i = 3; i < argc; i++) {
+        long long offset, length;
+        unsigned int crc;
+        if (strcmp(argv[i], "-b") == 0) {
+            opts->is_bg = 1;
+        } else if (strcmp(argv[i], "-z") == 0) {
+            opts->compress = 1;
+        } else if (!is_download && strcmp(argv[i], "-r") == 0) {
+            opts->resume = 1;
+        } else if (!is_download && strcmp(argv[i], "-d") == 0) {
+            opts->delta = 1;
+        } else if (is_download && strncmp(argv[i], "-range=", 7) == 0) {
+            int n = sscanf(argv[i] + 7, "%lld:%lld:%x", &offset, &length, &crc);
+            if (n < 2 || offset < 0 || length < 0) return -1;
+            opts->ranged = 1;
+            opts->offset = offset;
+            opts->length = length;
+            opts->check_tail = (n == 3);
+            opts->tail_crc = crc;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            opts->streams = atoi(argv[++i]);
+            if (opts->streams < 1 || opts->streams > MAX_PARALLEL_STREAMS) return -1;
+        } else {
+            return -1;
+        }
+    }
+    // a resumed transfer has a single tail to go on from
+    if ((opts->ranged || opts->resume) && opts->streams > 1) return -1;
+    // a delta rebuilds the whole file from the old one, there is no tail to go on from
+    if (opts->delta && (opts->resume || opts->streams > 1)) return -1;
+    // parallel slices are checksummed as they lie on disk, -z does not apply to them, nor to a delta
+    if (opts->streams > 1 || opts->delta) opts->compress = 0;
+    return 0;
+}
+
+// admission of a download/upload. Over the limits the command waits in the session and runs again
+// from check_for_notifications once a finished transfer wakes us. -1 when it is not to run now,
+// the client already has its QUEUED or BUSY reply
+static int scheduleTransfer(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr, int is_bg) {
+    if (granted_slot >= 0) {
+        int slot = granted_slot;
+        granted_slot = -1;
+        return slot;
+    }
+    QueuedCommand* q = NULL;
+    for (int i = 0; i < MAX_SESSION_QUEUED && !q; i++) {
+        if (session->queued[i].ticket == 0) q = &session->queued[i];
+    }
+    uint32_t ticket = 0;
+    uint32_t retry_ms;
+    const char* reason;
+    int position;
+    int slot = admitTransfer(server, session->username, is_bg, q ? &ticket : NULL, &position, &retry_ms, &reason);
+    if (slot == ADMIT_QUEUED) {
+        char command[PAYLOAD];
+        size_t len = 0;
+        for (int i = 0; i < argc && len < sizeof(command); i++) {
+            len += snprintf(command + len, sizeof(command) - len, i ? " %s" : "%s", argv[i]);
+        }
+        q->ticket = ticket;
+        q->priority = is_bg;
+        q->hdr = *hdr;
+        q->command = strdup(command);
+        q->server = server;
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Queued at position %d: %s", position, reason);
+        sendProtocolMsgBg(client_sfd, QUEUED, position, msg, is_bg);
+    } else if (slot < 0) {
+        sendProtocolMsgBg(client_sfd, BUSY, retry_ms, reason, is_bg);
+    }
+    return slot < 0 ? -1 : slot;
+}
+
+static int tailMatches(int file_fd, off_t offset, uint32_t crc) {
+    off_t tail = offset < RESUME_TAIL ? offset : RESUME_TAIL;
+    uint32_t ours;
+    return crc32cRange(file_fd, offset - tail, tail, &ours) == 0 && ours == crc;
+}
+
+// page cache straight to the socket, the file is locked shared so its size holds. sendfile never
+// shows us the bytes, crc continues over each chunk read back right after it went out
+static int sendFileTo(int data_sfd, int file_fd, off_t start, off_t end, uint32_t* crc) {
+    off_t sent = start;
+    while (sent < end) {
+        off_t from = sent;
+        off_t chunk_end = end - sent > CRC_CHUNK ? sent + CRC_CHUNK : end;
+        while (sent < chunk_end) {
+            ssize_t n = sendfile(data_sfd, file_fd, &sent, chunk_end - sent);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (n < 0) noteIdle();
+                fprintf(stderr, "[Download] sendfile stopped at %lld of %lld bytes\n", (long long)sent, (long long)end);
+                return -1;
+            }
+        }
+        if (crc32cUpdate(file_fd, from, sent - from, crc) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// -p N: N connections on the one data port, each gets a slice of the file behind a range_header
+// and followed by its CRC32C.
+// Slices go out from processes of their own so one slow connection does not hold up the others
+static int sendRanges(int data_listener, int file_fd, off_t size, int streams, int timeout) {
+    signal(SIGCHLD, SIG_DFL); // the slices are reaped here, not by the inherited handler
+    off_t slice = (size + streams - 1) / streams;
+    pid_t pids[MAX_PARALLEL_STREAMS];
+    int started = 0;
+    int ok = 1;
+    for (int i = 0; i < streams; i++) {
+        int sfd = accept(data_listener, NULL, NULL);
+        if (sfd < 0) {
+            noteIdle();
+            perror("accept range stream");
+            ok = 0;
+            break;
+        }
+        setDataTimeouts(sfd, timeout);
+        off_t start = (off_t)i * slice < size ? (off_t)i * slice : size;
+        off_t end = start + slice < size ? start + slice : size;
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(data_listener);
+            range_header range = { .size = (uint64_t)size, .offset = (uint64_t)start, .length = (uint64_t)(end - start) };
+            uint32_t crc = 0;
+            int ret = -1;
+            if (writeAll(sfd, &range, sizeof(range)) >= 0 && sendFileTo(sfd, file_fd, start, end, &crc) == 0) {
+                ret = writeAll(sfd, &crc, sizeof(crc)) < 0 ? -1 : 0;
+            }
+            _exit(ret == 0 ? 0 : data_idle ? 2 : 1);
+        }
+        close(sfd);
+        if (pid < 0) {
+            perror("fork range stream");
+            ok = 0;
+            break;
+        }
+        pids[started++] = pid;
+    }
+    for (int i = 0; i < started; i++) {
+        int status;
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = 0;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 2) data_idle = 1; // the slice gave up waiting
+    }
+    return ok ? 0 : -1;
+}
+
+static int pwriteAll(int fd, const char* buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+// one slice of upload -p N, written in place. The CRC32C the client sends after it has to match
+static int receiveRange(int sfd, int file_fd, const range_header* range) {
+    char* buf = malloc(DATA_CHUNK);
+    uint32_t crc = 0, sent_crc;
+    uint64_t got = 0;
+    while (buf && got < range->length) {
+        size_t want = range->length - got < DATA_CHUNK ? range->length - got : DATA_CHUNK;
+        ssize_t n = read(sfd, buf, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) noteIdle();
+        if (n <= 0 || pwriteAll(file_fd, buf, n, range->offset + got) < 0) break;
+        crc = crc32c(crc, buf, n);
+        got += n;
+    }
+    free(buf);
+    if (got != range->length || readAll(sfd, &sent_crc, sizeof(sent_crc)) != sizeof(sent_crc)) {
+        noteIdle();
+        return -1;
+    }
+    return sent_crc == crc ? 0 : -1;
+}
+
+static int compareRanges(const void* a, const void* b) {
+    const range_header* x = a;
+    const range_header* y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// upload -p N: the headers are read here before each slice gets a process of its own. They have
+// to agree on the size and cover the file exactly once, or nothing gets committed
+static int receiveRanges(int data_listener, int file_fd, int streams, int timeout) {
+    signal(SIGCHLD, SIG_DFL);
+    range_header ranges[MAX_PARALLEL_STREAMS];
+    pid_t pids[MAX_PARALLEL_STREAMS];
+    int started = 0;
+    int ok = 1;
+    for (int i = 0; i < streams; i++) {
+        int sfd = accept(data_listener, NULL, NULL);
+        if (sfd < 0) {
+            noteIdle();
+            perror("accept range stream");
+            ok = 0;
+            break;
+        }
+        setDataTimeouts(sfd, timeout);
+        range_header* range = &ranges[i];
+        if (readAll(sfd, range, sizeof(*range)) != sizeof(*range) || range->offset > range->size ||
+            range->length > range->size - range->offset || (i > 0 && range->size != ranges[0].size)) {
+            noteIdle();
+            close(sfd);
+            ok = 0;
+            break;
+        }
+        // laid out once, the slices land in a file of the final size
+        if (i == 0 && posix_fallocate(file_fd, 0, range->size) != 0 && ftruncate(file_fd, range->size) < 0) {
+            close(sfd);
+            ok = 0;
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(data_listener);
+            _exit(receiveRange(sfd, file_fd, range) == 0 ? 0 : data_idle ? 2 : 1);
+        }
+        close(sfd);
+        if (pid < 0) {
+            perror("fork range stream");
+            ok = 0;
+            break;
+        }
+        pids[started++] = pid;
+    }
+    if (!ok) {
+        // the slices still running would wait for data that never comes
+        for (int i = 0; i < started; i++) kill(pids[i], SIGKILL);
+    }
+    for (int i = 0; i < started; i++) {
+        int status;
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = 0;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 2) data_idle = 1; // the slice gave up waiting
+    }
+    if (!ok) {
+        return -1;
+    }
+    qsort(ranges, streams, sizeof(ranges[0]), compareRanges);
+    uint64_t next = 0;
+    for (int i = 0; i < streams; i++) {
+        if (ranges[i].offset != next) return -1;
+        next += ranges[i].length;
+    }
+    return next == ranges[0].size ? 0 : -1;
+}
+
+// one chunk read and packed ahead of the socket lock, out as is when it does not shrink
+static int packDataFrame(int file_fd, off_t off, size_t len, char* raw, char* packed, msg_header* data, char** payload) {
+    ssize_t n = pread(file_fd, raw, len, off);
+    if (n != (ssize_t)len) return -1;
+    ssize_t z = packChunk(raw, len, packed, DATA_CHUNK);
+    data->status = z > 0 ? (uint32_t)len : 0;
+    data->payloadLength = z > 0 ? (uint64_t)z : (uint64_t)len;
+    *payload = z > 0 ? packed : raw;
+    return 0;
+}
+
+// in-band download: DATA frames on the control socket, each one sent whole under the socket
+// lock so the replies and the other streams of the session interleave between chunks.
+// Packed frames go through user space, plain ones straight from the page cache. STREAM_STOPPED
+// when the stream ended early between frames, STREAM_BROKEN when one was cut and the session had to go
+static int sendDataFrames(int client_sfd, int file_fd, off_t start, off_t end, int is_bg, int timeout, int packed, uint32_t* crc) {
+    // the control socket is shared with the session, its own timeouts stay as they are. An alarm
+    // interrupts a frame that could not move for the whole timeout instead
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onDataAlarm;
+    sigaction(SIGALRM, &sa, NULL);
+    char* raw = packed ? malloc(DATA_CHUNK) : NULL;
+    char* zbuf = packed ? malloc(DATA_CHUNK) : NULL;
+    if (packed && (!raw || !zbuf)) {
+        packed = 0;
+    }
+    msg_header done = { .type = DATA, .payloadLength = 0, .is_background = (uint8_t)is_bg };
+    off_t sent = start;
+    while (sent < end) {
+        off_t chunk = end - sent;
+        if (chunk > DATA_CHUNK) chunk = DATA_CHUNK;
+        msg_header data = { .type = DATA, .payloadLength = (uint64_t)chunk, .req_id = current_req_id, .is_background = (uint8_t)is_bg };
+        stampHeader(&data);
+        char* payload = NULL;
+        off_t chunk_start = sent;
+        if (packed) {
+            if (packDataFrame(file_fd, sent, chunk, raw, zbuf, &data, &payload) < 0) {
+                goto stopped;
+            }
+            *crc = crc32c(*crc, raw, chunk);
+        }
+        if (waitFrameRoom(client_sfd, sizeof(data) + data.payloadLength, timeout) < 0) {
+            goto stopped;
+        }
+        alarm(timeout);
+        if (acquire_socket_lock(client_sfd) < 0) {
+            alarm(0);
+            goto stopped;
+        }
+        int ok = writeAll(client_sfd, &data, sizeof(data)) >= 0;
+        off_t chunk_end = sent + chunk;
+        if (payload) {
+            ok = ok && writeAll(client_sfd, payload, data.payloadLength) >= 0;
+            sent = chunk_end;
+        }
+        while (ok && sent < chunk_end) {
+            ssize_t n = sendfile(client_sfd, file_fd, &sent, chunk_end - sent);
+            if (n < 0 && errno == EINTR && !data_idle) continue;
+            ok = n > 0;
+        }
+        alarm(0);
+        release_socket_lock(client_sfd);
+        if (!ok) {
+            goto broken;
+        }
+        if (!packed && crc32cUpdate(file_fd, chunk_start, chunk, crc) < 0) {
+            goto stopped;
+        }
+        sched_yield(); // lets a waiting stream take the socket lock next
+    }
+    free(raw);
+    free(zbuf);
+    return sendProtocolFrame(client_sfd, &done, NULL);
+
+stopped:
+    // between two frames the stream is still in step, it is closed as usual and the caller
+    // says why. The session and whatever else runs on it carry on
+    fprintf(stderr, "[Download] In-band stream stopped at %lld of %lld bytes\n", (long long)sent, (long long)end);
+    free(raw);
+    free(zbuf);
+    sendProtocolFrame(client_sfd, &done, NULL);
+    return STREAM_STOPPED;
+
+broken:
+    // half a frame may be out, the client cannot resync, it has to see the connection go
+    fprintf(stderr, "[Download] In-band stream broken at %lld of %lld bytes\n", (long long)sent, (long long)end);
+    shutdown(client_sfd, SHUT_RDWR);
+    free(raw);
+    free(zbuf);
+    return STREAM_BROKEN;
 }
 
 // we need to fork for background op and talk to the helper using the child
 // if we do so no pollution on server_fds and no need to concurrent locks
 void handleDownload(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr) {
-    int is_bg = 0;
-    if (argc >= 4 && strcmp(argv[argc-1], "-b") == 0) {
-        is_bg = 1;
-    } else if (argc >= 4 && strcmp(argv[argc-1], "-b") != 0) {
-        sendProtocolMsgLocked(client_sfd, TEXT, -1, "Usage: download <server_path> <client_path> [-b]", is_bg);
+    TransferOpts opts;
+    if (parseTransferOpts(argc, argv, 1, &opts) < 0 || argc < 3) {
+        sendProtocolMsgLocked(client_sfd, TEXT, -1, "Usage: download <server_path> <client_path> [-r | -p N] [-z] [-b]", 0);
         return;
     }
+    int is_bg = opts.is_bg;
 
     if (session->state != STATE_LOGGED_IN) {
         sendProtocolMsgLocked(client_sfd, TEXT, -1, "Log in first", is_bg);
         return;
     }
-    if (argc < 3 || argc > 4) {
-        sendProtocolMsgLocked(client_sfd, TEXT, -1, "Usage: download <server_path> <client_path> [-b]", 0);
+    int slot = scheduleTransfer(client_sfd, argc, argv, server, session, hdr, is_bg);
+    if (slot < 0) {
         return;
     }
-    
-    int data_listener = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = 0 };
-    if (bind(data_listener, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        sendProtocolMsgLocked(client_sfd, TEXT, -1, "Internal: bind failed", is_bg);
-        return;
+    int inband = hdr->status & CMD_INBAND_DATA;
+    if (inband) {
+        opts.streams = 1; // in-band frames share one connection anyway
     }
-    listen(data_listener, 1);
+    
+    int data_listener = -1;
+    int data_port = 0;
+    if (!inband) {
+        data_listener = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = 0 };
+        if (bind(data_listener, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            releaseAdmission(slot);
+            close(data_listener);
+            sendProtocolMsgLocked(client_sfd, TEXT, -1, "Internal: bind failed", is_bg);
+            return;
+        }
+        listen(data_listener, opts.streams);
+        setDataTimeouts(data_listener, server->data_timeout);
 
-    socklen_t len = sizeof(addr);
-    getsockname(data_listener, (struct sockaddr*)&addr, &len);
-    int data_port = ntohs(addr.sin_port);
+        socklen_t len = sizeof(addr);
+        getsockname(data_listener, (struct sockaddr*)&addr, &len);
+        data_port = ntohs(addr.sin_port);
+    }
 
     pid_t pid = fork();
     if (pid < 0) {
+        releaseAdmission(slot);
         sendProtocolMsgLocked(client_sfd, TEXT, -1, "Fork failed", is_bg);
-        close(data_listener);
+        if (data_listener >= 0) close(data_listener);
         return;
     }
 
     if (pid > 0) {
-        char port_info[64];
-        snprintf(port_info, sizeof(port_info), "DATA_PORT %d %s", data_port, argv[2]);
-        sendProtocolMsgLocked(client_sfd, DOWNLOAD_RES, 0, port_info, 0);
-        close(data_listener);
+        live_children++; // a draining server waits for the transfer too
+        handOverAdmission(slot, pid);
+        if (!inband) {
+            // a ranged stream starts with the uint64_t offset it really begins at, a -z one
+            // then says whether the file compressed
+            char port_info[300];
+            if (opts.streams > 1) {
+                snprintf(port_info, sizeof(port_info), "DATA_PORT %d %s -p %d", data_port, argv[2], opts.streams);
+            } else {
+                snprintf(port_info, sizeof(port_info), "DATA_PORT %d %s%s%s", data_port, argv[2],
+                         opts.ranged ? " -r" : "", opts.compress ? " -z" : "");
+            }
+            sendProtocolMsgLocked(client_sfd, DOWNLOAD_RES, 0, port_info, 0);
+            close(data_listener);
+        }
         return; 
     }
+    releaseEngineFds(client_sfd);
+    closeUploadStreams(session);
+    closeHelperChannel(session); // the child streams over its own connection, the channel stays the parent's
     release_socket_lock(client_sfd);
-    int data_sfd = accept(data_listener, NULL, NULL);
-    if (data_sfd < 0) _exit(1);
-   
-    close(data_listener);
+    int data_sfd = -1;
+    if (!inband && opts.streams == 1) {
+        data_sfd = accept(data_listener, NULL, NULL);
+        close(data_listener);
+        data_listener = -1;
+        if (data_sfd < 0) {
+            char err_msg[128];
+            snprintf(err_msg, sizeof(err_msg), "Download failed: no data connection within %d s", server->data_timeout);
+            sendProtocolMsgLocked(client_sfd, TEXT, -1, err_msg, is_bg);
+            releaseAdmission(slot);
+            _exit(1);
+        }
+        setDataTimeouts(data_sfd, server->data_timeout);
+    }
     
     int helper_fd = connectToHelper();
     helper_response res;
     char *h_argv[] = { argv[1] }; 
     
-    if (sendHelperRequestRW(helper_fd, DOWNLOAD, 1, h_argv, 0, session, NULL, 0, &res) == 0) {
-        char buffer[16384];
-        uint32_t total_to_read = res.payload_len;
-        uint32_t total_received = 0;
-        while (total_received < total_to_read) {
-            uint32_t to_read = total_to_read - total_received;
-            if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-            ssize_t n = read(helper_fd, buffer, to_read);
-            
-            if (n <= 0) {
-                fprintf(stderr, "[Debug] Connection closed or error before finishing file\n");
-                break;
+    int file_fd = -1;
+    struct stat st;
+    if (sendHelperRequestRW(helper_fd, DOWNLOAD, 1, h_argv, 0, session, NULL, 0, &res) == 0 &&
+        (file_fd = recvFd(helper_fd)) >= 0 && fstat(file_fd, &st) == 0) {
+        close(helper_fd);
+        helper_fd = -1;
+        off_t start = 0, end = st.st_size;
+        if (opts.ranged) {
+            start = opts.offset;
+            if (start > st.st_size) {
+                snprintf(res.msg, sizeof(res.msg), "Offset %lld is past the end of the file", (long long)start);
+                start = -1;
+            } else if (opts.check_tail && !tailMatches(file_fd, start, opts.tail_crc)) {
+                start = 0; // the client's copy is not a prefix of ours, it gets the whole file
+            } else if (opts.length > 0 && opts.length < st.st_size - start) {
+                end = start + opts.length;
             }
+        }
 
-            if (writeAll(data_sfd, buffer, n) < 0) {
-                fprintf(stderr, "[Debug] Data socket write failed\n");
-                break;
+        // -z is only worth the cpu when a sample of what goes out shrinks
+        int packed = start >= 0 && opts.compress && worthCompressing(file_fd, start, end);
+        uint32_t crc = 0;
+        int ret = -1;
+        if (start < 0) {
+            if (data_sfd >= 0) close(data_sfd);
+        } else if (opts.streams > 1) {
+            ret = sendRanges(data_listener, file_fd, end, opts.streams, server->data_timeout);
+            // the slices carry checksums of their own, the final reply has the whole file's as usual
+            if (ret == 0 && crc32cRange(file_fd, 0, end, &crc) < 0) {
+                ret = -1;
             }
-
-            total_received += n;
+        } else if (inband) {
+            // the stream is only announced once the file is open, a failure never creates it client side
+            char stream_info[300];
+            if (opts.ranged) {
+                snprintf(stream_info, sizeof(stream_info), "DATA_STREAM %s %lld", argv[2], (long long)start);
+            } else {
+                snprintf(stream_info, sizeof(stream_info), "DATA_STREAM %s", argv[2]);
+            }
+            sendProtocolMsgLocked(client_sfd, DOWNLOAD_RES, 0, stream_info, is_bg);
+            ret = sendDataFrames(client_sfd, file_fd, start, end, is_bg, server->data_timeout, packed, &crc);
+        } else {
+            // only a stream that went out whole reports its checksum, the client compares it
+            // with what it wrote
+            uint64_t from = start;
+            char codec = packed ? STREAM_PACKED : STREAM_PLAIN;
+            if ((!opts.ranged || writeAll(data_sfd, &from, sizeof(from)) >= 0) &&
+                (!opts.compress || writeAll(data_sfd, &codec, 1) >= 0)) {
+                if (!packed) {
+                    ret = sendFileTo(data_sfd, file_fd, start, end, &crc);
+                } else if ((ret = deflateRange(data_sfd, file_fd, start, end, &crc)) < 0) {
+                    noteIdle();
+                    fprintf(stderr, "[Download] Compressed stream stopped\n");
+                }
+            } else {
+                noteIdle();
+            }
+            close(data_sfd); // Tell client data port is finished
         }
-        close(data_sfd); // Tell client data port is finished
+        close(file_fd);  // drops the lock
+        if (data_listener >= 0) close(data_listener);
         
-        char finished_msg[128];
-        snprintf(finished_msg, sizeof(finished_msg), "download %s %s concluded", argv[1], argv[2]);
-        sendProtocolMsgLocked(client_sfd, TEXT, 0, finished_msg, is_bg);
+        if (start < 0) {
+            char err_msg[1400];
+            snprintf(err_msg, sizeof(err_msg), "Download failed: %s", res.msg);
+            sendProtocolMsgLocked(client_sfd, TEXT, -1, err_msg, is_bg);
+        } else if (ret == 0) {
+            char finished_msg[600];
+            if (start > 0) {
+                snprintf(finished_msg, sizeof(finished_msg), "download %s %s concluded, resumed at byte %lld, crc32c %08x", argv[1], argv[2], (long long)start, crc);
+            } else if (opts.streams > 1) {
+                snprintf(finished_msg, sizeof(finished_msg), "download %s %s concluded over %d streams, crc32c %08x", argv[1], argv[2], opts.streams, crc);
+            } else {
+                snprintf(finished_msg, sizeof(finished_msg), "download %s %s concluded, crc32c %08x", argv[1], argv[2], crc);
+            }
+            sendProtocolMsgLocked(client_sfd, TEXT, 0, finished_msg, is_bg);
+        } else if (ret == STREAM_BROKEN) {
+            // the session is shut down, nobody is left to tell
+        } else if (data_idle) {
+            char err_msg[128];
+            snprintf(err_msg, sizeof(err_msg), "Download failed: data %s idle for %d s", inband ? "stream" : "connection", server->data_timeout);
+            sendProtocolMsgLocked(client_sfd, TEXT, -1, err_msg, is_bg);
+        } else if (opts.streams > 1) {
+            sendProtocolMsgLocked(client_sfd, TEXT, -1, "Download failed: a data stream broke off", is_bg);
+        } else if (ret == STREAM_STOPPED) {
+            sendProtocolMsgLocked(client_sfd, TEXT, -1, "Download failed: the file could not be read", is_bg);
+        } else if (inband) {
+            // the client still waits for this one, its transfer is only let go with the final reply
+            sendProtocolMsgLocked(client_sfd, TEXT, -1, "Download failed: the stream broke off", is_bg);
+        } else {
+            sendProtocolMsgLocked(client_sfd, TEXT, -1, "Download failed: the data connection broke off", is_bg);
+        }
     } else {
-        close(data_sfd);
+        if (data_sfd >= 0) close(data_sfd);
+        if (data_listener >= 0) close(data_listener); // resets the range streams still waiting
+        if (file_fd >= 0) close(file_fd);
         char err_msg[2048];
         snprintf(err_msg, sizeof(err_msg), "Download failed: %s", 
-             (res.msg[0] != '\0') ? res.msg : "Helper error");
+             (res.status != 0 && res.msg[0] != '\0') ? res.msg : "Helper error");
         sendProtocolMsgLocked(client_sfd, TEXT, -1, err_msg, is_bg);
     }
 
-    close(helper_fd);
+    if (helper_fd >= 0) {
+        close(helper_fd);
+    }
+    releaseAdmission(slot);
     _exit(0);
 }
 
+static int openUploadStream(ClientSession* session, uint32_t req_id, int pipe_fd) {
+    for (int i = 0; i < MAX_UPLOAD_STREAMS; i++) {
+        if (session->uploads[i].req_id == 0) {
+            session->uploads[i].req_id = req_id;
+            session->uploads[i].pipe_fd = pipe_fd;
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void closeUploadStream(UploadStream* stream) {
+    close(stream->pipe_fd);
+    stream->req_id = 0;
+    stream->pipe_fd = -1;
+}
+
+// forked children must not keep the write ends either, the writers would never see EOF. Nor the
+// file of a write in progress, its lock would outlive the write
+void closeUploadStreams(ClientSession* session) {
+    for (int i = 0; i < MAX_UPLOAD_STREAMS; i++) {
+        if (session->uploads[i].req_id != 0) {
+            closeUploadStream(&session->uploads[i]);
+        }
+    }
+    if (session->write.req_id != 0) {
+        closeWriteStream(&session->write);
+    }
+    for (int i = 0; i < MAX_READ_STREAMS; i++) {
+        if (session->reads[i].req_id != 0) {
+            closeReadStream(&session->reads[i]);
+        }
+    }
+}
+
+// a DATA frame of an in-band upload, an empty one closes the stream. Frames of a stream whose
+// writer already gave up are dropped, the child reports the failure on its own
+void handleUploadData(msg_header* hdr, char* payload, ClientSession* session) {
+    for (int i = 0; i < MAX_UPLOAD_STREAMS; i++) {
+        UploadStream* stream = &session->uploads[i];
+        if (stream->req_id == 0 || stream->req_id != hdr->req_id) continue;
+        if (hdr->payloadLength == 0) {
+            closeUploadStream(stream);
+            return;
+        }
+        char* unpacked = NULL;
+        uint64_t len = hdr->payloadLength;
+        if (hdr->status != 0) {
+            // a packed frame, it never inflates past what one plain frame holds
+            ssize_t n = -1;
+            if (hdr->status <= DATA_CHUNK && (unpacked = malloc(hdr->status))) {
+                n = unpackChunk(payload, hdr->payloadLength, unpacked, hdr->status);
+            }
+            if (n != (ssize_t)hdr->status) {
+                fprintf(stderr, "[Upload] Stream %u sent a broken packed frame\n", hdr->req_id);
+                free(unpacked);
+                closeUploadStream(stream);
+                return;
+            }
+            payload = unpacked;
+            len = n;
+        }
+        if (writeAll(stream->pipe_fd, payload, len) < 0) {
+            fprintf(stderr, "[Upload] Stream %u writer is gone\n", hdr->req_id);
+            closeUploadStream(stream);
+        }
+        free(unpacked);
+        return;
+    }
+}
+
+// resumed upload: tells the client what we already hold and reads back the offset its data
+// starts at, the file is cut there. -1 if the handshake fails
+static off_t negotiateResume(int client_sfd, int data_in, int file_fd, int inband, const char* client_path, int is_bg, int compress, int timeout) {
+    struct stat st;
+    if (fstat(file_fd, &st) < 0) return -1;
+    resume_info info = { .size = (uint64_t)st.st_size };
+    off_t tail = st.st_size < RESUME_TAIL ? st.st_size : RESUME_TAIL;
+    if (crc32cRange(file_fd, st.st_size - tail, tail, &info.tail_crc) < 0) return -1;
+    if (inband) {
+        char stream_info[300];
+        snprintf(stream_info, sizeof(stream_info), "DATA_STREAM %s %llu %08x%s", client_path, (unsigned long long)info.size, info.tail_crc, compress ? " -z" : "");
+        if (sendProtocolMsgLocked(client_sfd, UPLOAD_RES, 0, stream_info, is_bg) < 0) return -1;
+    } else if (writeAll(data_in, &info, sizeof(info)) < 0) {
+        return -1;
+    }
+    uint64_t from;
+    if (waitReadable(data_in, timeout) < 0) return -1;
+    if (readAll(data_in, &from, sizeof(from)) != sizeof(from) || from > info.size) {
+        noteIdle();
+        return -1;
+    }
+    if (ftruncate(file_fd, from) < 0 || lseek(file_fd, from, SEEK_SET) < 0) return -1;
+    return from;
+}
+
+// upload -d: the signatures of the server's copy go out, the delta coming back is rebuilt into
+// the part file. No copy yet simply means no signatures, the client then sends everything
+static int receiveDelta(int data_sfd, int part_fd, char* path, ClientSession* session, uint64_t* total, uint64_t* literal, uint32_t* crc) {
+    int helper_fd = connectToHelper();
+    helper_response res;
+    int basis_fd = -1;
+    struct stat st = { .st_size = 0 };
+    // the old copy is opened like a download, locked shared so no upload replaces it meanwhile
+    if (sendHelperRequestRW(helper_fd, DOWNLOAD, 1, &path, 0, session, NULL, 0, &res) == 0) {
+        basis_fd = recvFd(helper_fd);
+        if (basis_fd >= 0 && fstat(basis_fd, &st) < 0) st.st_size = 0;
+    }
+    close(helper_fd);
+    delta_header dh;
+    int ret = -1;
+    errno = 0; // only a timeout on the data connection counts as idle
+    if (sendSignatures(data_sfd, basis_fd, st.st_size, &dh) == 0) {
+        ret = applyDelta(data_sfd, basis_fd, &dh, part_fd, total, literal, crc);
+    }
+    if (ret < 0) noteIdle();
+    if (basis_fd >= 0) close(basis_fd);
+    return ret;
+}
+
 void handleUpload(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr) {
-    int is_bg = (argc >= 4 && strcmp(argv[argc-1], "-b") == 0);
+    TransferOpts opts;
+    if (parseTransferOpts(argc, argv, 0, &opts) < 0 || argc < 3) {
+        sendProtocolMsgLocked(client_sfd, TEXT, -1, "Usage: upload <client_path> <server_path> [-r | -p N | -d] [-z] [-b]", 0);
+        return;
+    }
+    int is_bg = opts.is_bg;
     if (session->state != STATE_LOGGED_IN) {
         sendProtocolMsgLocked(client_sfd, TEXT, -1, "Log in first", is_bg);
         return;
     }
-    if (argc < 3 || argc > 4) {
-        sendProtocolMsgLocked(client_sfd, TEXT, -1, "Usage: upload <client_path> <server_path> [-b]", 0);
+    int inband = hdr->status & CMD_INBAND_DATA;
+    if (inband && hdr->req_id == 0) {
+        sendProtocolMsgLocked(client_sfd, TEXT, -1, "In-band upload needs a request id", is_bg);
         return;
     }
-
-    int data_listener = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = 0 };
-    if (bind(data_listener, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        sendProtocolMsgLocked(client_sfd, TEXT, -1, "Internal: bind failed", is_bg);
+    if (inband) {
+        opts.streams = 1; // in-band frames share one connection anyway
+        opts.delta = 0;   // and carry the upload one way only, the signatures have no way back
+    }
+    int slot = scheduleTransfer(client_sfd, argc, argv, server, session, hdr, is_bg);
+    if (slot < 0) {
         return;
     }
-    listen(data_listener, 1);
 
-    socklen_t len = sizeof(addr);
-    getsockname(data_listener, (struct sockaddr*)&addr, &len);
-    int data_port = ntohs(addr.sin_port);
+    int data_listener = -1;
+    int data_port = 0;
+    int stream_pipe[2] = { -1, -1 };
+    if (inband) {
+        if (pipe(stream_pipe) < 0 || openUploadStream(session, hdr->req_id, stream_pipe[1]) < 0) {
+            if (stream_pipe[0] >= 0) {
+                close(stream_pipe[0]);
+                close(stream_pipe[1]);
+            }
+            releaseAdmission(slot);
+            sendProtocolMsgLocked(client_sfd, TEXT, -1, "Too many in-band uploads", is_bg);
+            return;
+        }
+        // the handler writes whatever the client sends into it, a roomier pipe blocks it less
+        fcntl(stream_pipe[1], F_SETPIPE_SZ, 1 << 20);
+    } else {
+        data_listener = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = 0 };
+        if (bind(data_listener, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            releaseAdmission(slot);
+            close(data_listener);
+            sendProtocolMsgLocked(client_sfd, TEXT, -1, "Internal: bind failed", is_bg);
+            return;
+        }
+        listen(data_listener, opts.streams);
+        setDataTimeouts(data_listener, server->data_timeout);
+
+        socklen_t len = sizeof(addr);
+        getsockname(data_listener, (struct sockaddr*)&addr, &len);
+        data_port = ntohs(addr.sin_port);
+    }
     pid_t pid = fork();
     if (pid < 0) {
+        releaseAdmission(slot);
         sendProtocolMsgLocked(client_sfd, TEXT, -1, "Fork failed", is_bg);
-        close(data_listener);
+        if (data_listener >= 0) close(data_listener);
+        if (inband) {
+            close(stream_pipe[0]);
+            msg_header end = { .type = DATA, .req_id = hdr->req_id };
+            handleUploadData(&end, NULL, session); // as if the client had ended it
+        }
         return;
     }
     if (pid > 0) {
-        char port_info[64];
-        snprintf(port_info, sizeof(port_info), "DATA_PORT %d %s", data_port, argv[1]);
-        sendProtocolMsgLocked(client_sfd, UPLOAD_RES, 0, port_info, 0);
-        close(data_listener);
+        live_children++;
+        handOverAdmission(slot, pid);
+        char port_info[300];
+        if (inband) {
+            close(stream_pipe[0]);
+            if (opts.resume) {
+                return; // the child announces the stream along with what the server holds
+            }
+            snprintf(port_info, sizeof(port_info), "DATA_STREAM %s%s", argv[1], opts.compress ? " -z" : "");
+        } else {
+            if (opts.streams > 1) {
+                snprintf(port_info, sizeof(port_info), "DATA_PORT %d %s -p %d", data_port, argv[1], opts.streams);
+            } else {
+                snprintf(port_info, sizeof(port_info), "DATA_PORT %d %s%s%s%s", data_port, argv[1],
+                         opts.resume ? " -r" : "", opts.compress ? " -z" : "", opts.delta ? " -d" : "");
+            }
+            close(data_listener);
+        }
+        sendProtocolMsgLocked(client_sfd, UPLOAD_RES, 0, port_info, is_bg && inband);
         return;
     }   
+    releaseEngineFds(client_sfd);
+    closeUploadStreams(session); // our own write end included
+    closeHelperChannel(session); // the child streams over its own connection, the channel stays the parent's
     release_socket_lock(client_sfd);
-    int data_sfd = accept(data_listener, NULL, NULL);
-    close(data_listener); // close old fd since now accepted new con
-    if (data_sfd < 0) _exit(1);
+    int data_sfd = stream_pipe[0];
+    if (!inband && opts.streams == 1) {
+        data_sfd = accept(data_listener, NULL, NULL);
+        close(data_listener); // close old fd since now accepted new con
+        data_listener = -1;
+        if (data_sfd < 0) {
+            char err_msg[128];
+            snprintf(err_msg, sizeof(err_msg), "Upload failed: no data connection within %d s", server->data_timeout);
+            sendProtocolMsgLocked(client_sfd, TEXT, -1, err_msg, is_bg);
+            releaseAdmission(slot);
+            _exit(1);
+        }
+        setDataTimeouts(data_sfd, server->data_timeout);
+    }
 
     int helper_fd = connectToHelper();
     helper_response res;
-    char *h_argv[] = { argv[2] };
-    if (sendHelperRequestRW(helper_fd, UPLOAD, 1, h_argv, 0, session, NULL, 0, &res) == 0) {
-    
-        char buffer[16384];
-        ssize_t n;
-        while ((n = read(data_sfd, buffer, sizeof(buffer))) > 0) {
-            if (writeAll(helper_fd, buffer, n) < 0) {
-                fprintf(stderr, "[Upload] Failed writing to helper\n");
-                break;
+    // parallel parts and a delta go to a part file of their own, which only replaces the target once complete
+    int to_part = opts.streams > 1 || opts.delta;
+    char *h_argv[] = { argv[2], to_part ? "part" : "resume" };
+    int file_fd = -1;
+    if (sendHelperRequestRW(helper_fd, UPLOAD, (opts.resume || to_part) ? 2 : 1, h_argv, 0, session, NULL, 0, &res) == 0 &&
+        (file_fd = recvFd(helper_fd)) >= 0) {
+        close(helper_fd);
+        helper_fd = -1;
+        off_t from = 0;
+        int committed = -1;
+        uint64_t total = 0, literal = 0;
+        uint32_t crc = 0;
+        int received = -1;
+        if (to_part) {
+            received = opts.delta ?
+                receiveDelta(data_sfd, file_fd, argv[2], session, &total, &literal, &crc) :
+                receiveRanges(data_listener, file_fd, opts.streams, server->data_timeout);
+            struct stat assembled;
+            // each slice matched its own checksum, the whole file still gets the one the other
+            // uploads report
+            if (received == 0 && !opts.delta &&
+                (fstat(file_fd, &assembled) < 0 || crc32cRange(file_fd, 0, assembled.st_size, &crc) < 0)) {
+                received = -1;
             }
+            if (received == 0) {
+                helper_fd = connectToHelper();
+                committed = sendHelperRequest(helper_fd, UPLOAD_COMMIT, 1, &argv[2], session, &res);
+            } else if (data_idle) {
+                snprintf(res.msg, sizeof(res.msg), "data connection idle for %d s", server->data_timeout);
+            } else if (opts.delta) {
+                snprintf(res.msg, sizeof(res.msg), "the rebuilt file does not match the client's checksum");
+            } else {
+                snprintf(res.msg, sizeof(res.msg), "a part is missing or does not match its checksum");
+            }
+            if (data_listener >= 0) close(data_listener);
+            if (data_sfd >= 0) close(data_sfd);
+            close(file_fd); // drops the lock, the part file is gone or about to be
+            if (committed != 0) {
+                char part_path[ABS_PATH + 8];
+                char* d_argv[] = { part_path };
+                snprintf(part_path, sizeof(part_path), "%s.part", argv[2]);
+                if (helper_fd < 0) helper_fd = connectToHelper();
+                helper_response del;
+                sendHelperRequest(helper_fd, DELETE, 1, d_argv, session, &del);
+            }
+        } else {
+            if (opts.resume) {
+                from = negotiateResume(client_sfd, data_sfd, file_fd, inband, argv[1], is_bg, opts.compress, server->data_timeout);
+            }
+            if (from >= 0 && (received = receiveStream(data_sfd, file_fd, !inband && opts.compress, server->data_timeout, &crc)) < 0) {
+                fprintf(stderr, "[Upload] Failed writing to file\n");
+            }
+            close(data_sfd);
+            close(file_fd);
         }
 
-        close(data_sfd);
-
-        char finished_msg[128];
-        snprintf(finished_msg, sizeof(finished_msg), "upload %s %s concluded", argv[2], argv[1]);
-        sendProtocolMsgLocked(client_sfd, TEXT, 0, finished_msg, is_bg);   
+        char finished_msg[1500];
+        if (data_idle && !to_part) {
+            // what arrived stays, upload -r goes on from there
+            snprintf(finished_msg, sizeof(finished_msg), "Upload failed: data connection idle for %d s", server->data_timeout);
+            from = -1;
+        } else if (to_part && committed != 0) {
+            snprintf(finished_msg, sizeof(finished_msg), "Upload failed: %s", res.msg);
+            from = -1;
+        } else if (opts.delta) {
+            snprintf(finished_msg, sizeof(finished_msg), "upload %s %s concluded, delta sent %llu of %llu bytes, crc32c %08x",
+                     argv[2], argv[1], (unsigned long long)literal, (unsigned long long)total, crc);
+        } else if (opts.streams > 1) {
+            snprintf(finished_msg, sizeof(finished_msg), "upload %s %s concluded over %d streams, crc32c %08x", argv[2], argv[1], opts.streams, crc);
+        } else if (from < 0) {
+            snprintf(finished_msg, sizeof(finished_msg), "Upload failed: the client did not say where to resume");
+        } else if (received < 0) {
+            snprintf(finished_msg, sizeof(finished_msg), "Upload failed: the data stream broke off");
+            from = -1;
+        } else if (from > 0) {
+            snprintf(finished_msg, sizeof(finished_msg), "upload %s %s concluded, resumed at byte %lld, crc32c %08x", argv[2], argv[1], (long long)from, crc);
+        } else {
+            snprintf(finished_msg, sizeof(finished_msg), "upload %s %s concluded, crc32c %08x", argv[2], argv[1], crc);
+        }
+        sendProtocolMsgLocked(client_sfd, TEXT, from < 0 ? -1 : 0, finished_msg, is_bg);   
     } else {
-        close(data_sfd);
+        if (data_sfd >= 0) close(data_sfd);
+        if (data_listener >= 0) close(data_listener); // resets the part streams still waiting
         char err_msg[1500];
         snprintf(err_msg, sizeof(err_msg), "Upload failed: %s", 
-             (res.msg[0] != '\0') ? res.msg : "Helper error");
+             (res.status != 0 && res.msg[0] != '\0') ? res.msg : "Helper error");
         sendProtocolMsgLocked(client_sfd, TEXT, -1, err_msg, is_bg);
     }
-    close(helper_fd);
-    exit(0);
+    if (helper_fd >= 0) {
+        close(helper_fd);
+    }
+    releaseAdmission(slot);
+    _exit(0);
 }
 
 void handleTransferRequest(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr) {
@@ -821,6 +2190,11 @@ void handleTransferRequest(int client_sfd, int argc, char* argv[], Server* serve
         sem_post(&registry->mux);
         // polling each sec releasing the lock
         if (target_pid == 0) {
+            if (server->engine == ENGINE_EPOLL) {
+                // sleeping here would stall every session of the loop, let it retry us on its next tick
+                dispatch_deferred = 1;
+                return;
+            }
             sleep(1);
         }
     }
@@ -858,6 +2232,96 @@ void handleTransferRequest(int client_sfd, int argc, char* argv[], Server* serve
     sendProtocolMsg(client_sfd, TEXT, 0, success);
 }
 
+#define JOB_REPORT_MS 1000
+
+static uint64_t monotonicMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// takes a free job entry for an accepted request, or the oldest finished one whose parties
+// never came back to hear about it
+static TransferJob* claimJob(const TransferRequest* req) {
+    TransferJob* job = NULL;
+    sem_wait(&registry->mux);
+    for (int i = 0; i < MAX_TRANSFER_JOBS; i++) {
+        TransferJob* j = &registry->jobs[i];
+        if (j->id == 0) {
+            job = j;
+            break;
+        }
+        if (j->state != JOB_RUNNING && (!job || j->started_ms < job->started_ms)) {
+            job = j;
+        }
+    }
+    if (job) {
+        memset(job, 0, sizeof(*job));
+        job->id = req->id;
+        strncpy(job->sender, req->sender, sizeof(job->sender) - 1);
+        strncpy(job->receiver, req->receiver, sizeof(job->receiver) - 1);
+        strncpy(job->filename, req->filename, sizeof(job->filename) - 1);
+        job->state = JOB_RUNNING;
+        job->started_ms = monotonicMs();
+    }
+    sem_post(&registry->mux);
+    return job;
+}
+
+// wakes the handlers of both parties, they tell their clients from check_for_notifications
+static void signalJobParties(const TransferJob* job) {
+    sem_wait(&registry->mux);
+    for (int i = 0; i < MAX_USERS; i++) {
+        UserEntry* user = &registry->online_users[i];
+        if (user->is_active && (strcmp(user->username, job->sender) == 0 || strcmp(user->username, job->receiver) == 0)) {
+            kill(user->handler_pid, SIGUSR1);
+        }
+    }
+    sem_post(&registry->mux);
+}
+
+static void failJob(TransferJob* job, const char* msg) {
+    strncpy(job->msg, msg, sizeof(job->msg) - 1);
+    job->state = JOB_FAILED;
+    job->tick++;
+    signalJobParties(job);
+}
+
+typedef struct {
+    TransferJob* job;
+    uint64_t last_ms;
+    uint64_t last_done;
+} JobProgress;
+
+// copy progress, published to the job and reported to both parties about once a second
+static void reportJob(uint64_t copied, void* arg) {
+    JobProgress* p = arg;
+    p->job->done = copied;
+    uint64_t now = monotonicMs();
+    if (now - p->last_ms < JOB_REPORT_MS) return;
+    p->job->rate = (copied - p->last_done) * 1000 / (now - p->last_ms);
+    p->last_ms = now;
+    p->last_done = copied;
+    p->job->tick++;
+    signalJobParties(p->job);
+}
+
+// a copy that did not make it leaves no "<file>.part" behind in the receiver's home
+static void dropTransferPart(ClientSession* session, const char* dest_path) {
+    char part_path[ABS_PATH + 8];
+    char* d_argv[] = { part_path };
+    snprintf(part_path, sizeof(part_path), "%s.part", dest_path);
+    int helper_fd = connectToHelper();
+    if (helper_fd < 0) return;
+    helper_response res;
+    sendHelperRequest(helper_fd, DELETE, 1, d_argv, session, &res);
+    close(helper_fd);
+}
+
+/*
+accept <dir> <ID>: the copy runs in a child of ours while the session goes on. Both parties get
+its progress about once a second and its outcome as notifications, transfers lists the running ones
+*/
 void handleAcceptTransfer(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr) {
     if (session->state != STATE_LOGGED_IN) {
         sendProtocolMsg(client_sfd, TEXT, -1, "Login required");
@@ -890,11 +2354,36 @@ void handleAcceptTransfer(int client_sfd, int argc, char* argv[], Server* server
         sendProtocolMsg(client_sfd, TEXT, -1, "Error: ID not found or notification not yet processed.");
         return;
     }
-    int helper_fd = connectToHelper();
-    if (helper_fd < 0) {
-        sendProtocolMsg(client_sfd, TEXT, -1, "Internal Error: Helper unreachable");
+    TransferJob* job = claimJob(&current_req);
+    if (!job) {
+        sendProtocolMsg(client_sfd, TEXT, -1, "Error: Too many transfers in flight, try again later");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        failJob(job, "Fork failed");
+        sendProtocolMsg(client_sfd, TEXT, -1, "Fork failed");
+        return;
+    }
+    if (pid > 0) {
+        live_children++;
+        job->pid = pid;
+        char msg[512];
+        snprintf(msg, sizeof(msg), "Transfer %d accepted, %s is being copied in the background (see transfers)",
+                 current_req.id, current_req.filename);
+        sendProtocolMsg(client_sfd, TEXT, 0, msg);
         return;
     }
+    releaseEngineFds(client_sfd);
+    closeUploadStreams(session);
+    closeHelperChannel(session); // the copy asks the pool on its own connection
+    release_socket_lock(client_sfd);
+    close(client_sfd); // both parties hear from their own handlers
+
+    // the copy is made as "<file>.part" and only takes the file's name once it is complete
+    char dest_path[ABS_PATH];
+    snprintf(dest_path, sizeof(dest_path), "/%s/%s", target_dir, current_req.filename);
+
     char* helper_args[4];
     helper_args[0] = current_req.sender;
     helper_args[1] = current_req.filename;
@@ -902,10 +2391,86 @@ void handleAcceptTransfer(int client_sfd, int argc, char* argv[], Server* server
     helper_args[3] = target_dir;
 
     helper_response res;
-    int status = sendHelperRequest(helper_fd, TRANSFER, 4, helper_args, NULL, &res);
-    
-    sendProtocolMsg(client_sfd, TEXT, status, res.msg);
+    memset(&res, 0, sizeof(res));
+    int src_fd = -1, dest_fd = -1;
+    int helper_fd = connectToHelper();
+    if (helper_fd < 0) {
+        failJob(job, "Helper unreachable");
+        _exit(1);
+    }
+    if (sendHelperRequest(helper_fd, TRANSFER, 4, helper_args, NULL, &res) != 0 ||
+        (src_fd = recvFd(helper_fd)) < 0 || (dest_fd = recvFd(helper_fd)) < 0) {
+        failJob(job, res.status != 0 ? res.msg : "Failed to get the files from the helper");
+        _exit(1);
+    }
+    close(helper_fd);
+    job->total = res.payload_len;
+
+    JobProgress progress = { .job = job, .last_ms = job->started_ms };
+    uint64_t copied = 0;
+    CopyMethod method;
+    int copy_ret = copyFileData(src_fd, dest_fd, &copied, &method, reportJob, &progress);
+    int copy_errno = errno;
+    close(src_fd);
+    // the part stays locked until it is committed, no other copy may truncate it before the rename
+    char* c_argv[] = { dest_path };
+    if (copy_ret < 0 || (helper_fd = connectToHelper()) < 0 ||
+        sendHelperRequest(helper_fd, UPLOAD_COMMIT, 1, c_argv, session, &res) != 0) {
+        char msg[sizeof(res.msg) + 64];
+        if (copy_ret < 0) {
+            snprintf(msg, sizeof(msg), "Write error during transfer: %s", strerror(copy_errno));
+        } else {
+            snprintf(msg, sizeof(msg), "Could not put the copy in place: %s", helper_fd < 0 ? "Helper unreachable" : res.msg);
+        }
+        close(dest_fd); // DELETE takes the part's lock itself
+        dropTransferPart(session, dest_path);
+        failJob(job, msg);
+        _exit(1);
+    }
     close(helper_fd);
+    close(dest_fd);
+    uint64_t took = monotonicMs() - job->started_ms;
+    job->done = copied;
+    snprintf(job->msg, sizeof(job->msg), "%llu bytes in %.1f s by %s", (unsigned long long)copied, took / 1000.0,
+             copyMethodName(method));
+    job->state = JOB_DONE;
+    job->tick++;
+    signalJobParties(job);
+    _exit(0);
+}
+
+/*
+transfers: the background copies of accepted transfers this user sends or receives that are still
+running, with the bytes copied so far and the rate over the last report
+*/
+void handleTransfers(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr) {
+    if (session->state != STATE_LOGGED_IN) {
+        sendProtocolMsg(client_sfd, TEXT, -1, "Login required");
+        return;
+    }
+    char out[MAX_TRANSFER_JOBS * 256 + 64];
+    size_t len = 0;
+    int count = 0;
+    sem_wait(&registry->mux);
+    for (int i = 0; i < MAX_TRANSFER_JOBS; i++) {
+        const TransferJob* job = &registry->jobs[i];
+        if (job->id == 0 || job->state != JOB_RUNNING ||
+            (strcmp(job->sender, session->username) != 0 && strcmp(job->receiver, session->username) != 0)) {
+            continue;
+        }
+        unsigned pct = job->total ? (unsigned)(job->done * 100 / job->total) : 0;
+        uint64_t rate = job->rate;
+        uint64_t elapsed = monotonicMs() - job->started_ms;
+        if (rate == 0 && elapsed > 0) rate = job->done * 1000 / elapsed; // no report yet, the average so far
+        int n = snprintf(out + len, sizeof(out) - len, "%s%-4d %-24s %s -> %s  %llu/%llu bytes (%u%%)  %.1f MB/s",
+                         count ? "\n" : "", job->id, job->filename, job->sender, job->receiver,
+                         (unsigned long long)job->done, (unsigned long long)job->total, pct, rate / 1e6);
+        if (n < 0 || (size_t)n >= sizeof(out) - len) break;
+        len += n;
+        count++;
+    }
+    sem_post(&registry->mux);
+    sendProtocolMsg(client_sfd, TEXT, 0, count ? out : "No transfers in flight");
 }
 void handleRejectTransfer(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr) {
     if (session->state != STATE_LOGGED_IN) {
@@ -1,12 +1,48 @@
 // handles each call such as LOGIN, LS etc as routes
 #include "core/server.h"
 #include "net/net.h"
+#include <signal.h>
 
 #ifndef HANDLER_H
 #define HANDLER_H
 
 typedef enum { STATE_NOT_LOGGED_IN, STATE_LOGGED_IN } ClientState; // to enforce login and creation
 
+#define MAX_UPLOAD_STREAMS 8
+
+// in-band upload being received: DATA frames with this req_id go down the pipe to the child writing the file
+typedef struct {
+    uint32_t req_id;    // 0 for a free entry
+    int pipe_fd;
+} UploadStream;
+
+// write whose content is streaming in: WRITECMD chunks with this req_id are pwritten to fd at pos
+typedef struct {
+    uint32_t req_id;    // 0 when no write is open
+    int fd;             // -1 once the write failed, the rest of its chunks are dropped
+    off_t pos;
+} WriteStream;
+
+#define MAX_READ_STREAMS 4
+
+// read streaming from a child of its own: closing cancel_fd, the write end of a pipe the child
+// polls between frames, stops it. The entry goes stale once the child is done, see openReadStream
+typedef struct {
+    uint32_t req_id;    // 0 for a free entry
+    int cancel_fd;
+} ReadStream;
+
+#define MAX_SESSION_QUEUED 8
+
+// transfer waiting in the scheduler's queue, its command runs again once it is let in
+typedef struct {
+    uint32_t ticket;    // 0 for a free entry
+    int priority;
+    msg_header hdr;
+    char* command;
+    Server* server;
+} QueuedCommand;
+
 typedef struct {
     ClientState state;
     uid_t uid;
@@ -14,13 +50,32 @@ typedef struct {
     char username[MAX_USERNAME_LEN];
     char home[ABS_PATH];
     char workdir[ABS_PATH]; //relative to home path 
+    int helper_fd; // persistent helper connection of this session, -1 until first use
+    int helper_dedicated; // helper_fd is served by a worker sandboxed for this user only
+    int admission_slot; // registry slot held while the session lives, -1 if none
+    UploadStream uploads[MAX_UPLOAD_STREAMS];
+    WriteStream write;
+    ReadStream reads[MAX_READ_STREAMS];
+    QueuedCommand queued[MAX_SESSION_QUEUED];
 } ClientSession;
 
 
 
-void handleClient(int client_sfd, Server* server);
+extern volatile sig_atomic_t transfer_signal_received;
+extern int dispatch_deferred;
+
+void handleClient(int client_sfd, Server* server, int admission_slot);
+void closeClientSession(int client_sfd, ClientSession* session);
+void closeUploadStreams(ClientSession* session);
+void dropQueuedCommands(ClientSession* session);
+void setup_signal_handling();
+void check_for_notifications(int client_fds, ClientSession* session);
 void dispatchCommands(int client_sfd, msg_header* hdr, char* payload, Server* server, ClientSession* session);
 int tokenizeCommand(char* input, char* argv[]);
+void handleUploadData(msg_header* hdr, char* payload, ClientSession* session);
+void handleWriteData(int client_sfd, msg_header* hdr, char* payload, ClientSession* session);
+void handleCancel(msg_header* hdr, ClientSession* session);
+void handleBatch(int client_sfd, msg_header* hdr, char* payload, Server* server, ClientSession* session);
 void handleCreateUser(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr);
 void handleLogin(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr);
 void handleCd(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr);
@@ -36,4 +91,5 @@ void handleUpload(int client_sfd, int argc, char* argv[], Server* server, Client
 void handleTransferRequest(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr);
 void handleAcceptTransfer(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr);
 void handleRejectTransfer(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr);
+void handleTransfers(int client_sfd, int argc, char* argv[], Server* server, ClientSession* session, msg_header* hdr);
 #endif
\ No newline at end of file
@@ -18,14 +18,40 @@
 #include <stdint.h>
 
 #include <sys/mman.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 
 #include "helper/helper.h"
 #include "net/net.h"
 #include "utils/utils.h"
+#include "utils/sandbox.h"
 
 #define USER_CREATION_LOCK_FILENAME ".user_creation.lock"
+#define HELPER_POOL_TICK_MS 100          // how often the master checks the pool
+#define HELPER_SHRINK_DELAY 10           // seconds of surplus before an idle worker is retired
+#define HELPER_CHANNELS_PER_WORKER 256
 static char lock_file_path[PATH_MAX];
 
+// channels multiplexed by this worker, fds[0] is the shared listener
+static struct pollfd worker_fds[HELPER_CHANNELS_PER_WORKER + 1];
+static int worker_channels = 0;
+
+static void spawnHelperWorker(Helper* helper);
+static void stopHelperPool();
+static int startSessionWorker(Helper* helper, int server_fds, const char* username, helper_response* login);
+
+// a transfer child only keeps the channel it streams on
+static void releaseWorkerFds(int keep_fd) {
+    if (worker_channels == 0) return;
+    close(worker_fds[0].fd);
+    for (int i = 1; i <= worker_channels; i++) {
+        if (worker_fds[i].fd != keep_fd) close(worker_fds[i].fd);
+    }
+    worker_channels = 0;
+}
+
 
 typedef void (*cmd_func) (int server_fds, int argc, char* argv[]);
 
@@ -53,6 +79,32 @@ void initSharedRegistry() {
     printf("Shared memory segment initialized\n");
     memset(registry->online_users, 0, sizeof(registry->online_users));
     memset(registry->pending, 0, sizeof(registry->pending));
+    memset(registry->jobs, 0, sizeof(registry->jobs));
+    memset(registry->queued, 0, sizeof(registry->queued));
+}
+
+// a server taking over keeps the registry of the one it replaces, logins and limits carry on
+int attachSharedRegistry() {
+    int fd = shm_open("/server_registry", O_RDWR, 0660);
+    if (fd == -1) {
+        perror("shm_open");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size != (off_t)sizeof(SharedRegistry)) {
+        fprintf(stderr, "Registry layout differs from this build, cannot take over\n");
+        close(fd);
+        return -1;
+    }
+    registry = mmap(NULL, sizeof(SharedRegistry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (registry == MAP_FAILED) {
+        perror("mmap");
+        registry = NULL;
+        return -1;
+    }
+    printf("Shared memory segment attached\n");
+    return 0;
 }
 
 void SharedMemCleanup() {
@@ -85,6 +137,11 @@ Helper* CreateHelper(int socket_fd, char* rootDir) {
     }
     strncpy(helper->rootDir, absRoot, sizeof(helper->rootDir)-1);
     helper->rootDir[sizeof(helper->rootDir)-1] = '\0';
+    helper->min_workers = DEFAULT_HELPER_MIN_WORKERS;
+    helper->max_workers = DEFAULT_HELPER_MAX_WORKERS;
+    helper->session_workers = 0;
+    helper->sandbox_mode = SANDBOX_CHROOT;
+    helper->takeover = 0;
     return helper;
 }
 
@@ -99,77 +156,276 @@ void runHelperLoop(Helper* helper) {
     }
     close(test_fd);
 
+    // connections now live as long as a session, each one must leave the chroot after every command
+    if (initSandboxRoot() < 0 || initPathSandbox(helper->sandbox_mode) < 0) {
+        return;
+    }
+    // every worker polls the same listener, the ones losing the accept race must not block in it
+    int flags = fcntl(helper->socket_fds, F_GETFL, 0);
+    fcntl(helper->socket_fds, F_SETFL, flags | O_NONBLOCK);
+
     printf("helper set-up and ready\n");
     printf("[Helper] Lock file created at %s\n", lock_file_path);
+    printf("[Helper] Worker pool: min %d, max %d\n", helper->min_workers, helper->max_workers);
+
+    if (!helper->takeover) {
+        memset(registry->helper_pool, 0, sizeof(registry->helper_pool));
+    }
+    time_t surplus_since = 0;
+    // the server can't signal us once it dropped root, so we watch for it going away instead
+    pid_t server_pid = getppid();
+
     while (1) {
-        // should fork for each arriving command for parallelism
-        struct sockaddr_un addr;
-        socklen_t len = sizeof(addr);
-        int server_fds = accept(helper->socket_fds,(struct sockaddr*)&addr, &len);
-        // accept incoming connections 
-        if (server_fds < 0) { perror("accept"); return;}
+        if (getppid() != server_pid) {
+            stopHelperPool();
+            return;
+        }
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < MAX_HELPER_WORKERS; i++) {
+                if (registry->helper_pool[i].pid == pid && registry->helper_pool[i].master == getpid()) {
+                    printf("[Helper] Worker %d (PID %d) exited with status %d\n", i, pid, status);
+                    memset(&registry->helper_pool[i], 0, sizeof(HelperWorkerSlot));
+                }
+            }
+        }
 
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork");
-            close(server_fds);
-            continue;
+        int total = 0, idle = 0, spare = -1;
+        for (int i = 0; i < MAX_HELPER_WORKERS; i++) {
+            HelperWorkerSlot* slot = &registry->helper_pool[i];
+            if (slot->state == HELPER_SLOT_FREE || slot->master != getpid()) continue;
+            total++;
+            if (slot->state == HELPER_IDLE) {
+                idle++;
+                if (slot->channels == 0) spare = i;
+            }
         }
-        if (pid == 0) {
-            close(helper->socket_fds);
-            handleCommands(helper, server_fds);
-            close(server_fds);
-            _exit(0);
+
+        if (total < helper->min_workers || (idle == 0 && total < helper->max_workers)) {
+            // every worker is in the middle of a command, add one so new requests don't queue behind them
+            spawnHelperWorker(helper);
+            surplus_since = 0;
+        } else if (spare >= 0 && idle > 1 && total > helper->min_workers) {
+            // only retire a worker nobody is attached to, after the surplus lasted a while
+            time_t now = time(NULL);
+            if (surplus_since == 0) {
+                surplus_since = now;
+            } else if (now - surplus_since >= HELPER_SHRINK_DELAY) {
+                __sync_bool_compare_and_swap(&registry->helper_pool[spare].state, HELPER_IDLE, HELPER_RETIRING);
+                surplus_since = 0;
+            }
+        } else {
+            surplus_since = 0;
         }
-        else {
-            close(server_fds);
+        usleep(HELPER_POOL_TICK_MS * 1000);
+    }
+}
+
+// the slots go back to the registry, a server that took over keeps using it
+static void stopHelperPool() {
+    printf("[Helper] Server gone, stopping the pool\n");
+    for (int i = 0; i < MAX_HELPER_WORKERS; i++) {
+        HelperWorkerSlot* slot = &registry->helper_pool[i];
+        if (slot->state != HELPER_SLOT_FREE && slot->master == getpid()) {
+            kill(slot->pid, SIGTERM);
+            waitpid(slot->pid, NULL, 0);
+            memset(slot, 0, sizeof(HelperWorkerSlot));
         }
     }
 }
 
-void handleCommands(Helper* helper, int server_fds){
-    // if else if chain for priviledged commands
+void printHelperPool() {
+    time_t now = time(NULL);
+    printf("[Helper pool]\n");
+    for (int i = 0; i < MAX_HELPER_WORKERS; i++) {
+        HelperWorkerSlot* slot = &registry->helper_pool[i];
+        if (slot->state == HELPER_SLOT_FREE) continue;
+        const char* state = slot->state == HELPER_BUSY ? "busy" :
+                            slot->state == HELPER_RETIRING ? "retiring" : "idle";
+        printf("  worker %2d pid %6d %-8s channels %3u requests %6u", i, slot->pid, state,
+               slot->channels, slot->requests);
+        if (slot->state == HELPER_BUSY) printf(" busy for %lds", (long)(now - slot->busy_since));
+        printf("\n");
+    }
+}
+
+// serves every session channel it accepted from one poll loop, no fork per connection or command
+static void runHelperWorker(Helper* helper, HelperWorkerSlot* slot) {
+    struct pollfd* fds = worker_fds;
+    fds[0].fd = helper->socket_fds;
+    fds[0].events = POLLIN;
+
     while (1) {
-        helper_request_header hdr;
-        ssize_t n = readAll(server_fds, &hdr, sizeof(hdr));
-        if (n <= 0) {
-            if (n == 0) printf("[Helper] Server closed connection\n");
-            else perror("[Helper] read error");
+        // reap transfer children handed their connection
+        while (waitpid(-1, NULL, WNOHANG) > 0);
+
+        if (slot->state == HELPER_RETIRING) {
+            if (worker_channels == 0) break;
+            slot->state = HELPER_IDLE; // a session attached meanwhile, stay
+        }
+        int accepting = worker_channels < HELPER_CHANNELS_PER_WORKER;
+        struct pollfd* watched = accepting ? fds : fds + 1;
+        int n = poll(watched, worker_channels + accepting, HELPER_POOL_TICK_MS * 10);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("[Helper] poll");
             break;
         }
-        printf("[Helper] hdr.cmd=%d argc=%u payload_len=%u data_len=%u offset=%d\n",
-        hdr.cmd, hdr.argc, hdr.payload_len, hdr.data_len, hdr.offset);
-
-        char* payload = NULL;
-        char* args[MAXARGS] = {NULL};
-
-        if (hdr.payload_len > 0) {
-            payload = malloc(hdr.payload_len);
-            if (readAll(server_fds, payload, hdr.payload_len) <= 0) {
-                free(payload);
-                break;
-            }
-            // args array unpacking
-            char* p = payload;
-            for (int i = 0; i < hdr.argc && i < MAXARGS; i++) {
-                args[i] = p;
-                p += strlen(p) + 1; 
+        if (n == 0) continue;
+
+        if (accepting && (fds[0].revents & POLLIN)) {
+            int server_fds = accept(helper->socket_fds, NULL, NULL);
+            if (server_fds >= 0) {
+                worker_channels++;
+                fds[worker_channels].fd = server_fds;
+                fds[worker_channels].events = POLLIN;
+                fds[worker_channels].revents = 0;
+                slot->channels = worker_channels;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
             }
         }
-        void *data_buf = NULL;
 
-        if (hdr.data_len > 0) {
-            data_buf = malloc(hdr.data_len);
-            if (!data_buf || readAll(server_fds, data_buf, hdr.data_len) <= 0) {
-                free(payload);
-                free(data_buf);
-                break;
+        for (int i = 1; i <= worker_channels; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            slot->state = HELPER_BUSY;
+            slot->busy_since = time(NULL);
+            int keep = handleHelperRequest(helper, fds[i].fd);
+            slot->requests++;
+            slot->state = HELPER_IDLE;
+
+            if (keep <= 0) {
+                close(fds[i].fd);
+                fds[i] = fds[worker_channels];
+                worker_channels--;
+                slot->channels = worker_channels;
+                i--;
             }
         }
-        helper_response res;
-        memset(&res, 0, sizeof(res));
-        res.cmd = hdr.cmd;
-        res.status = -1;
+    }
+    _exit(0);
+}
+
+static void spawnHelperWorker(Helper* helper) {
+    int idx = -1;
+    // the master keeps the count under max_workers, slots below it may be a draining helper's
+    for (int i = 0; i < MAX_HELPER_WORKERS; i++) {
+        if (registry->helper_pool[i].state == HELPER_SLOT_FREE) {
+            idx = i;
+            break;
+        }
+    }
+    if (idx < 0) return;
+
+    HelperWorkerSlot* slot = &registry->helper_pool[idx];
+    memset(slot, 0, sizeof(HelperWorkerSlot));
+    slot->master = getpid();
+    slot->state = HELPER_IDLE;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork helper worker");
+        slot->state = HELPER_SLOT_FREE;
+        return;
+    }
+    if (pid == 0) {
+        // the pool goes down with its master
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        slot->pid = getpid();
+        runHelperWorker(helper, slot);
+    }
+    slot->pid = pid;
+    printf("[Helper] Worker %d started (PID %d)\n", idx, pid);
+}
+
+void handleCommands(Helper* helper, int server_fds){
+    while (handleHelperRequest(helper, server_fds) > 0);
+}
+
+// commands waiting for a file lock that a stream may hold for long. They run in a process of
+// their own, which then keeps serving their channel. READ and WRITE only try the lock and stay here
+static int takesFileLock(uint32_t cmd) {
+    return cmd == DOWNLOAD || cmd == UPLOAD || cmd == UPLOAD_COMMIT || cmd == TRANSFER;
+}
+
+// reads and serves one request. 1: keep the connection, 0: closed or handed off, -1: broken
+int handleHelperRequest(Helper* helper, int server_fds) {
+    // if else if chain for priviledged commands
+    helper_request_header hdr;
+    ssize_t n = readAll(server_fds, &hdr, sizeof(hdr));
+    if (n <= 0) {
+        if (n == 0) printf("[Helper] Server closed connection\n");
+        else perror("[Helper] read error");
+        return n;
+    }
+    if (hdr.version != PROTOCOL_VERSION) {
+        fprintf(stderr, "[Helper] Dropping a server speaking protocol version %u, we speak %u\n", hdr.version, PROTOCOL_VERSION);
+        return -1;
+    }
+    if (hdr.payload_len > MAX_PAYLOAD_LEN || hdr.data_len > MAX_PAYLOAD_LEN || hdr.offset > INT64_MAX) {
+        fprintf(stderr, "[Helper] Malformed request header\n");
+        return -1;
+    }
+    printf("[Helper] hdr.cmd=%d argc=%u payload_len=%llu data_len=%llu offset=%llu\n",
+    hdr.cmd, hdr.argc, (unsigned long long)hdr.payload_len, (unsigned long long)hdr.data_len, (unsigned long long)hdr.offset);
+
+    char* payload = NULL;
+    char* args[MAXARGS] = {NULL};
+
+    if (hdr.payload_len > 0) {
+        payload = malloc(hdr.payload_len);
+        if (readAll(server_fds, payload, hdr.payload_len) <= 0) {
+            free(payload);
+            return -1;
+        }
+        // args array unpacking
+        char* p = payload;
+        for (int i = 0; i < hdr.argc && i < MAXARGS; i++) {
+            args[i] = p;
+            p += strlen(p) + 1; 
+        }
+    }
+    void *data_buf = NULL;
+
+    if (hdr.data_len > 0) {
+        data_buf = malloc(hdr.data_len);
+        if (!data_buf || readAll(server_fds, data_buf, hdr.data_len) <= 0) {
+            free(payload);
+            free(data_buf);
+            return -1;
+        }
+    }
+    if (takesFileLock(hdr.cmd)) {
+        // taking the file lock may wait for a transfer in progress, it gets a process of its
+        // own so the channels multiplexed on this worker are not stuck behind it
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork transfer");
+            free(payload);
+            free(data_buf);
+            return -1;
+        }
+        if (pid > 0) {
+            free(payload);
+            free(data_buf);
+            return 0;
+        }
+        releaseWorkerFds(server_fds);
+    }
+    helper_response res;
+    memset(&res, 0, sizeof(res));
+    res.version = PROTOCOL_VERSION;
+    res.cmd = hdr.cmd;
+    res.req_id = hdr.req_id;
+    res.status = -1;
+    int keep = 1;
+    if (isSandboxLocked() && (hdr.cmd == CREATE_USER || hdr.cmd == LOGIN || hdr.cmd == TRANSFER)) {
+        // root is gone for good here, the server sends these to the pool
+        strncpy(res.msg, "Command not available on a session worker", sizeof(res.msg)-1);
+        writeAll(server_fds, &res, sizeof(res));
+    } else {
         switch(hdr.cmd) {
             case CREATE_USER: {
                 mode_t mode = strtol(args[1], NULL, 8);
@@ -179,7 +435,11 @@ void handleCommands(Helper* helper, int server_fds){
             }
 
             case LOGIN:
+                res.data.login.dedicated = helper->session_workers;
                 handleHelperLogin(server_fds, args[0], &res);
+                if (res.status == 0 && helper->session_workers) {
+                    keep = startSessionWorker(helper, server_fds, args[0], &res);
+                }
                 break;
 
             case LS:
@@ -213,13 +473,17 @@ void handleCommands(Helper* helper, int server_fds){
                 HandleHelperRead(server_fds, &hdr, args[0], hdr.offset, &res);
                 break;
             case WRITE:
-                HandleHelperWrite(server_fds, &hdr, args[0], hdr.offset,data_buf, hdr.data_len, &res);
+                HandleHelperWrite(server_fds, &hdr, args[0], hdr.offset, &res);
                 break;
             case DOWNLOAD:
                 HandleHelperDownload(server_fds, &hdr, args[0], &res);
                 break;
             case UPLOAD:
-                HandleHelperUpload(server_fds, &hdr, args[0], &res);
+                HandleHelperUpload(server_fds, &hdr, args[0], args[1] && strcmp(args[1], "resume") == 0,
+                                   args[1] && strcmp(args[1], "part") == 0, &res);
+                break;
+            case UPLOAD_COMMIT:
+                HandleHelperUploadCommit(server_fds, &hdr, args[0], &res);
                 break;
             case TRANSFER:
                 HandleHelperTransfer(server_fds, &hdr, helper->rootDir, args[0], args[1], args[2], args[3], &res);
@@ -228,15 +492,41 @@ void handleCommands(Helper* helper, int server_fds){
                 strncpy(res.msg, "Command not available on the helper", sizeof(res.msg)-1);
                 writeAll(server_fds, &res, sizeof(res));
         }
-        if (payload) {
-            free(payload);
-            payload = NULL; 
-        }
-        if (data_buf) {
-            free(data_buf);
-            data_buf = NULL; 
-        }
     }
+    if (payload) {
+        free(payload);
+        payload = NULL; 
+    }
+    if (data_buf) {
+        free(data_buf);
+        data_buf = NULL; 
+    }
+    if (takesFileLock(hdr.cmd)) {
+        handleCommands(helper, server_fds);
+        _exit(0);
+    }
+    return keep;
+}
+
+// the channel that logged in gets a process of its own, jailed in the user's home and
+// privilege-dropped once, which then serves every command of that session
+static int startSessionWorker(Helper* helper, int server_fds, const char* username, helper_response* login) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork session worker");
+        return 1; // keep serving it from the pool, the per-command sandbox still holds
+    }
+    if (pid > 0) {
+        return 0;
+    }
+    releaseWorkerFds(server_fds);
+    if (lockSessionSandbox(username, login->data.login.uid, login->data.login.gid,
+                           login->data.login.home) < 0) {
+        // the server finds the channel closed and falls back to the pool
+        _exit(1);
+    }
+    handleCommands(helper, server_fds);
+    _exit(0);
 }
 
 
@@ -302,11 +592,12 @@ int CreateSystemUser(
     if (!pwd) {
         snprintf(msg, msgLen, "internal server error");
 
-        if (fork() == 0) {
+        // waitpid, the pool worker may have transfer children of its own to reap
+        if ((pid = fork()) == 0) {
             execlp("deluser", "deluser", "--remove-home", username, NULL);
             _exit(1);
         }
-        wait(NULL);
+        waitpid(pid, NULL, 0);
         releaseUserCreationLock(lock_fd);
         return -1;
     }
@@ -316,11 +607,11 @@ int CreateSystemUser(
         perror("mkdir");
         snprintf(msg, msgLen, "error creating home directory");
 
-        if (fork() == 0) {
+        if ((pid = fork()) == 0) {
             execlp("deluser", "deluser", "--remove-home", username, NULL);
             _exit(1);
         }
-        wait(NULL);
+        waitpid(pid, NULL, 0);
         releaseUserCreationLock(lock_fd);
         return -1;
     }
@@ -330,11 +621,11 @@ int CreateSystemUser(
         perror("chown");
         snprintf(msg, msgLen, "error setting home ownership");
 
-        if (fork() == 0) {
+        if ((pid = fork()) == 0) {
             execlp("deluser", "deluser", "--remove-home", username, NULL);
             _exit(1);
         }
-        wait(NULL);
+        waitpid(pid, NULL, 0);
         releaseUserCreationLock(lock_fd);
         return -1;
     }
@@ -355,7 +646,10 @@ void handleHelperLs(int server_fd, helper_request_header *hdr, char* path, const
     }
 
     // returns pointer to dir, to its first entry
-    dir = opendir(path); 
+    int dir_fd = sandboxOpen(&hdr->session, path, O_RDONLY | O_DIRECTORY, 0);
+    if (dir_fd >= 0 && !(dir = fdopendir(dir_fd))) {
+        close(dir_fd);
+    }
     if (!dir) {
         res-> status = -1;
         snprintf(res->msg, sizeof(res->msg),
@@ -373,7 +667,7 @@ void handleHelperLs(int server_fd, helper_request_header *hdr, char* path, const
         snprintf(full, sizeof(full), "%s/%s", path, entry->d_name);
 
         struct stat st;
-        if (stat(full, &st) != 0) {
+        if (sandboxStat(&hdr->session, full, &st) != 0) {
             perror("stat");
             continue;
         }
@@ -432,17 +726,12 @@ void ChangeDirectory(int server_fd, helper_request_header *hdr, char* path, help
     }
     char newcwd[ABS_PATH];
 
-    if (chdir(path) == -1) {
+    if (sandboxChdir(&hdr->session, path, newcwd, sizeof(newcwd)) == -1) {
         snprintf(res->msg, sizeof(res->msg),
                  "cd failed: %s", strerror(errno));
         goto out;
 
     }
-    if (getcwd(newcwd, sizeof(newcwd)) == NULL) {
-        strncpy(res->msg, "Failed to resolve directory",
-                sizeof(res->msg) - 1);
-        goto out;
-    }
     res->status = 0;
     snprintf(res->msg, sizeof(res->msg), "Directory changed");
     snprintf(res->data.cd.cwd, sizeof(res->data.cd.cwd), "%s", newcwd);
@@ -484,37 +773,32 @@ void HandlerHelperCreateFile(int server_fd, helper_request_header *hdr, const ch
         _exit(1);
     }
     if (makeDir) {
-        if (mkdir(filename, privileges) != 0) {
+        char name[PATH_MAX];
+        int parent = sandboxParent(&hdr->session, filename, name, sizeof(name));
+        if (parent == -1 || mkdirat(parent, name, privileges) != 0) {
             snprintf(res->msg, sizeof(res->msg), "mkdir failed: %s", strerror(errno));
             res->status = -1;
         } else {
             snprintf(res->msg, sizeof(res->msg), "Directory created successfully");
             res->status = 0;
         }
+        if (parent >= 0) close(parent);
         writeAll(server_fd, res, sizeof(*res));
         if (regainRoot() == -1) _exit(1);
         return;
     }
-    int dirfd = open(".", O_RDONLY | O_DIRECTORY);
-    if (dirfd < 0) {
-        strncpy(res->msg, "Dir open error", sizeof(res->msg)-1);
-        goto out;
-    }
-    fd = openat(dirfd, filename,
-                O_CREAT | O_WRONLY | O_TRUNC | O_NOFOLLOW,
-                privileges);
+    fd = sandboxOpen(&hdr->session, filename,
+                     O_CREAT | O_WRONLY | O_TRUNC | O_NOFOLLOW,
+                     privileges);
 
-    close(dirfd);
-    
     if (fd < 0) {
         perror("openat");
         strncpy(res->msg, "Create failed", sizeof(res->msg)-1);
         goto out;
     }
-    lockFd = lock_file(filename, LOCK_EXCLUSIVE);
+    lockFd = sandboxLockFile(&hdr->session, filename, LOCK_EXCLUSIVE);
     if (lockFd < 0) {
         snprintf(res->msg, sizeof(res->msg), "Cannot lock file for creation");
-        close(dirfd);
         goto out;
     }
     
@@ -541,12 +825,12 @@ void HandleHelperChmod(int server_fd, helper_request_header *hdr, const char* fi
         writeAll(server_fd, res, sizeof(helper_response));
         _exit(1);
     }
-    lockFd = lock_file(filename, LOCK_EXCLUSIVE);
+    lockFd = sandboxLockFile(&hdr->session, filename, LOCK_EXCLUSIVE);
     if (lockFd < 0) {
         snprintf(res->msg, sizeof(res->msg), "Cannot lock file for chmod");
         goto out;
     }
-    if (chmod(filename, privileges) != 0) {
+    if (fchmod(lockFd, privileges) != 0) {
         snprintf(res->msg, sizeof(res->msg), "chmod failed: %s", strerror(errno));
         goto out;
     }
@@ -564,6 +848,8 @@ out:
 
 void HandleHelperDelete(int server_fd, helper_request_header *hdr, const char* path, helper_response *res) {
     int lockFd = -1;
+    int parent = -1;
+    char name[PATH_MAX];
     struct stat st;
 
     if (sandboxUserToHisHome(&hdr->session) == -1) {
@@ -571,7 +857,12 @@ void HandleHelperDelete(int server_fd, helper_request_header *hdr, const char* p
         writeAll(server_fd, res, sizeof(helper_response));
         _exit(1);
     }
-    if (stat(path, &st) != 0) {
+    if (sandboxStat(&hdr->session, path, &st) != 0) {
+        snprintf(res->msg, sizeof(res->msg), "Delete failed: %s", strerror(errno));
+        goto out;
+    }
+    parent = sandboxParent(&hdr->session, path, name, sizeof(name));
+    if (parent == -1) {
         snprintf(res->msg, sizeof(res->msg), "Delete failed: %s", strerror(errno));
         goto out;
     }
@@ -579,19 +870,19 @@ void HandleHelperDelete(int server_fd, helper_request_header *hdr, const char* p
     int ret = -1;
     if (S_ISDIR(st.st_mode)) {
         // only works if the directory is EMPTY
-        ret = rmdir(path); 
+        ret = unlinkat(parent, name, AT_REMOVEDIR); 
         if (ret != 0) {
             snprintf(res->msg, sizeof(res->msg), "Delete directory failed: %s", strerror(errno));
             goto out;
         }
     } else {
-        lockFd = lock_file(path, LOCK_EXCLUSIVE);
+        lockFd = sandboxLockFile(&hdr->session, path, LOCK_EXCLUSIVE);
         if (lockFd < 0) {
             snprintf(res->msg, sizeof(res->msg), "Cannot lock file for delete");
             goto out;
         }
 
-        ret = unlink(path);
+        ret = unlinkat(parent, name, 0);
         if (ret != 0) {
             snprintf(res->msg, sizeof(res->msg), "Delete file failed: %s", strerror(errno));
             goto out;
@@ -608,6 +899,9 @@ out:
     if (lockFd >= 0) {
         unlock_file(lockFd);
     }
+    if (parent >= 0) {
+        close(parent);
+    }
     if (regainRoot() == -1) {
         _exit(1);   
     }
@@ -615,22 +909,24 @@ out:
 }
 void HandleHelperMove(int server_fd, helper_request_header *hdr, const char* path1, const char* path2, helper_response *res) {
     int lockFd = -1;
+    int srcParent = -1, dstParent = -1;
+    char srcName[PATH_MAX], dstName[PATH_MAX];
     if (sandboxUserToHisHome(&hdr->session) == -1) {
         snprintf(res->msg, sizeof(res->msg), "Sandbox error");
         writeAll(server_fd, res, sizeof(*res));
         _exit(1);
     }
-    lockFd = lock_file(path1, LOCK_EXCLUSIVE);
+    lockFd = sandboxLockFile(&hdr->session, path1, LOCK_EXCLUSIVE);
     if (lockFd < 0) {
         snprintf(res->msg, sizeof(res->msg), "Cannot lock source file for move");
         goto out;
     }
     struct stat stSrc, stDest;
-    if (stat(path1, &stSrc) != 0) {
+    if (sandboxStat(&hdr->session, path1, &stSrc) != 0) {
         snprintf(res->msg, sizeof(res->msg), "Move failed: source does not exist: %s", strerror(errno));
         goto out;
     }
-    if (stat(path2, &stDest) != 0 || !S_ISDIR(stDest.st_mode)) {
+    if (sandboxStat(&hdr->session, path2, &stDest) != 0 || !S_ISDIR(stDest.st_mode)) {
         snprintf(res->msg, sizeof(res->msg), "Move failed: destination is not a directory or doesn't exists");
         goto out;
     }
@@ -647,11 +943,13 @@ void HandleHelperMove(int server_fd, helper_request_header *hdr, const char* pat
     snprintf(dstPath, sizeof(dstPath), "%s/%s", path2, baseName);
     
     struct stat stCheck;
-    if (stat(dstPath, &stCheck) == 0) {
+    if (sandboxStat(&hdr->session, dstPath, &stCheck) == 0) {
         snprintf(res->msg, sizeof(res->msg), "Move failed: destination file already exists");
         goto out;
     }
-    if (rename(path1, dstPath) != 0) {
+    srcParent = sandboxParent(&hdr->session, path1, srcName, sizeof(srcName));
+    dstParent = sandboxParent(&hdr->session, dstPath, dstName, sizeof(dstName));
+    if (srcParent == -1 || dstParent == -1 || renameat(srcParent, srcName, dstParent, dstName) != 0) {
         snprintf(res->msg, sizeof(res->msg), "Move failed: %s", strerror(errno));
         goto out;
     }
@@ -661,28 +959,38 @@ void HandleHelperMove(int server_fd, helper_request_header *hdr, const char* pat
 
 out:
     if (lockFd >= 0) unlock_file(lockFd);
+    if (srcParent >= 0) close(srcParent);
+    if (dstParent >= 0) close(dstParent);
     if (regainRoot() == -1) _exit(1);
     writeAll(server_fd, res, sizeof(*res));
 }
 
-void HandleHelperRead(int server_fd, helper_request_header *hdr, const char* path, int offset, helper_response *res) {
-    int lockFd = -1;
+// read streams far more than one reply holds: like a download the file is only opened and locked
+// here, the handler reads it through the fd passed with the response. payload_len is the file size
+void HandleHelperRead(int server_fd, helper_request_header *hdr, const char* path, off_t offset, helper_response *res) {
+    int fd = -1;
     struct stat st;
 
-    printf("path:%s & offset:%d\n", path, offset);
+    printf("path:%s & offset:%lld\n", path, (long long)offset);
     if (sandboxUserToHisHome(&hdr->session) == -1) {
         snprintf(res->msg, sizeof(res->msg), "Sandbox error");
         writeAll(server_fd, res, sizeof(*res));
         _exit(1);
     }
-   
-    lockFd = lock_file(path, LOCK_SHARED);   
-    if (lockFd < 0) {
+
+    fd = sandboxOpen(&hdr->session, path, O_RDONLY, 0);
+    if (fd < 0) {
+        snprintf(res->msg, sizeof(res->msg), "Open failed: %s", strerror(errno));
+        goto out;
+    }
+    // an OFD lock, it stays with the handler's copy of the fd for as long as the stream runs.
+    // Waiting for it would hold up every channel of this worker, the handler retries instead
+    if (trylock_ofd(fd, LOCK_SHARED) < 0) {
+        if (errno == EAGAIN) res->status = HELPER_LOCKED;
         snprintf(res->msg, sizeof(res->msg), "Lock failed: %s", strerror(errno));
         goto out;
     }
-    // check if it's a regular file and that offset is not going past EOF
-    if (fstat(lockFd, &st) < 0) {
+    if (fstat(fd, &st) < 0) {
         snprintf(res->msg, sizeof(res->msg), "Stat failed: %s", strerror(errno));
         goto out;
     }
@@ -690,54 +998,34 @@ void HandleHelperRead(int server_fd, helper_request_header *hdr, const char* pat
         snprintf(res->msg, sizeof(res->msg), "Not a regular file");
         goto out;
     }
-    if ((off_t)offset > st.st_size) {
+    if (offset > st.st_size) {
         snprintf(res->msg, sizeof(res->msg), "Offset beyond EOF");
         goto out;
     }
-    // on error the value (off_t)-1 is returned otw returns the set offset
-    if (lseek(lockFd, offset, SEEK_SET) == (off_t)-1) {
-        snprintf(res->msg, sizeof(res->msg), "Seek failed");
-        goto out;
-    }
-
-    char buf[4096];
-    ssize_t n;
-
-    n = read(lockFd, buf, sizeof(buf));
-    if (n < 0) {
-        fprintf(stderr, "[HelperRead] read error: %s\n", strerror(errno));
-        snprintf(res->msg, sizeof(res->msg), "Internal error reading file");
-        goto out;
-    }
 
     res->status = 0;
-    res->payload_len = (uint32_t)n; 
+    res->payload_len = (uint64_t)st.st_size;
     snprintf(res->msg, sizeof(res->msg), "Success");
 
 out:
-    
-    if (lockFd >= 0) unlock_file(lockFd);
-
     if (regainRoot() == -1)
         _exit(1);
-    
-        // header
+
     if (writeAll(server_fd, res, sizeof(helper_response)) < 0) {
         perror("[Helper] Failed to send response header");
+    } else if (res->status == 0) {
+        sendFd(server_fd, fd);
     }
-    if (res->status == 0 && res->payload_len > 0) { 
-        if (writeAll(server_fd, buf, res->payload_len) < 0) {
-            perror("[Helper] Failed to send file payload");
-        }
-    }
+    if (fd >= 0) close(fd);
 }
     
-void HandleHelperWrite(int server_fd, helper_request_header *hdr, const char* path, int offset, void *data,
-                       uint32_t data_len, helper_response *res) {                        
-
+// the content of a write streams in after the command, so as for read the helper only opens, locks
+// and pads the file, the handler pwrites the chunks itself through the fd passed with the response
+void HandleHelperWrite(int server_fd, helper_request_header *hdr, const char* path, off_t offset, helper_response *res) {
+    int fd = -1;
     struct stat st;
 
-    printf("path:%s, offset:%d\n", path, offset);
+    printf("path:%s, offset:%lld\n", path, (long long)offset);
     
     if (sandboxUserToHisHome(&hdr->session) == -1) {
         snprintf(res->msg, sizeof(res->msg), "Sandbox error");
@@ -745,13 +1033,15 @@ void HandleHelperWrite(int server_fd, helper_request_header *hdr, const char* pa
         _exit(1);
     }
    
-    int fd = open(path, O_RDWR | O_CREAT, 0700);
+    fd = sandboxOpen(&hdr->session, path, O_RDWR | O_CREAT, 0700);
     if (fd < 0) {
         snprintf(res->msg, sizeof(res->msg), "Open failed: %s", strerror(errno));
         goto out;
     }
-    if (lock_fd(fd, LOCK_EXCLUSIVE) < 0) {
-        close(fd);
+    // an OFD lock, held by the handler's copy of the fd until the last chunk is written. Not
+    // waited for either (see HandleHelperRead)
+    if (trylock_ofd(fd, LOCK_EXCLUSIVE) < 0) {
+        if (errno == EAGAIN) res->status = HELPER_LOCKED;
         snprintf(res->msg, sizeof(res->msg), "Error locking fd: %s", strerror(errno));
         goto out; 
     }
@@ -770,54 +1060,37 @@ void HandleHelperWrite(int server_fd, helper_request_header *hdr, const char* pa
     //created by lskeeing after EOF
     if (offset > st.st_size) { 
         if (lseek(fd, 0, SEEK_END) == (off_t)-1) goto out;
-        char space = ' ';
-        for (int i = st.st_size; i < offset; i++) {
-            if (write(fd, &space, 1) < 0) {
+        char spaces[4096];
+        memset(spaces, ' ', sizeof(spaces));
+        for (off_t pad = offset - st.st_size; pad > 0; ) {
+            size_t chunk = pad < (off_t)sizeof(spaces) ? (size_t)pad : sizeof(spaces);
+            if (writeAll(fd, spaces, chunk) < 0) {
                 snprintf(res->msg, sizeof(res->msg), "Padding failed");
                 goto out;
             }
-        }
-
-    } else {
-        if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
-            snprintf(res->msg, sizeof(res->msg), "Seek failed: %s", strerror(errno));
-            goto out;
+            pad -= chunk;
         }
     }
 
-    
-
-    ssize_t n = write(fd, data, data_len);
-    if (n < 0) {
-        snprintf(res->msg, sizeof(res->msg), "Write failed: %s", strerror(errno));
-        goto out;
-    }
-
-    if ((uint32_t)n != data_len) {
-        snprintf(res->msg, sizeof(res->msg), "Partial write: wrote %ld of %u bytes", n, data_len);
-        goto out;
-    }
-
     res->status = 0;
     res->payload_len = 0;
     snprintf(res->msg, sizeof(res->msg), "Success");
 
 out:
-    if (fd >= 0) {
-        close(fd); // should also release the lock associated with it 
-    }
-    
-
     if (regainRoot() == -1)
         _exit(1);
     
     if (writeAll(server_fd, res, sizeof(helper_response)) < 0) {
         perror("[Helper] Failed to send response header");
+    } else if (res->status == 0) {
+        sendFd(server_fd, fd);
     }
-
+    if (fd >= 0) close(fd);
 }
 
 
+// the helper only opens and locks the file as the user, the handler moves the bytes itself
+// with sendfile()/splice() on the fd passed along with the response
 void HandleHelperDownload(int server_fd, helper_request_header *hdr, const char* path, helper_response *res) {
     fprintf(stderr, "[Helper] Starting download for path: %s\n", path);
     int fd = -1;
@@ -827,13 +1100,13 @@ void HandleHelperDownload(int server_fd, helper_request_header *hdr, const char*
         writeAll(server_fd, res, sizeof(*res));
         return;
     }
-    fd = open(path, O_RDONLY);
+    fd = sandboxOpen(&hdr->session, path, O_RDONLY, 0);
     if (fd < 0) {
         snprintf(res->msg, sizeof(res->msg), "Open failed: %s", strerror(errno));
-        writeAll(server_fd, res, sizeof(helper_response));
-        return;
+        goto out;
     }
-    if (lock_fd(fd, LOCK_SHARED) < 0) {
+    // an OFD lock stays on the file with the handler's copy of the fd
+    if (lock_ofd(fd, LOCK_SHARED) < 0) {
         snprintf(res->msg, sizeof(res->msg), "Lock failed");
         goto out;
     }
@@ -843,29 +1116,17 @@ void HandleHelperDownload(int server_fd, helper_request_header *hdr, const char*
         goto out;
     }
     res->status = 0;
-    res->payload_len = (uint32_t)st.st_size;
+    res->payload_len = (uint64_t)st.st_size;
     snprintf(res->msg, sizeof(res->msg), "Success");
 
-    /*
-    fprintf(stderr, "[Helper] Waiting 10 seconds before sending response (for testing)...\n");
-    sleep(5);
-    fprintf(stderr, "[Helper] Delay complete, sending response now\n");
-    */
-    if (writeAll(server_fd, res, sizeof(helper_response)) < 0) {
-        goto out;
-    }
-    fprintf(stderr, "[Helper] Beginning stream to server_fd...\n");
-    char stream_buf[16384];
-    ssize_t n;
-    while ((n = read(fd, stream_buf, sizeof(stream_buf))) > 0) {
-        if (writeAll(server_fd, stream_buf, n) < 0) break;
+    if (writeAll(server_fd, res, sizeof(helper_response)) >= 0) {
+        sendFd(server_fd, fd);
     }
 out: 
     if (res->status != 0) {
         writeAll(server_fd, res, sizeof(helper_response));
     }
     if (fd >= 0) {
-        unlock_fd(fd);
         close(fd);
     }
     if (regainRoot() == -1) {
@@ -873,45 +1134,61 @@ out:
     }
 }
 
-void HandleHelperUpload(int server_fd, helper_request_header *hdr, const char* path, helper_response *res) {
+// a multipart upload (-p N) writes "<path>.part" and only UPLOAD_COMMIT renames it over path
+void HandleHelperUpload(int server_fd, helper_request_header *hdr, const char* path, int resume, int part, helper_response *res) {
 
     fprintf(stderr, "[Helper] Starting upload to path: %s\n", path);
     int fd = -1;
+    char part_path[PATH_MAX];
+    if (part) {
+        if ((size_t)snprintf(part_path, sizeof(part_path), "%s.part", path) >= sizeof(part_path)) {
+            snprintf(res->msg, sizeof(res->msg), "Path too long");
+            writeAll(server_fd, res, sizeof(*res));
+            return;
+        }
+        path = part_path;
+    }
     if (sandboxUserToHisHome(&hdr->session) == -1) {
         snprintf(res->msg, sizeof(res->msg), "Sandbox error");
         writeAll(server_fd, res, sizeof(*res));
         return;
     }
-    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-    if (fd < 0) {
-        snprintf(res->msg, sizeof(res->msg), "Open/Create failed: %s", strerror(errno));
-        goto out;
-        return;
+    for (;;) {
+        // readable too: the handler checksums what is already there for a resume and what arrived
+        // once the upload is through. A resumed one is truncated once it knows where to go on
+        fd = sandboxOpen(&hdr->session, path, O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            snprintf(res->msg, sizeof(res->msg), "Open/Create failed: %s", strerror(errno));
+            goto out;
+        }
+        if (lock_ofd(fd, LOCK_EXCLUSIVE) < 0) {
+            snprintf(res->msg, sizeof(res->msg), "Lock failed");
+            goto out;
+        }
+        // the part file we waited for may have been committed meanwhile, that one is someone's upload
+        struct stat locked, now;
+        if (!part || (fstat(fd, &locked) == 0 && sandboxStat(&hdr->session, path, &now) == 0 &&
+                      locked.st_ino == now.st_ino && locked.st_dev == now.st_dev)) {
+            break;
+        }
+        close(fd);
     }
-    if (lock_fd(fd, LOCK_EXCLUSIVE) < 0) {
-        snprintf(res->msg, sizeof(res->msg), "Lock failed");;
+    // truncating only once locked, a download still reading the file keeps its bytes
+    if (!resume && ftruncate(fd, 0) < 0) {
+        snprintf(res->msg, sizeof(res->msg), "Truncate failed: %s", strerror(errno));
         goto out;
     }
     res->status = 0;
     res->payload_len = 0; 
     snprintf(res->msg, sizeof(res->msg), "Success");
-    if (writeAll(server_fd, res, sizeof(helper_response)) < 0) {
-        goto out;
-    }
-    char stream_buf[16384];
-    ssize_t n;
-    while ((n = read(server_fd, stream_buf, sizeof(stream_buf))) > 0) {
-        if (writeAll(fd, stream_buf, n) < 0) {
-            fprintf(stderr, "[Helper] Disk write error\n");
-            break;
-        }
+    if (writeAll(server_fd, res, sizeof(helper_response)) >= 0) {
+        sendFd(server_fd, fd);
     }
 out: 
     if (res->status != 0) {
         writeAll(server_fd, res, sizeof(helper_response));
     }
     if (fd >= 0) {
-        unlock_fd(fd);
         close(fd);
     }
     
@@ -920,17 +1197,57 @@ out:
     }
 }
 
+// every part is in and checked, "<path>.part" takes the place of path in one rename. An upload
+// or download still on the old file finishes first. An accepted transfer commits its copy here too
+void HandleHelperUploadCommit(int server_fd, helper_request_header *hdr, const char* path, helper_response *res) {
+    int lockFd = -1;
+    int parent = -1;
+    char name[PATH_MAX], part_name[PATH_MAX];
+    if (sandboxUserToHisHome(&hdr->session) == -1) {
+        snprintf(res->msg, sizeof(res->msg), "Sandbox error");
+        writeAll(server_fd, res, sizeof(*res));
+        return;
+    }
+    struct stat st;
+    if (sandboxStat(&hdr->session, path, &st) == 0) {
+        lockFd = sandboxLockFile(&hdr->session, path, LOCK_EXCLUSIVE);
+        if (lockFd < 0) {
+            snprintf(res->msg, sizeof(res->msg), "Cannot lock the file to replace");
+            goto out;
+        }
+    }
+    parent = sandboxParent(&hdr->session, path, name, sizeof(name));
+    if (parent == -1 || (size_t)snprintf(part_name, sizeof(part_name), "%s.part", name) >= sizeof(part_name) ||
+        renameat(parent, part_name, parent, name) != 0) {
+        snprintf(res->msg, sizeof(res->msg), "Commit failed: %s", strerror(errno));
+        goto out;
+    }
+    res->status = 0;
+    snprintf(res->msg, sizeof(res->msg), "Committed");
+
+out:
+    if (lockFd >= 0) unlock_file(lockFd);
+    if (parent >= 0) close(parent);
+    if (regainRoot() == -1) _exit(1);
+    writeAll(server_fd, res, sizeof(*res));
+}
+
 
 
+// accepted transfer: opens the sender's file and creates the receiver's copy as root, then hands
+// both fds over. The handler copies in the background, a long copy would hold a pool worker
 void HandleHelperTransfer(int server_fd, helper_request_header *hdr, const char* root, const char* sender, const char* filename, const char* recv, const char* targetPath, helper_response* res) {
     char src_full_path[512];
     char dest_full_path[512];
 
     int src_fd = -1;
     int dest_fd = -1;
+    int part_locked = 0; // only a part we hold is ours to remove
+    struct stat st;
 
     snprintf(src_full_path, sizeof(src_full_path), "%s/%s/%s", root, sender, filename);
-    snprintf(dest_full_path, sizeof(dest_full_path), "%s/%s/%s/%s", root, recv, targetPath, filename);
+    // the copy goes to "<file>.part", the handler has it committed over the file once complete
+    snprintf(dest_full_path, sizeof(dest_full_path), "%s/%s/%s/%s.part", root, recv, targetPath, filename);
 
     // cant chroot so locate substring .. for path traversal
     if (strstr(targetPath, "..") || strstr(filename, "..")) {
@@ -942,43 +1259,57 @@ void HandleHelperTransfer(int server_fd, helper_request_header *hdr, const char*
         snprintf(res->msg, sizeof(res->msg), "Source file not found");
         goto out;
     }
-    if (lock_fd(src_fd, LOCK_SHARED) < 0) {
+    // OFD locks, they go along with the fds and last until the copy is over
+    if (lock_ofd(src_fd, LOCK_SHARED) < 0 || fstat(src_fd, &st) < 0) {
         snprintf(res->msg, sizeof(res->msg), "Could not lock source file");
         goto out;
     }
-    dest_fd = open(dest_full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (dest_fd < 0) {
-        snprintf(res->msg, sizeof(res->msg), "Destination path invalid or permission denied");
-        goto out;
-    }
     struct passwd *pw = getpwnam(recv);
-    if (pw != NULL) {
-        if (fchown(dest_fd, pw->pw_uid, pw->pw_gid) != 0) {
-            // Log error but attempt to continue
-            fprintf(stderr, "[Helper] Warning: Failed to change owner to %s: %s\n", recv, strerror(errno));
-        }
-    } else {
+    if (pw == NULL) {
         res->status = -1;
         snprintf(res->msg, sizeof(res->msg), "Recipient user '%s' does not exist on system", recv);
         goto out;
     }
-    if (lock_fd(dest_fd, LOCK_EXCLUSIVE) < 0) {
-        snprintf(res->msg, sizeof(res->msg), "Could not lock destination file");
-        goto out;
-    }
-    char buf[8192];
-    ssize_t n_read;
-    while ((n_read = read(src_fd, buf, sizeof(buf))) > 0) {
-        if (write(dest_fd, buf, n_read) != n_read) {
-            snprintf(res->msg, sizeof(res->msg), "Write error during transfer");
+    for (;;) {
+        dest_fd = open(dest_full_path, O_WRONLY | O_CREAT, 0644);
+        if (dest_fd < 0) {
+            snprintf(res->msg, sizeof(res->msg), "Destination path invalid or permission denied");
+            goto out;
+        }
+        if (lock_ofd(dest_fd, LOCK_EXCLUSIVE) < 0) {
+            snprintf(res->msg, sizeof(res->msg), "Could not lock destination file");
             goto out;
         }
+        // the part we waited for may have been committed meanwhile, that one is the receiver's file
+        struct stat locked, now;
+        if (fstat(dest_fd, &locked) == 0 && stat(dest_full_path, &now) == 0 &&
+            locked.st_ino == now.st_ino && locked.st_dev == now.st_dev) {
+            break;
+        }
+        close(dest_fd);
+        dest_fd = -1;
+    }
+    part_locked = 1;
+    // truncated once locked, a copy of the same file already running keeps its part
+    if (ftruncate(dest_fd, 0) < 0) {
+        snprintf(res->msg, sizeof(res->msg), "Could not truncate destination file");
+        goto out;
+    }
+    if (fchown(dest_fd, pw->pw_uid, pw->pw_gid) != 0) {
+        // Log error but attempt to continue
+        fprintf(stderr, "[Helper] Warning: Failed to change owner to %s: %s\n", recv, strerror(errno));
     }
     res->status = 0;
-    snprintf(res->msg, sizeof(res->msg), "Transfer successful");
+    res->payload_len = (uint64_t)st.st_size;
+    snprintf(res->msg, sizeof(res->msg), "Transfer ready");
 out: 
+    if (writeAll(server_fd, res, sizeof(helper_response)) < 0) {
+        perror("[Helper] Failed to send response header");
+    } else if (res->status == 0) {
+        sendFd(server_fd, src_fd);
+        sendFd(server_fd, dest_fd);
+    }
+    if (part_locked && res->status != 0) unlink(dest_full_path);
     if (src_fd >= 0) close(src_fd);
     if (dest_fd >= 0) close(dest_fd);
-
-    writeAll(server_fd, res, sizeof(helper_response));
 }
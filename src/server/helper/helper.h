@@ -6,18 +6,29 @@
 #include <semaphore.h>
 
 
+#define DEFAULT_HELPER_MIN_WORKERS 2
+#define DEFAULT_HELPER_MAX_WORKERS 16
+
 typedef struct {
     // define the pipe 
     int socket_fds;
     char rootDir[64];
+    int min_workers;    // pre-forked workers kept alive even when idle
+    int max_workers;    // ceiling the pool may grow to under load
+    int session_workers; // LOGIN moves the channel to a worker sandboxed for the whole session
+    int sandbox_mode;   // SandboxMode, how handlers confine client paths to the user's home
+    int takeover;       // the registry already holds the pool of the helper being replaced
 } Helper;
 
 Helper* CreateHelper(int socket_fd, char* rootDir);
+int handleHelperRequest(Helper* helper, int server_fds);
 void handleCommands(Helper* helper, int server_fds);
 void runHelperLoop(Helper* helper);
+void printHelperPool();
 
 int CreateSystemUser( const char* rootDir,const char* username, mode_t privileges, char msg[], size_t msgLen);
 void initSharedRegistry();
+int attachSharedRegistry();
 void SharedMemCleanup();
 void handleHelperLogin(int server_fd, char* username, helper_response* res);
 
@@ -43,9 +54,10 @@ void HandleHelperChmod(int server_fd, helper_request_header *hdr, const char* fi
 
 void HandleHelperDelete(int server_fd, helper_request_header *hdr, const char* path, helper_response *res);
 void HandleHelperMove(int server_fd, helper_request_header *hdr, const char* path1, const char* path2, helper_response *res);
-void HandleHelperRead(int server_fd, helper_request_header *hdr, const char* path, int offset, helper_response *res);
-void HandleHelperWrite(int server_fd, helper_request_header *hdr, const char* path, int offset, void *data, uint32_t data_len, helper_response *res);
-void HandleHelperUpload(int server_fd, helper_request_header *hdr, const char* path, helper_response *res);
+void HandleHelperRead(int server_fd, helper_request_header *hdr, const char* path, off_t offset, helper_response *res);
+void HandleHelperWrite(int server_fd, helper_request_header *hdr, const char* path, off_t offset, helper_response *res);
+void HandleHelperUpload(int server_fd, helper_request_header *hdr, const char* path, int resume, int part, helper_response *res);
+void HandleHelperUploadCommit(int server_fd, helper_request_header *hdr, const char* path, helper_response *res);
 void HandleHelperDownload(int server_fd, helper_request_header *hdr, const char* path, helper_response *res);
 void HandleHelperTransfer(int server_fd, helper_request_header *hdr, const char* root, const char* sender, const char* filename, const char* recv, const char* targetPath, helper_response* res); 
 #endif
\ No newline at end of file
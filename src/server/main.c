@@ -1,6 +1,7 @@
 // takes arguments for server and starts it, listening on given ports
 #include <stdio.h>
 #include <stdlib.h>   // for atoi
+#include <string.h>
 #include <unistd.h> // fork
 #include <limits.h> 
 
@@ -10,33 +11,122 @@
 #include <fcntl.h>
 
 #include "core/server.h"
+#include "core/handoff.h"
 #include "helper/helper.h"
 #include "utils/utils.h"
+#include "utils/sandbox.h"
 #include "net/net.h"
 #include "common/utility.h"
 
 #define DEFAULT_IP "127.0.0.1"
 #define DEFAULT_PORT 8080
+#define MAX_WORKERS 64
 
 
 
 SharedRegistry* registry = NULL;
 
 
+static void printUsage(const char* prog) {
+    printf("Usage: %s <root_dir> [ip] [port] [--engine=fork|epoll] [--workers=N] [--helper-workers=MIN:MAX] [--session-helpers] [--sandbox=chroot|openat2]\n"
+           "       [--max-sessions=N] [--max-per-ip=N] [--max-transfers=N] [--max-user-transfers=N]\n"
+           "       [--data-timeout=SECONDS] [--takeover]\n", prog);
+}
+
+// value of an admission limit option, 0 meaning unlimited
+static int parseLimit(const char* opt) {
+    const char* eq = strchr(opt, '=');
+    int limit = atoi(eq + 1);
+    if (limit < 0 || limit > MAX_ADMITTED) {
+        fprintf(stderr, "%.*s must be between 0 (unlimited) and %d\n", (int)(eq - opt), opt, MAX_ADMITTED);
+        return -1;
+    }
+    return limit;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 2 || argv[1][0] == '\0'){
-        printf("Usage: %s <root_dir> [ip] [port]\n", argv[0]);
+    // --options may appear anywhere, everything else is positional
+    char* positional[3] = { NULL, NULL, NULL };
+    int npositional = 0;
+    int engine = -1;
+    int workers = 0;
+    int helper_min = DEFAULT_HELPER_MIN_WORKERS;
+    int helper_max = DEFAULT_HELPER_MAX_WORKERS;
+    int session_helpers = 0;
+    int sandbox_mode = SANDBOX_CHROOT;
+    int max_sessions = 0, max_per_ip = 0, max_transfers = 0, max_user_transfers = 0;
+    int data_timeout = DEFAULT_DATA_TIMEOUT;
+    int takeover = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--engine=", 9) == 0) {
+            if (strcmp(argv[i] + 9, "epoll") == 0) {
+                engine = ENGINE_EPOLL;
+            } else if (strcmp(argv[i] + 9, "fork") == 0) {
+                engine = ENGINE_FORK;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+            workers = atoi(argv[i] + 10);
+            if (workers < 1 || workers > MAX_WORKERS) {
+                fprintf(stderr, "--workers must be between 1 and %d\n", MAX_WORKERS);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--helper-workers=", 17) == 0) {
+            if (sscanf(argv[i] + 17, "%d:%d", &helper_min, &helper_max) != 2 ||
+                helper_min < 1 || helper_max < helper_min || helper_max > MAX_HELPER_WORKERS) {
+                fprintf(stderr, "--helper-workers must be MIN:MAX with 1 <= MIN <= MAX <= %d\n", MAX_HELPER_WORKERS);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--sandbox=", 10) == 0) {
+            if (strcmp(argv[i] + 10, "openat2") == 0) {
+                sandbox_mode = SANDBOX_OPENAT2;
+            } else if (strcmp(argv[i] + 10, "chroot") == 0) {
+                sandbox_mode = SANDBOX_CHROOT;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--max-sessions=", 15) == 0) {
+            if ((max_sessions = parseLimit(argv[i])) < 0) return 1;
+        } else if (strncmp(argv[i], "--max-per-ip=", 13) == 0) {
+            if ((max_per_ip = parseLimit(argv[i])) < 0) return 1;
+        } else if (strncmp(argv[i], "--max-transfers=", 16) == 0) {
+            if ((max_transfers = parseLimit(argv[i])) < 0) return 1;
+        } else if (strncmp(argv[i], "--max-user-transfers=", 21) == 0) {
+            if ((max_user_transfers = parseLimit(argv[i])) < 0) return 1;
+        } else if (strncmp(argv[i], "--data-timeout=", 15) == 0) {
+            data_timeout = atoi(argv[i] + 15);
+            if (data_timeout < 0) {
+                fprintf(stderr, "--data-timeout must be 0 (never) or more seconds\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--takeover") == 0) {
+            takeover = 1;
+        } else if (strcmp(argv[i], "--session-helpers") == 0) {
+            session_helpers = 1;
+        } else if (strncmp(argv[i], "--", 2) == 0 || npositional == 3) {
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            positional[npositional++] = argv[i];
+        }
+    }
+    if (npositional < 1 || positional[0][0] == '\0'){
+        printUsage(argv[0]);
         return 1;
     } 
-    char* root_dir = argv[1];
+    char* root_dir = positional[0];
     char* ip = DEFAULT_IP;
     int port = DEFAULT_PORT;
 
-    if (argc >= 3 && argv[2][0] != '\0') {
-        ip = argv[2];           
+    if (npositional >= 2 && positional[1][0] != '\0') {
+        ip = positional[1];           
     }
-    if (argc >= 4 && argv[3][0] != '\0') {
-        port = atoi(argv[3]);   
+    if (npositional >= 3 && positional[2][0] != '\0') {
+        port = atoi(positional[2]);   
     }
     struct passwd* pw = userLookUp();
     if (!pw) {
@@ -52,11 +142,42 @@ int main(int argc, char* argv[]) {
     } else {
         sharedGroupId = gr->gr_gid;
     }
-    Server* server = createServer(root_dir, port, ip);
+    Server* server;
+    int handoff_conn = -1;
+    if (takeover) {
+        // the running server's listeners, so not a single connection is refused meanwhile
+        HandoffInfo info;
+        int fds[HANDOFF_MAX_FDS];
+        handoff_conn = receiveHandoff(root_dir, &info, fds);
+        if (handoff_conn < 0) {
+            fprintf(stderr, "Takeover failed, is a server running on %s?\n", root_dir);
+            return 1;
+        }
+        if (workers != info.workers) {
+            printf("Note: keeping the listener layout of the running server (%d workers)\n", info.workers);
+        }
+        workers = info.workers;
+        server = adoptServer(root_dir, info.port, info.ip, info.workers, fds);
+    } else {
+        server = createServer(root_dir, port, ip);
+    }
     if (!server) {
         printf("Failed to create server\n");
         return 1;
     }
+    // workers exist to take the fork out of the accept path, so they default to the event loop
+    if (engine < 0) engine = workers > 0 ? ENGINE_EPOLL : ENGINE_FORK;
+    server->engine = engine;
+    server->max_sessions = max_sessions;
+    server->max_per_ip = max_per_ip;
+    server->max_transfers = max_transfers;
+    server->max_user_transfers = max_user_transfers;
+    server->data_timeout = data_timeout;
+    server->handoff_conn = handoff_conn;
+    if (workers > 0 && !takeover && openWorkerListeners(server, workers) < 0) {
+        printf("Failed to create worker listeners\n");
+        return 1;
+    }
 
     // create tmp dir
     char socket_dir[PATH_MAX];
@@ -79,12 +200,29 @@ int main(int argc, char* argv[]) {
     // creates unix socket for helper-server communication
     int listen_fd = createUnixSocket(server->Root, sharedGroupId);
     if (listen_fd < 0) { fprintf(stderr, "Failed to create helper socket\n"); return 1; }
-    
+    if (openHandoffListener(server) < 0) {
+        fprintf(stderr, "Failed to create handoff socket\n");
+        return 1;
+    }
 
-    SharedMemCleanup(); // for safety force clean up in case mem persisted
-    initSharedRegistry();
+    if (takeover) {
+        // sessions of the old server stay registered, it keeps serving them while it drains
+        if (attachSharedRegistry() < 0) return 1;
+    } else {
+        SharedMemCleanup(); // for safety force clean up in case mem persisted
+        initSharedRegistry();
+        // on a takeover these move in place only once this server serves, see confirmHandoff()
+        if (publishHelperSocket(server->Root) < 0 || publishHandoffSocket(server->Root) < 0) {
+            return 1;
+        }
+    }
 
     Helper* helper = CreateHelper(listen_fd, root_dir);   
+    helper->min_workers = helper_min;
+    helper->max_workers = helper_max;
+    helper->session_workers = session_helpers;
+    helper->sandbox_mode = sandbox_mode;
+    helper->takeover = takeover;
     
 
     // fork the helper 
@@ -94,7 +232,7 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     else if (helperPid == 0) {
-        close(server->sfd);
+        closeServerListeners(server);
         if (setgid(sharedGroupId) != 0) {
             perror("setgid");
             _exit(1);
@@ -106,6 +244,7 @@ int main(int argc, char* argv[]) {
         _exit(0);
     }
     close(listen_fd);
+    server->helper_pid = helperPid;
     
     setup_sigchld(); // sets up SIGCHLD handler 
        
@@ -1,6 +1,7 @@
 
 
 #include <stdio.h>        // perror, snprintf
+#include <errno.h>
 #include <string.h>       // memset, strncpy, strlen
 #include <unistd.h>       // close, unlink, chown
 #include <fcntl.h>        // fcntl, F_SETLKW 
@@ -8,17 +9,20 @@
 #include <sys/socket.h>   
 #include <sys/un.h>       
 #include <sys/stat.h>
+#include <poll.h>
 
 #include "net/net.h"
 
 #define HELPER_SOCK_REL "/tmp/helper.sock"
 
+// binds next to the real path, publishHelperSocket() then moves it in place. A server taking
+// over only does so once it serves, until then connections keep reaching the old helper
 int createUnixSocket(const char* root_dir, gid_t groupId) {
     int sockfd;
     struct sockaddr_un addr;
 
-    char socket_path[60];
-    snprintf(socket_path, sizeof(socket_path), "%s/%s", root_dir, HELPER_SOCK_REL);
+    char socket_path[sizeof(addr.sun_path)];
+    snprintf(socket_path, sizeof(socket_path), "%s/%s.new", root_dir, HELPER_SOCK_REL);
 
     sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (sockfd < 0) {
@@ -30,7 +34,7 @@ int createUnixSocket(const char* root_dir, gid_t groupId) {
     addr.sun_family = AF_UNIX;
     strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
 
-    unlink(addr.sun_path); // remove old socket if exists
+    unlink(addr.sun_path); // leftover of a takeover that never completed
     if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("bind");
         close(sockfd);
@@ -47,7 +51,7 @@ int createUnixSocket(const char* root_dir, gid_t groupId) {
         close(sockfd);
         return -1;
     }
-    if (listen(sockfd, 5) < 0) {
+    if (listen(sockfd, SOMAXCONN) < 0) {
         perror("listen");
         close(sockfd);
         return -1;
@@ -56,6 +60,18 @@ int createUnixSocket(const char* root_dir, gid_t groupId) {
     return sockfd;
 }
 
+int publishHelperSocket(const char* root_dir) {
+    char from[PATH_MAX], to[PATH_MAX];
+    snprintf(from, sizeof(from), "%s/%s.new", root_dir, HELPER_SOCK_REL);
+    snprintf(to, sizeof(to), "%s/%s", root_dir, HELPER_SOCK_REL);
+    // rename replaces the old path atomically, connectToHelper() never sees it missing
+    if (rename(from, to) < 0) {
+        perror("publish helper socket");
+        return -1;
+    }
+    return 0;
+}
+
 int connectToHelper() {
     int fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (fd < 0) {
@@ -78,40 +94,59 @@ int connectToHelper() {
 }
 
 int sendProtocolMsgLocked(int fd, msg_type type, uint32_t status, const char* msg, int is_bg) {
-    int ret = -1;
-    if (acquire_socket_lock(fd) == 0) {
-        ret = sendProtocolMsgBg(fd, type, status, msg, is_bg);
-        release_socket_lock(fd);
-    }
-    return ret;
+    return sendProtocolMsgBg(fd, type, status, msg, is_bg); // every frame is sent locked now
 }
 int sendProtocolMsgBg(int fd, msg_type type, uint32_t status, const char* msg, int is_bg) {
     msg_header resp;
+    memset(&resp, 0, sizeof(resp));
     resp.type = type;
     resp.status = status;
     resp.is_background = (uint8_t)is_bg;
-    resp.payloadLength = (uint32_t)strlen(msg) + 1; 
+    resp.payloadLength = strlen(msg) + 1; 
 
-    if (writeAll(fd, &resp, sizeof(resp)) < 0) return -1;
-    return writeAll(fd, msg, resp.payloadLength);
+    return sendProtocolFrame(fd, &resp, msg);
 }
 
-int sendHelperRequestRW(int helper_fd,
-                        helper_commands cmd,
-                        int argc,
-                        char *argv[],
-                        int offset,
-                        ClientSession *session,
-                        void *data,
-                        uint32_t data_len,
-                        helper_response *out)
+// request being served, children forked for it keep the value so their late replies carry it too
+uint32_t current_req_id = 0;
+
+// clients pipeline commands now, so a forked transfer child may reply while the handler
+// answers the next command. A whole frame goes out under the socket lock
+int sendProtocolFrame(int fd, msg_header* hdr, const void* payload) {
+    hdr->req_id = current_req_id;
+    stampHeader(hdr);
+    if (acquire_socket_lock(fd) < 0) return -1;
+    int ret = -1;
+    if (writeAll(fd, hdr, sizeof(*hdr)) >= 0 &&
+        (hdr->payloadLength == 0 || writeAll(fd, payload, hdr->payloadLength) >= 0)) {
+        ret = 0;
+    }
+    release_socket_lock(fd);
+    return ret;
+}
+
+// the helper serves a connection in order, so ids only have to be unique per process
+static uint32_t next_req_id = 0;
+
+uint32_t submitHelperRequest(int helper_fd,
+                             helper_commands cmd,
+                             int argc,
+                             char *argv[],
+                             uint64_t offset,
+                             ClientSession *session,
+                             void *data,
+                             uint64_t data_len)
 {
-    uint32_t p_len = 0;
+    uint64_t p_len = 0;
     for (int i = 0; i < argc; i++)
         p_len += strlen(argv[i]) + 1;
 
+    if (++next_req_id == 0) next_req_id = 1; // 0 is reserved for failed submissions
+
     helper_request_header req_hdr = {
+        .version = PROTOCOL_VERSION,
         .cmd = cmd,
+        .req_id = next_req_id,
         .argc = argc,
         .payload_len = p_len,
         .offset = offset,
@@ -120,59 +155,147 @@ int sendHelperRequestRW(int helper_fd,
 
     if (session) req_hdr.session = *session;
 
-    if (writeAll(helper_fd, &req_hdr, sizeof(req_hdr)) < 0) return -1;
+    if (writeAll(helper_fd, &req_hdr, sizeof(req_hdr)) < 0) return 0;
 
     for (int i = 0; i < argc; i++)
         if (writeAll(helper_fd, argv[i], strlen(argv[i]) + 1) < 0)
-            return -1;
+            return 0;
 
     if (data_len > 0 && data) {
         if (writeAll(helper_fd, data, data_len) < 0)
-            return -1;
+            return 0;
     }
-    if (readAll(helper_fd, out, sizeof(helper_response)) <= 0)
-        return -1;
+    return req_hdr.req_id;
+}
 
+int awaitHelperResponse(int helper_fd, uint32_t req_id, helper_response *out) {
+    if (req_id == 0 || readAll(helper_fd, out, sizeof(helper_response)) <= 0) {
+        memset(out, 0, sizeof(helper_response));
+        out->status = -1;
+        snprintf(out->msg, sizeof(out->msg), "Internal error: Helper unreachable");
+        return -1;
+    }
+    if (out->version != PROTOCOL_VERSION) {
+        fprintf(stderr, "[Helper channel] Helper speaks protocol version %u, we speak %u\n", out->version, PROTOCOL_VERSION);
+        out->status = -1;
+        snprintf(out->msg, sizeof(out->msg), "Internal error: Helper version mismatch");
+        return -1;
+    }
+    if (out->req_id != req_id) {
+        fprintf(stderr, "[Helper channel] Response %u does not match request %u\n", out->req_id, req_id);
+        out->status = -1;
+        snprintf(out->msg, sizeof(out->msg), "Internal error: Helper out of sync");
+        return -1;
+    }
     return out->status;
 }
 
+int sendHelperRequestRW(int helper_fd,
+                        helper_commands cmd,
+                        int argc,
+                        char *argv[],
+                        uint64_t offset,
+                        ClientSession *session,
+                        void *data,
+                        uint64_t data_len,
+                        helper_response *out)
+{
+    uint32_t req_id = submitHelperRequest(helper_fd, cmd, argc, argv, offset, session, data, data_len);
+    return awaitHelperResponse(helper_fd, req_id, out);
+}
+
 int sendHelperRequest(int helper_fd, helper_commands cmd, int argc, char *argv[], ClientSession *session, helper_response *out) {
-    uint32_t p_len = 0;
-    for (int i = 0; i < argc; i++) {
-        p_len += strlen(argv[i]) + 1;
+    return sendHelperRequestRW(helper_fd, cmd, argc, argv, 0, session, NULL, 0, out);
+}
+
+// one long lived helper connection per session instead of a connect, accept and fork per command
+int helperChannel(ClientSession* session) {
+    if (session->helper_fd >= 0) {
+        // the helper only speaks when asked, a readable idle channel means it died or we lost sync
+        struct pollfd pfd = { .fd = session->helper_fd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) == 0) {
+            return session->helper_fd;
+        }
+        fprintf(stderr, "[Helper channel] Stale channel, reconnecting\n");
+        closeHelperChannel(session);
     }
+    session->helper_fd = connectToHelper();
+    return session->helper_fd;
+}
 
-    helper_request_header req_hdr = {
-        .cmd = cmd,
-        .argc = argc,
-        .payload_len = p_len,
-        .offset = 0,
-    };
-    if (session) req_hdr.session = *session;
+// a worker dedicated to the session dropped root for good, root-only commands take a one-shot pool connection
+int rootHelperChannel(ClientSession* session) {
+    if (session->helper_dedicated) {
+        return connectToHelper();
+    }
+    return helperChannel(session);
+}
 
-    if (writeAll(helper_fd, &req_hdr, sizeof(req_hdr)) < 0) return -1;
+void releaseRootHelperChannel(ClientSession* session, int helper_fd) {
+    if (helper_fd >= 0 && helper_fd != session->helper_fd) {
+        close(helper_fd);
+    }
+}
 
-    for (int i = 0; i < argc; i++) {
-        if (writeAll(helper_fd, argv[i], strlen(argv[i]) + 1) < 0) return -1;
+// the helper hands over the file it opened as the user, one byte carries the SCM_RIGHTS
+int sendFd(int sock, int fd) {
+    char byte = 'F';
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (n != 1) {
+        perror("sendmsg fd");
+        return -1;
     }
-    if (readAll(helper_fd, out, sizeof(helper_response)) <= 0) return -1;
+    return 0;
+}
 
-    return out->status;
+int recvFd(int sock) {
+    char byte;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != 1 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        fprintf(stderr, "[Helper channel] Expected a file descriptor from the helper\n");
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
 }
 
+void closeHelperChannel(ClientSession* session) {
+    if (session->helper_fd >= 0) {
+        close(session->helper_fd);
+    }
+    session->helper_fd = -1;
+    session->helper_dedicated = 0;
+}
 
 int sendProtocolMsg(int fd, msg_type type, uint32_t status, const char* msg) {
-    msg_header resp;
-    resp.type = type;
-    resp.status = status;
-    resp.is_background = 0;
-    resp.payloadLength = strlen(msg) + 1; 
-
-    if (writeAll(fd, &resp, sizeof(resp)) < 0) return -1;
-    if (resp.payloadLength > 0) {
-        if (writeAll(fd, msg, resp.payloadLength) < 0) return -1;
-    }
-    return 0;
+    return sendProtocolMsgBg(fd, type, status, msg, 0);
 }
 int acquire_socket_lock(int fd) {
     struct flock fl = {
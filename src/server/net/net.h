@@ -5,35 +5,45 @@
 #include <sys/types.h>
 #include <stdint.h>   
 #include <semaphore.h>
+#include <time.h>
 
 #include "common/utility.h"
 #include "handler/handlers.h"
 
 
 
-typedef enum {CREATE_USER, LOGIN, CD, LS, CREATE_FILE, CHMOD, DELETE, MOVE, READ, WRITE, DOWNLOAD, UPLOAD, TRANSFER} helper_commands;
+typedef enum {CREATE_USER, LOGIN, CD, LS, CREATE_FILE, CHMOD, DELETE, MOVE, READ, WRITE, DOWNLOAD, UPLOAD, TRANSFER, UPLOAD_COMMIT} helper_commands;
 
 typedef enum {FREE, PENDING, NOTIFIED, REJECTED} TransferStatus;
 
+// a READ or WRITE found the file locked by another stream, the helper does not wait for it
+#define HELPER_LOCKED 1
+
+// both carry PROTOCOL_VERSION, a helper left running over a takeover may be older than the server
 typedef struct {
+    uint32_t version;
     uint32_t cmd;           
+    uint32_t req_id;        // echoed back in the response, lets a session keep several requests in flight
     uint32_t argc;         
-    uint32_t payload_len;   // Total bytes of all strings (including \0)
+    uint64_t payload_len;   // Total bytes of all strings (including \0)
     ClientSession session;  
-    uint32_t offset; // for read/write
-    uint32_t data_len;
+    uint64_t offset; // for read/write
+    uint64_t data_len;
 } helper_request_header;
 
 typedef struct {
-    int32_t status;         // 0 = success, <0 = error
-    uint32_t payload_len;   
+    uint32_t version;
+    int32_t status;         // 0 = success, <0 = error, HELPER_LOCKED
+    uint64_t payload_len;   // a download's is the file size
     char msg[1256];          
     uint32_t cmd;
+    uint32_t req_id;
     union {
         struct {
             uid_t uid;
             gid_t gid;
             char home[4096];
+            uint8_t dedicated;  // the channel now belongs to a worker jailed for this session
         } login;
         struct {
             uint32_t count; 
@@ -61,25 +71,102 @@ typedef struct {
     TransferStatus status; 
 } TransferRequest;
 
+#define MAX_TRANSFER_JOBS 32
+
+typedef enum { JOB_FREE, JOB_RUNNING, JOB_DONE, JOB_FAILED } TransferJobState;
+
+// accepted transfer copied in the background by a child of the receiver's handler. Only that
+// child writes done and rate, it bumps tick and signals both parties at every report. Each of
+// them tells its client whenever tick moved past what it saw, a finished job is freed once
+// both saw its end
+typedef struct {
+    int id;                             // the transfer request's, 0 for a free entry
+    char sender[MAX_USERNAME_LEN];
+    char receiver[MAX_USERNAME_LEN];
+    char filename[FILENAME_SIZE];
+    volatile TransferJobState state;
+    pid_t pid;
+    uint64_t total;
+    volatile uint64_t done;
+    volatile uint64_t rate;             // bytes/s over the last report
+    uint64_t started_ms;                // CLOCK_MONOTONIC
+    volatile uint32_t tick;
+    uint32_t seen_sender, seen_receiver;
+    char msg[128];                      // how it ended
+} TransferJob;
+
+#define MAX_HELPER_WORKERS 64
+
+typedef enum { HELPER_SLOT_FREE, HELPER_IDLE, HELPER_BUSY, HELPER_RETIRING } HelperSlotState;
+
+// scoreboard of the helper pool, each worker only writes its own slot
+typedef struct {
+    pid_t pid;
+    pid_t master;                   // helper that spawned it, two coexist while a takeover drains
+    volatile HelperSlotState state;
+    volatile uint32_t channels;     // session channels attached to this worker
+    volatile uint32_t requests;     // commands served since spawn
+    volatile time_t busy_since;     // start of the command being served
+} HelperWorkerSlot;
+
+#define MAX_ADMITTED 1024
+
+typedef enum { ADMIT_FREE, ADMIT_SESSION, ADMIT_TRANSFER } AdmissionKind;
+
+// a session or transfer let in by admission control, held until the process serving it is done
+typedef struct {
+    AdmissionKind kind;
+    pid_t pid;          // process serving it, a slot whose pid is gone gets reclaimed
+    uint32_t addr;      // client IPv4 address, network byte order
+    char user[MAX_USERNAME_LEN]; // owner of a transfer, for the per-user limit
+} AdmissionSlot;
+
+#define MAX_QUEUED 64
+
+// a transfer over the limits waits here for its turn, the session holding it keeps the command
+typedef struct {
+    uint32_t ticket;    // order of arrival, 0 for a free entry
+    pid_t pid;          // process holding the session, woken with SIGUSR1 when a transfer ends
+    int priority;       // 0 foreground, 1 background: nobody sits waiting for the latter
+    char user[MAX_USERNAME_LEN];
+} QueuedTransfer;
+
 typedef struct {
     UserEntry online_users[MAX_USERS];
     TransferRequest pending[MAX_TRANSFERS];
+    TransferJob jobs[MAX_TRANSFER_JOBS];
     unsigned int global_id_counter;
+    HelperWorkerSlot helper_pool[MAX_HELPER_WORKERS];
+    AdmissionSlot admitted[MAX_ADMITTED];
+    QueuedTransfer queued[MAX_QUEUED];
+    uint32_t next_ticket;
     sem_t mux; 
 } SharedRegistry;
 
 extern SharedRegistry* registry;
 
+uint32_t submitHelperRequest(int helper_fd,
+                             helper_commands cmd,
+                             int argc,
+                             char *argv[],
+                             uint64_t offset,
+                             ClientSession *session,
+                             void *data,
+                             uint64_t data_len);
+int awaitHelperResponse(int helper_fd, uint32_t req_id, helper_response *out);
 int sendHelperRequestRW(int helper_fd,
                         helper_commands cmd,
                         int argc,
                         char *argv[],
-                        int offset,
+                        uint64_t offset,
                         ClientSession *session,
                         void *data,
-                        uint32_t data_len,
+                        uint64_t data_len,
                         helper_response *out);
 
+extern uint32_t current_req_id;
+
+int sendProtocolFrame(int fd, msg_header* hdr, const void* payload);
 int sendProtocolMsgBg(int fd, msg_type type, uint32_t status, const char* msg, int is_bg);
 int sendProtocolMsg(int fd, msg_type type, uint32_t status, const char* msg);
 int sendProtocolMsgLocked(int fd, msg_type type, uint32_t status, const char* msg, int is_bg);
@@ -88,5 +175,12 @@ int release_socket_lock(int fd);
 int sendHelperRequest(int helper_fd, helper_commands cmd, int argc, char *argv[], ClientSession *session, helper_response *out);
 int sendMessage(int fd, const char* msg);
 int createUnixSocket(const char* root_dir, gid_t groupId);
+int publishHelperSocket(const char* root_dir);
 int connectToHelper();
+int helperChannel(ClientSession* session);
+int rootHelperChannel(ClientSession* session);
+void releaseRootHelperChannel(ClientSession* session, int helper_fd);
+void closeHelperChannel(ClientSession* session);
+int sendFd(int sock, int fd);
+int recvFd(int sock);
 #endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+// copy engine of accepted transfers: reflink, then copy_file_range, then a big buffer. Each one
+// takes over from where the previous one gave up, so a fallback never copies a byte twice
+
+#define _GNU_SOURCE
+
+#include "utils/copy.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define RANGE_CHUNK (1 << 26)   // per copy_file_range call, small enough for progress to keep moving
+#define COPY_BUFFER_SIZE (1 << 20)
+
+// what copy_file_range answers when the files or the kernel cannot do it, not an I/O failure
+static int rangeUnsupported(int err) {
+    return err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EINVAL || err == EBADF;
+}
+
+// dest_fd must be empty. copied gets the bytes now in it, method what moved them. progress may be NULL
+int copyFileData(int src_fd, int dest_fd, uint64_t* copied, CopyMethod* method, CopyProgress progress, void* arg) {
+    struct stat st;
+    *copied = 0;
+    if (fstat(src_fd, &st) < 0) return -1;
+
+    // same filesystem and one sharing extents (btrfs, XFS): the blocks are shared, none is copied
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+        *method = COPY_REFLINK;
+        *copied = st.st_size;
+        if (progress) progress(*copied, arg);
+        return 0;
+    }
+
+    *method = COPY_RANGE;
+    loff_t in = 0, out = 0;
+    for (;;) {
+        ssize_t n = copy_file_range(src_fd, &in, dest_fd, &out, RANGE_CHUNK, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && !rangeUnsupported(errno)) return -1;
+        if (n <= 0) break; // the end, or the buffer finds out whether it really is
+        *copied += n;
+        if (progress) progress(*copied, arg);
+    }
+
+    char* buf = malloc(COPY_BUFFER_SIZE);
+    if (!buf) return -1;
+    int ret = -1;
+    off_t off = in;
+    for (;;) {
+        ssize_t n = pread(src_fd, buf, COPY_BUFFER_SIZE, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) goto out;
+        if (n == 0) break;
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = pwrite(dest_fd, buf + done, n - done, off + done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) goto out;
+            done += w;
+        }
+        off += n;
+        *copied += n;
+        *method = COPY_BUFFER;
+        if (progress) progress(*copied, arg);
+    }
+    ret = 0;
+out:
+    free(buf);
+    return ret;
+}
+
+const char* copyMethodName(CopyMethod method) {
+    switch (method) {
+        case COPY_REFLINK: return "reflink";
+        case COPY_RANGE: return "copy_file_range";
+        default: return "buffered copy";
+    }
+}
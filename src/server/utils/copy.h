@@ -0,0 +1,17 @@
+// copies a whole file inside the kernel when the filesystem lets us: a reflink shares the blocks,
+// copy_file_range moves them without a trip through userspace, a big buffer does it otherwise
+
+#ifndef COPY_H
+#define COPY_H
+
+#include <stdint.h>
+
+typedef enum { COPY_REFLINK, COPY_RANGE, COPY_BUFFER } CopyMethod;
+
+// called after every step of a copy with the bytes copied so far
+typedef void (*CopyProgress)(uint64_t copied, void* arg);
+
+int copyFileData(int src_fd, int dest_fd, uint64_t* copied, CopyMethod* method, CopyProgress progress, void* arg);
+const char* copyMethodName(CopyMethod method);
+
+#endif
@@ -0,0 +1,272 @@
+// dirfd based sandbox: the helper never leaves the real root, client paths are resolved beneath
+// the user's home by the kernel and permission checks run under the user's fs credentials.
+// Both are per thread, so unlike chroot + seteuid one process can serve many users at once
+
+#define _GNU_SOURCE
+
+#include "utils/sandbox.h"
+#include "utils/utils.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <grp.h>
+#include <limits.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#define HOME_CACHE_SIZE 16
+
+typedef struct {
+    uid_t uid;
+    char home[ABS_PATH];    // empty for an unused slot
+    int fd;                 // O_PATH fd of home, the root every client path resolves in
+} HomeRoot;
+
+static SandboxMode sandbox_mode = SANDBOX_CHROOT;
+
+// fs credentials are per thread, so is the cache of the homes the thread resolves in
+static __thread HomeRoot home_cache[HOME_CACHE_SIZE];
+static __thread int home_cache_next = 0;
+
+int initPathSandbox(SandboxMode mode) {
+    sandbox_mode = mode;
+    if (mode != SANDBOX_OPENAT2) {
+        return 0;
+    }
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+    how.resolve = RESOLVE_IN_ROOT;
+    int fd = syscall(SYS_openat2, AT_FDCWD, "/", &how, sizeof(how));
+    if (fd < 0) {
+        perror("openat2 not available");
+        return -1;
+    }
+    close(fd);
+    // only fsuid/fsgid are switched per request, root's supplementary groups would still count
+    if (setgroups(0, NULL) != 0) {
+        perror("setgroups");
+        return -1;
+    }
+    printf("[Sandbox] Resolving client paths with openat2(RESOLVE_IN_ROOT)\n");
+    return 0;
+}
+
+// a session worker already sits in a chroot of its own, plain paths are right there
+bool usesResolveInRoot() {
+    return sandbox_mode == SANDBOX_OPENAT2 && !isSandboxLocked();
+}
+
+static int homeFd(const ClientSession* session) {
+    for (int i = 0; i < HOME_CACHE_SIZE; i++) {
+        HomeRoot* h = &home_cache[i];
+        if (h->home[0] != '\0' && h->uid == session->uid && strcmp(h->home, session->home) == 0) {
+            return h->fd;
+        }
+    }
+    int fd = open(session->home, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open home");
+        return -1;
+    }
+    HomeRoot* h = &home_cache[home_cache_next];
+    home_cache_next = (home_cache_next + 1) % HOME_CACHE_SIZE;
+    if (h->home[0] != '\0') {
+        close(h->fd);
+    }
+    h->uid = session->uid;
+    h->fd = fd;
+    snprintf(h->home, sizeof(h->home), "%s", session->home);
+    return fd;
+}
+
+int enterFsCreds(const ClientSession* session) {
+    // home is opened as root, like the chroot it replaces
+    if (homeFd(session) < 0) {
+        return -1;
+    }
+    // leaving fsuid 0 also drops the fs capabilities, the user's own permissions apply
+    setfsgid(session->gid);
+    setfsuid(session->uid);
+    if ((uid_t)setfsuid(-1) != session->uid || (gid_t)setfsgid(-1) != session->gid) {
+        fprintf(stderr, "[Sandbox] Cannot switch fs credentials to %d:%d\n", session->uid, session->gid);
+        leaveFsCreds();
+        return -1;
+    }
+    return 0;
+}
+
+int leaveFsCreds() {
+    setfsuid(geteuid());
+    setfsgid(getegid());
+    if ((uid_t)setfsuid(-1) != geteuid() || (gid_t)setfsgid(-1) != getegid()) {
+        fprintf(stderr, "[Sandbox] Cannot restore fs credentials\n");
+        return -1;
+    }
+    return 0;
+}
+
+// client paths are relative to the session workdir, which is itself relative to home
+static int joinWorkdir(const ClientSession* session, const char* path, char* full, size_t len) {
+    int n;
+    if (path[0] == '/') {
+        n = snprintf(full, len, "%s", path);
+    } else {
+        n = snprintf(full, len, "%s/%s", session->workdir, path);
+    }
+    if (n < 0 || (size_t)n >= len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int resolveInHome(const ClientSession* session, const char* full, int flags, mode_t mode) {
+    int root = homeFd(session);
+    if (root < 0) {
+        return -1;
+    }
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.mode = (flags & O_CREAT) ? mode : 0;
+    // ".." and absolute symlinks stop at home, /proc style links are refused
+    how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+    return syscall(SYS_openat2, root, full, &how, sizeof(how));
+}
+
+int sandboxOpen(const ClientSession* session, const char* path, int flags, mode_t mode) {
+    if (!usesResolveInRoot()) {
+        return open(path, flags, mode);
+    }
+    char full[PATH_MAX];
+    if (joinWorkdir(session, path, full, sizeof(full)) < 0) {
+        return -1;
+    }
+    return resolveInHome(session, full, flags, mode);
+}
+
+int sandboxStat(const ClientSession* session, const char* path, struct stat* st) {
+    if (!usesResolveInRoot()) {
+        return stat(path, st);
+    }
+    int fd = sandboxOpen(session, path, O_PATH, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = fstat(fd, st);
+    close(fd);
+    return ret;
+}
+
+int sandboxLockFile(const ClientSession* session, const char* path, LockType type) {
+    if (!usesResolveInRoot()) {
+        return lock_file(path, type);
+    }
+    int fd = sandboxOpen(session, path, (type == LOCK_EXCLUSIVE) ? O_RDWR : O_RDONLY, 0);
+    if (fd < 0) {
+        perror("open for locking");
+        return -1;
+    }
+    if (lock_fd(fd, type) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// dirfd of the directory holding path, for the *at calls acting on the entry itself.
+// The last component is copied to name, AT_FDCWD and the whole path in chroot mode
+int sandboxParent(const ClientSession* session, const char* path, char* name, size_t len) {
+    if (!usesResolveInRoot()) {
+        if ((size_t)snprintf(name, len, "%s", path) >= len) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        return AT_FDCWD;
+    }
+    char full[PATH_MAX];
+    if (joinWorkdir(session, path, full, sizeof(full)) < 0) {
+        return -1;
+    }
+    size_t n = strlen(full);
+    while (n > 1 && full[n - 1] == '/') {
+        full[--n] = '\0';
+    }
+    char* slash = strrchr(full, '/');
+    const char* base = slash + 1;
+    // "." and ".." are no entry of their own, an *at call on them would act on another directory
+    if (*base == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (strlen(base) >= len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(name, base);
+    if (slash == full) {
+        slash[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+    return resolveInHome(session, full, O_PATH | O_DIRECTORY, 0);
+}
+
+// resolves . and .. by name like a shell does, ".." of the home is the home itself
+static int normalizePath(const char* in, char* out, size_t len) {
+    size_t n = 0;
+    out[0] = '\0';
+    const char* p = in;
+    while (*p) {
+        while (*p == '/') p++;
+        if (*p == '\0') break;
+        const char* end = strchrnul(p, '/');
+        size_t seg = end - p;
+        if (seg == 2 && p[0] == '.' && p[1] == '.') {
+            char* last = strrchr(out, '/');
+            if (last) *last = '\0';
+            n = strlen(out);
+        } else if (!(seg == 1 && p[0] == '.')) {
+            if (n + seg + 2 > len) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            out[n++] = '/';
+            memcpy(out + n, p, seg);
+            n += seg;
+            out[n] = '\0';
+        }
+        p = end;
+    }
+    if (n == 0) {
+        snprintf(out, len, "/");
+    }
+    return 0;
+}
+
+int sandboxChdir(const ClientSession* session, const char* path, char* newcwd, size_t len) {
+    if (!usesResolveInRoot()) {
+        if (chdir(path) == -1) {
+            return -1;
+        }
+        return getcwd(newcwd, len) ? 0 : -1;
+    }
+    // the workdir only lives in the session, check it names a directory the user may enter
+    char full[PATH_MAX];
+    if (joinWorkdir(session, path, full, sizeof(full)) < 0 ||
+        normalizePath(full, newcwd, len) < 0) {
+        return -1;
+    }
+    int fd = resolveInHome(session, newcwd, O_PATH | O_DIRECTORY, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = faccessat(fd, ".", X_OK, AT_EACCESS);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,29 @@
+// path resolution for helper handlers. In chroot mode these are the plain calls made after
+// sandboxUserToHisHome(), in openat2 mode every client path is resolved beneath an O_PATH fd
+// of the user's home with RESOLVE_IN_ROOT, so no process wide chroot is needed
+
+#ifndef SANDBOX_H
+#define SANDBOX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common/utility.h"
+#include "handler/handlers.h"
+
+typedef enum { SANDBOX_CHROOT, SANDBOX_OPENAT2 } SandboxMode;
+
+int initPathSandbox(SandboxMode mode);
+bool usesResolveInRoot();
+int enterFsCreds(const ClientSession* session);
+int leaveFsCreds();
+
+int sandboxOpen(const ClientSession* session, const char* path, int flags, mode_t mode);
+int sandboxStat(const ClientSession* session, const char* path, struct stat* st);
+int sandboxLockFile(const ClientSession* session, const char* path, LockType type);
+int sandboxParent(const ClientSession* session, const char* path, char* name, size_t len);
+int sandboxChdir(const ClientSession* session, const char* path, char* newcwd, size_t len);
+
+#endif
@@ -6,6 +6,7 @@
 
 #include "net/net.h"
 #include "utils/utils.h"    
+#include "utils/sandbox.h"
 
 #include <grp.h>            // Required for initgroups()
 #include <fcntl.h>          // Required for open(), fcntl(), and F_WRLCK
@@ -98,17 +99,95 @@ int dropPrivilegesTemp(const ClientSession *cs) {
     return 0;
 }
 
+// fd on the real filesystem root, kept open so a chrooted helper can step back out of the jail
+static int real_root_fd = -1;
+
+// set once a session worker jailed itself for good, sandboxing is then just a chdir
+static bool sandbox_locked = false;
+static uid_t sandbox_uid;
+
+int initSandboxRoot() {
+    real_root_fd = open("/", O_RDONLY | O_DIRECTORY);
+    if (real_root_fd < 0) {
+        perror("open real root");
+        return -1;
+    }
+    return 0;
+}
+
 int regainRoot() {
+    if (sandbox_locked) {
+        return 0; // nothing to regain, the worker stays the user until it exits
+    }
+    if (usesResolveInRoot()) {
+        return leaveFsCreds();
+    }
     if (seteuid(0) != 0 || setegid(0) != 0) {
         perror("Failed to regain root");
         return -1;
     }
+    // leave the user's chroot, the same helper serves the next command of the session
+    if (real_root_fd >= 0) {
+        if (fchdir(real_root_fd) != 0 || chroot(".") != 0) {
+            perror("Failed to leave chroot");
+            return -1;
+        }
+    }
 
     printf("Privileges regained as root\n");
     return 0;
 }
 
+// chroot, group lookup and credential switch paid once per login instead of once per command
+int lockSessionSandbox(const char* username, uid_t uid, gid_t gid, const char* home) {
+    // an fd outside the jail would let the user walk back out of it
+    if (real_root_fd >= 0) {
+        close(real_root_fd);
+        real_root_fd = -1;
+    }
+    if (chroot(home) == -1 || chdir("/") == -1) {
+        perror("session chroot");
+        return -1;
+    }
+    if (initgroups(username, gid) != 0) {
+        perror("initgroups");
+        return -1;
+    }
+    // real and saved ids too, there is no way back to root from here
+    if (setgid(gid) != 0 || setuid(uid) != 0) {
+        perror("session setuid");
+        return -1;
+    }
+    sandbox_locked = true;
+    sandbox_uid = uid;
+    printf("Session worker locked to user: %s\n", username);
+    return 0;
+}
+
+bool isSandboxLocked() {
+    return sandbox_locked;
+}
+
+// already jailed in the right home, only the session's workdir has to be applied
+static int enterLockedSandbox(const ClientSession* session) {
+    if (session->uid != sandbox_uid) {
+        fprintf(stderr, "Session worker of uid %d got a request for uid %d\n", sandbox_uid, session->uid);
+        return -1;
+    }
+    if (chdir(session->workdir) == -1) {
+        perror("chdir");
+        return -1;
+    }
+    return 0;
+}
+
 int sandboxUserToHisHome(const ClientSession* session){
+    if (sandbox_locked) {
+        return enterLockedSandbox(session);
+    }
+    if (usesResolveInRoot()) {
+        return enterFsCreds(session);
+    }
     printf("Session home:%s\n", session->home);
     if (chroot(session->home) == -1) {
         perror("chroot");
@@ -116,14 +195,23 @@ int sandboxUserToHisHome(const ClientSession* session){
     }
     if (chdir(session->workdir) == -1) {
         perror("chdir");
+        regainRoot();
         return -1;
     }
     if (dropPrivilegesTemp(session) == -1) {
+        regainRoot();
         return -1;
     }
     return 0;
 }
 int sandboxUserToRoot(const ClientSession* session, char* rootdir){
+    if (sandbox_locked) {
+        // the jail is the home, paths above it are out of reach
+        return enterLockedSandbox(session);
+    }
+    if (usesResolveInRoot()) {
+        return enterFsCreds(session); // same here, paths resolve beneath home
+    }
     if (chroot(rootdir) == -1) {
         perror("chroot");
         return -1;
@@ -136,9 +224,11 @@ int sandboxUserToRoot(const ClientSession* session, char* rootdir){
     
     if (chdir(realPath) == -1) {
         perror("chdir");
+        regainRoot();
         return -1;
     }
     if (dropPrivilegesTemp(session) == -1) {
+        regainRoot();
         return -1;
     }
     return 0;
@@ -14,7 +14,10 @@ bool isUsernameValid(char* username);
 int createUserDirectory(const char* pathname, uid_t uid, gid_t gid, mode_t mode);
 
 int dropPrivilegesTemp(const ClientSession *cs);
+int initSandboxRoot();
 int regainRoot();
+int lockSessionSandbox(const char* username, uid_t uid, gid_t gid, const char* home);
+bool isSandboxLocked();
 
 int sandboxUserToHisHome(const ClientSession* session);
 int sandboxUserToRoot(const ClientSession* session, char* rootdir);